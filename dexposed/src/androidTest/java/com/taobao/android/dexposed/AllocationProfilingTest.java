@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.taobao.android.dexposed;
+
+import android.test.AndroidTestCase;
+
+import java.io.BufferedReader;
+import java.io.File;
+import java.io.FileReader;
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.List;
+
+public class AllocationProfilingTest extends AndroidTestCase {
+
+	static class Allocated {
+		final int value;
+
+		Allocated() {
+			this(1);
+		}
+
+		Allocated(int value) {
+			this.value = value;
+		}
+	}
+
+	static class Constructed {
+		int value;
+
+		Constructed(int value) {
+			this.value = value;
+		}
+	}
+
+	private static Allocated allocate(int value) {
+		return value == 0 ? new Allocated() : new Allocated(value);
+	}
+
+	@Override
+	protected void setUp() throws Exception {
+		super.setUp();
+		assertTrue("dexposed is not supported on this device", DexposedBridge.canDexposed(getContext()));
+	}
+
+	public void testProfileAllocationsDumpsSites() throws IOException {
+		DexposedBridge.startAllocationProfiling(64);
+		DexposedBridge.profileAllocations(Allocated.class, 1);
+		for (int i = 0; i < 10; i++)
+			assertNotNull(allocate(i % 2));
+
+		File dump = new File(getContext().getCacheDir(), "allocations.txt");
+		int sites = DexposedBridge.dumpAllocations(dump.getPath());
+		List<String> lines = readLines(dump);
+		assertTrue("no allocation sites were written", sites > 0);
+		assertEquals(sites, lines.size());
+
+		// this(...) is not counted twice, all ten instances come from allocate()
+		int counted = 0;
+		for (String line : lines) {
+			String[] fields = line.split("\t");
+			assertEquals(line, 3, fields.length);
+			if (fields[1].endsWith("Allocated") && fields[2].contains("allocate"))
+				counted += Integer.parseInt(fields[0]);
+		}
+		assertEquals(10, counted);
+	}
+
+	public void testHookConstructor() throws NoSuchMethodException {
+		DexposedBridge.hookMethod(Constructed.class.getDeclaredConstructor(int.class), new XC_MethodHook() {
+			@Override
+			protected void beforeHookedMethod(MethodHookParam param) throws Throwable {
+				param.args[0] = (Integer) param.args[0] + 1;
+			}
+		});
+		assertEquals(2, new Constructed(1).value);
+	}
+
+	private static List<String> readLines(File file) throws IOException {
+		List<String> lines = new ArrayList<String>();
+		BufferedReader reader = new BufferedReader(new FileReader(file));
+		try {
+			String line;
+			while ((line = reader.readLine()) != null)
+				lines.add(line);
+		} finally {
+			reader.close();
+		}
+		return lines;
+	}
+}
@@ -22,9 +22,11 @@ import static com.taobao.android.dexposed.XposedHelpers.getIntField;
 
 import java.lang.reflect.AccessibleObject;
 import java.lang.reflect.Constructor;
+import java.lang.reflect.Field;
 import java.lang.reflect.InvocationTargetException;
 import java.lang.reflect.Member;
 import java.lang.reflect.Method;
+import java.lang.reflect.Modifier;
 import java.util.ArrayList;
 import java.util.Arrays;
 import java.util.HashMap;
@@ -49,6 +51,21 @@ public final class DexposedBridge {
 	private static final int RUNTIME_DALVIK = 1;
 	private static final int RUNTIME_ART = 2;
 	private static int runtime = RUNTIME_UNKNOW;
+
+	// must match DexposedBootstrapPhase in dexposed_bootstrap.h
+	/** Loading the library, which only registers the native methods. */
+	public static final int INIT_PHASE_LOAD = 0;
+	/** Reading the device properties. */
+	public static final int INIT_PHASE_DEVICE_INFO = 1;
+	/** Detecting the offsets of runtime structures. */
+	public static final int INIT_PHASE_MEMBER_OFFSETS = 2;
+	/** Patching the access checks of the runtime. */
+	public static final int INIT_PHASE_ACCESS_PATCHES = 3;
+	/** Looking up the methods and fields which hooked methods use. */
+	public static final int INIT_PHASE_RESOLVE_METHODS = 4;
+
+	private static boolean lazyInit = false;
+	private static volatile boolean initialized = false;
 	
 	private static final Object[] EMPTY_ARRAY = new Object[0];
 	public static final ClassLoader BOOTCLASSLOADER = ClassLoader.getSystemClassLoader();
@@ -60,6 +77,62 @@ public final class DexposedBridge {
 	
 	private static final ArrayList<XC_MethodHook.Unhook> allUnhookCallbacks = new ArrayList<XC_MethodHook.Unhook>();
 
+	/** Stay in pass-through mode until {@link #rearmHookBudget} is called. */
+	public static final int BUDGET_REARM_MANUAL = 0;
+	/** Dispatch to the callbacks again once the cooldown has passed. */
+	public static final int BUDGET_REARM_AFTER_COOLDOWN = 1;
+
+	private static volatile HookBudgetListener hookBudgetListener;
+
+	/** Calls made from callback code are dispatched to the callbacks like other calls. */
+	public static final int NESTED_DISPATCH = 0;
+	/** Calls made from callback code go directly to the original method. */
+	public static final int NESTED_PASS_THROUGH = 1;
+
+	// must match DexposedThreadFilter in dexposed_hook_control.h
+	/** Calls on every thread are dispatched. */
+	public static final int THREAD_FILTER_ALL = 0;
+	/** Only calls on the main thread are dispatched. */
+	public static final int THREAD_FILTER_MAIN = 1;
+	/** Only calls on other threads than the main thread are dispatched. */
+	public static final int THREAD_FILTER_BACKGROUND = 2;
+	/** Only calls on the threads passed to {@link #setHookThreadFilter(Member, int[])} are dispatched. */
+	public static final int THREAD_FILTER_TIDS = 3;
+	/** Only calls on threads which called {@link #setThreadOptIn} are dispatched. */
+	public static final int THREAD_FILTER_OPT_IN = 4;
+	// must match DEXPOSED_MAX_FILTER_TIDS
+	private static final int MAX_FILTER_TIDS = 8;
+
+	// must match DEXPOSED_MAX_HOOK_GROUPS in dexposed_hook_control.h
+	private static final int MAX_HOOK_GROUPS = 256;
+	private static final Map<String, Integer> hookGroups = new HashMap<String, Integer>();
+	private static final Set<String> disabledHookGroups = new HashSet<String>();
+
+	// indexed by coverage id, null for ids which were handed out to a method that could not be counted
+	private static final ArrayList<Member> coveredMethods = new ArrayList<Member>();
+	private static final Map<Member, Integer> coverageIds = new HashMap<Member, Integer>();
+
+	/** Calls for asynchronous hooks which find the queue full are dropped. */
+	public static final int ASYNC_OVERFLOW_DROP = 0;
+	/** Calls for asynchronous hooks wait until the queue has room again. */
+	public static final int ASYNC_OVERFLOW_BLOCK = 1;
+
+	// must match DexposedDispatchMode in dexposed_hook_control.h
+	private static final int DISPATCH_SYNC = 0;
+	private static final int DISPATCH_SYNC_AND_ASYNC = 1;
+	private static final int DISPATCH_ASYNC_ONLY = 2;
+	private static final int DISPATCH_NONE = 3;
+
+	// constructors hooked by profileAllocations(), they call nothing while they have no callbacks
+	private static final Set<Member> allocationProfiledConstructors = new HashSet<Member>();
+
+	// methods of the published patch set, their calls always go through Java to run its callbacks
+	private static final Set<Member> patchedMethods = new HashSet<Member>();
+
+	private static int asyncQueueCapacity = 1024;
+	private static int asyncOverflowPolicy = ASYNC_OVERFLOW_DROP;
+	private static Thread asyncWorker;
+
 	
 	private static int getRuntime() {
 
@@ -76,6 +149,21 @@ public final class DexposedBridge {
 		}
 	}
 
+	private static int getMethodSlot(Member method) {
+		if(runtime == RUNTIME_UNKNOW)  runtime = getRuntime();
+		return (runtime == RUNTIME_DALVIK) ? (int) getIntField(method, "slot") : 0;
+	}
+
+	// a hooked native method would stop being native on ART while calls may still be in its JNI
+	// stub, its JNI function can be hooked instead
+	private static void checkHookable(Member method) {
+		if (!(method instanceof Method) && !(method instanceof Constructor<?>))
+			throw new IllegalArgumentException("only methods and constructors can be hooked");
+		if(runtime == RUNTIME_UNKNOW)  runtime = getRuntime();
+		if (runtime == RUNTIME_ART && Modifier.isNative(method.getModifiers()))
+			throw new IllegalArgumentException("native methods cannot be hooked on ART, see hookJniFunction(): " + method);
+	}
+
 	/**
 	 * Writes a message to BASE_DIR/log/debug.log (needs to have chmod 777)
 	 * @param text log message
@@ -94,15 +182,17 @@ public final class DexposedBridge {
 	}
 
 	/**
-	 * Hook any method with the specified callback
+	 * Hook any method with the specified callback. Native methods cannot be hooked on ART, their
+	 * JNI function can be hooked with {@link #hookJniFunction}.
 	 * 
 	 * @param hookMethod The method to be hooked
 	 * @param callback 
 	 */
 	public static XC_MethodHook.Unhook hookMethod(Member hookMethod, XC_MethodHook callback) {
-		if (!(hookMethod instanceof Method) && !(hookMethod instanceof Constructor<?>)) {
-			throw new IllegalArgumentException("only methods and constructors can be hooked");
-		}
+		checkHookable(hookMethod);
+		ensureInit();
+		if (callback instanceof XC_MethodAsyncHook)
+			startAsyncWorker();
 		
 		boolean newMethod = false;
 		CopyOnWriteSortedSet<XC_MethodHook> callbacks;
@@ -117,22 +207,10 @@ public final class DexposedBridge {
 		callbacks.add(callback);
 		if (newMethod) {
 			Class<?> declaringClass = hookMethod.getDeclaringClass();
-			if(runtime == RUNTIME_UNKNOW)  runtime = getRuntime();
-			int slot = (runtime == RUNTIME_DALVIK) ? (int) getIntField(hookMethod, "slot") : 0;
-
-			Class<?>[] parameterTypes;
-			Class<?> returnType;
-			if (hookMethod instanceof Method) {
-				parameterTypes = ((Method) hookMethod).getParameterTypes();
-				returnType = ((Method) hookMethod).getReturnType();
-			} else {
-				parameterTypes = ((Constructor<?>) hookMethod).getParameterTypes();
-				returnType = null;
-			}
-
-			AdditionalHookInfo additionalInfo = new AdditionalHookInfo(callbacks, parameterTypes, returnType);
-			hookMethodNative(hookMethod, declaringClass, slot, additionalInfo);
+			int slot = getMethodSlot(hookMethod);
+			hookMethodNative(hookMethod, declaringClass, slot, newAdditionalHookInfo(hookMethod, callbacks));
 		}
+		updateDispatchMode(hookMethod, callbacks);
 		return callback.new Unhook(hookMethod);
 	}
 	
@@ -149,6 +227,1029 @@ public final class DexposedBridge {
 				return;
 		}	
 		callbacks.remove(callback);
+		updateDispatchMode(hookMethod, callbacks);
+	}
+
+	/**
+	 * Removes all callbacks of a hooked method and gives it its original code back. The native
+	 * data of the hook is freed once no call uses it anymore, see {@link #reclaimRemovedHooks},
+	 * the settings of the hook (sampling, budget, memoization, ...) go with it. Must not be
+	 * called while another thread changes the settings of the same method.
+	 *
+	 * @return <code>false</code> if the method was not hooked
+	 */
+	public static boolean removeHook(Member hookMethod) {
+		synchronized (hookedMethodCallbacks) {
+			hookedMethodCallbacks.remove(hookMethod);
+		}
+		synchronized (allocationProfiledConstructors) {
+			allocationProfiledConstructors.remove(hookMethod);
+		}
+		return removeHookNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod));
+	}
+
+	/**
+	 * Frees the native data of removed hooks which were still in use when they were removed.
+	 *
+	 * @return Number of removed hooks which are still in use
+	 */
+	public static int reclaimRemovedHooks() {
+		return reclaimRemovedHooksNative();
+	}
+
+	/**
+	 * @return <code>{ bytes, global references }</code> held by a hooked method, or <code>null</code>
+	 *         if it is not hooked. Objects which are only reachable through the hook, like the
+	 *         backup of the method on ART, are counted in the bytes.
+	 */
+	public static int[] getHookMemoryUsage(Member hookMethod) {
+		return getHookMemoryUsageNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod));
+	}
+
+	/**
+	 * @return <code>{ hooks, bytes, global references, removed hooks not freed yet }</code> of all
+	 *         hooks, removed hooks are counted until they are freed
+	 */
+	public static int[] getMemoryUsage() {
+		return getMemoryUsageNative();
+	}
+
+	private static AdditionalHookInfo newAdditionalHookInfo(Member hookMethod, CopyOnWriteSortedSet<XC_MethodHook> callbacks) {
+		Class<?>[] parameterTypes;
+		Class<?> returnType;
+		if (hookMethod instanceof Method) {
+			parameterTypes = ((Method) hookMethod).getParameterTypes();
+			returnType = ((Method) hookMethod).getReturnType();
+		} else {
+			parameterTypes = ((Constructor<?>) hookMethod).getParameterTypes();
+			returnType = null;
+		}
+		return new AdditionalHookInfo(hookMethod, callbacks, parameterTypes, returnType);
+	}
+
+	/**
+	 * Replace the callbacks of the methods in <code>patchSet</code> all at once. Every call
+	 * which starts afterwards runs the callbacks of the new set, a call never sees callbacks of
+	 * two different sets. Methods which are not hooked yet are hooked, methods of the previous
+	 * set which are not in the new one go back to the callbacks added with {@link #hookMethod}.
+	 * The native data of the previous set is freed once no thread can be using it anymore.
+	 *
+	 * @param patchSet The callbacks to publish, <code>null</code> removes the current set
+	 * @return The version of the published set, it increases with every call
+	 */
+	public static synchronized int publishHookPatchSet(HookPatchSet patchSet) {
+		Set<Member> previousMethods;
+		synchronized (patchedMethods) {
+			previousMethods = new HashSet<Member>(patchedMethods);
+		}
+		if (patchSet == null) {
+			int version = publishPatchSetNative(null, null, null, null);
+			unpatchMethods(previousMethods);
+			return version;
+		}
+		ensureInit();
+
+		// the methods of the new set are dispatched in a mode which looks the set up before it is
+		// published, the others only leave that mode once it is published
+		synchronized (patchedMethods) {
+			patchedMethods.addAll(patchSet.callbacks.keySet());
+		}
+
+		int count = patchSet.callbacks.size();
+		Member[] methods = new Member[count];
+		Class<?>[] declaringClasses = new Class<?>[count];
+		int[] slots = new int[count];
+		Object[] additionalInfos = new Object[count];
+		int i = 0;
+		for (Map.Entry<Member, CopyOnWriteSortedSet<XC_MethodHook>> entry : patchSet.callbacks.entrySet()) {
+			Member hookMethod = entry.getKey();
+			boolean newMethod = false;
+			CopyOnWriteSortedSet<XC_MethodHook> callbacks;
+			synchronized (hookedMethodCallbacks) {
+				callbacks = hookedMethodCallbacks.get(hookMethod);
+				if (callbacks == null) {
+					callbacks = new CopyOnWriteSortedSet<XC_MethodHook>();
+					hookedMethodCallbacks.put(hookMethod, callbacks);
+					newMethod = true;
+				}
+			}
+			methods[i] = hookMethod;
+			declaringClasses[i] = hookMethod.getDeclaringClass();
+			slots[i] = getMethodSlot(hookMethod);
+			if (newMethod)
+				hookMethodNative(hookMethod, declaringClasses[i], slots[i], newAdditionalHookInfo(hookMethod, callbacks));
+			updateDispatchMode(hookMethod, callbacks);
+			additionalInfos[i] = newAdditionalHookInfo(hookMethod, entry.getValue());
+			i++;
+		}
+
+		int version = publishPatchSetNative(methods, declaringClasses, slots, additionalInfos);
+		if (version == 0) {
+			Set<Member> addedMethods = new HashSet<Member>(patchSet.callbacks.keySet());
+			addedMethods.removeAll(previousMethods);
+			unpatchMethods(addedMethods);
+			throw new IllegalStateException("could not publish the patch set");
+		}
+		previousMethods.removeAll(patchSet.callbacks.keySet());
+		unpatchMethods(previousMethods);
+		return version;
+	}
+
+	/**
+	 * Dispatch methods which are no longer in the published patch set by their own callbacks.
+	 */
+	private static void unpatchMethods(Set<Member> methods) {
+		synchronized (patchedMethods) {
+			patchedMethods.removeAll(methods);
+		}
+		for (Member hookMethod : methods) {
+			CopyOnWriteSortedSet<XC_MethodHook> callbacks;
+			synchronized (hookedMethodCallbacks) {
+				callbacks = hookedMethodCallbacks.get(hookMethod);
+			}
+			if (callbacks != null)
+				updateDispatchMode(hookMethod, callbacks);
+		}
+	}
+
+	/**
+	 * Free the native data of replaced patch sets which are no longer used. This is also
+	 * done by every {@link #publishHookPatchSet}.
+	 *
+	 * @return The number of replaced sets which may still be in use
+	 */
+	public static int reclaimHookPatchSets() {
+		return reclaimPatchSetsNative();
+	}
+
+	/**
+	 * Tells the native handler whether the calls of a method must go through Java and
+	 * whether they are queued for asynchronous callbacks. The callbacks of a published
+	 * patch set count as synchronous ones.
+	 */
+	private static void updateDispatchMode(Member hookMethod, CopyOnWriteSortedSet<XC_MethodHook> callbacks) {
+		synchronized (callbacks) {
+			boolean sync = false;
+			boolean async = false;
+			for (Object callback : callbacks.getSnapshot()) {
+				if (callback instanceof XC_MethodAsyncHook)
+					async = true;
+				else
+					sync = true;
+			}
+			if (!sync) {
+				synchronized (patchedMethods) {
+					sync = patchedMethods.contains(hookMethod);
+				}
+			}
+
+			int mode = DISPATCH_SYNC;
+			if (async) {
+				mode = sync ? DISPATCH_SYNC_AND_ASYNC : DISPATCH_ASYNC_ONLY;
+			} else if (!sync) {
+				synchronized (allocationProfiledConstructors) {
+					if (allocationProfiledConstructors.contains(hookMethod))
+						mode = DISPATCH_NONE;
+				}
+			}
+			setDispatchModeNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), mode);
+		}
+	}
+
+	/**
+	 * Set the number of calls which may wait for asynchronous hooks. Only has an effect
+	 * before the first {@link XC_MethodAsyncHook} is added.
+	 */
+	public static synchronized void setAsyncHookQueueCapacity(int capacity) {
+		if (capacity < 1)
+			throw new IllegalArgumentException("capacity must be at least 1");
+		asyncQueueCapacity = capacity;
+	}
+
+	/**
+	 * Set what happens to a call for asynchronous hooks when the queue is full.
+	 * The background thread itself never waits, its calls are dropped.
+	 *
+	 * @param policy {@link #ASYNC_OVERFLOW_DROP} or {@link #ASYNC_OVERFLOW_BLOCK}
+	 */
+	public static synchronized void setAsyncHookOverflowPolicy(int policy) {
+		if (policy != ASYNC_OVERFLOW_DROP && policy != ASYNC_OVERFLOW_BLOCK)
+			throw new IllegalArgumentException("unknown overflow policy " + policy);
+		asyncOverflowPolicy = policy;
+		if (asyncWorker != null)
+			setAsyncOverflowPolicyNative(policy);
+	}
+
+	/**
+	 * Returns the counters of the asynchronous hook queue as
+	 * <code>{ enqueued, dropped, blocked, pending }</code>, or null if no asynchronous
+	 * hook was added yet. <code>blocked</code> counts the calls which had to wait for room.
+	 */
+	public static int[] getAsyncHookStats() {
+		return getAsyncStatsNative();
+	}
+
+	private static synchronized void startAsyncWorker() {
+		if (asyncWorker != null)
+			return;
+		if (!startAsyncHooksNative(asyncQueueCapacity))
+			throw new IllegalStateException("could not create the queue for asynchronous hooks");
+		setAsyncOverflowPolicyNative(asyncOverflowPolicy);
+
+		asyncWorker = new Thread("DexposedAsyncHooks") {
+			@Override
+			public void run() {
+				while (true) {
+					Object[] call = takeAsyncCallNative();
+					if (call != null)
+						handleAsyncCall(call);
+				}
+			}
+		};
+		asyncWorker.setDaemon(true);
+		asyncWorker.start();
+	}
+
+	/**
+	 * Runs the asynchronous callbacks for a call taken from the native queue, see
+	 * dexposed_async.h for the layout of <code>call</code>.
+	 */
+	private static void handleAsyncCall(Object[] call) {
+		AdditionalHookInfo additionalInfo = (AdditionalHookInfo) call[0];
+
+		MethodHookParam param = new MethodHookParam();
+		param.method = additionalInfo.method;
+		param.thisObject = call[1];
+		param.args = new Object[call.length - 4];
+		System.arraycopy(call, 4, param.args, 0, param.args.length);
+		if (call[3] != null)
+			param.setThrowable((Throwable) call[3]);
+		else
+			param.setResult(call[2]);
+
+		for (Object callback : additionalInfo.callbacks.getSnapshot()) {
+			if (!(callback instanceof XC_MethodAsyncHook))
+				continue;
+			try {
+				((XC_MethodAsyncHook) callback).afterHookedMethodAsync(param);
+			} catch (Throwable t) {
+				log(t);
+			}
+		}
+	}
+
+	/**
+	 * Dispatch only a random sample of the calls of a hooked method to its callbacks.
+	 * The other calls go directly from the native handler to the original method,
+	 * without boxing the arguments or calling into Java.
+	 *
+	 * @param hookMethod The hooked method
+	 * @param rate On average one in <code>rate</code> calls is dispatched, 1 dispatches every call
+	 */
+	public static void setHookSamplingRate(Member hookMethod, int rate) {
+		if (rate < 1)
+			throw new IllegalArgumentException("sampling rate must be at least 1");
+		if (!setSamplingRateNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), rate))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	/**
+	 * Restrict the threads on which the calls of a hooked method are dispatched. The calls on
+	 * other threads go directly from the native handler to the original method, before the
+	 * arguments are looked at, and are not traced either.
+	 *
+	 * @param hookMethod The hooked method
+	 * @param filter One of the <code>THREAD_FILTER_*</code> constants except {@link #THREAD_FILTER_TIDS}
+	 */
+	public static void setHookThreadFilter(Member hookMethod, int filter) {
+		if (filter < THREAD_FILTER_ALL || filter > THREAD_FILTER_OPT_IN || filter == THREAD_FILTER_TIDS)
+			throw new IllegalArgumentException("unknown thread filter " + filter);
+		if (!setThreadFilterNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), filter, null))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	/**
+	 * Dispatch the calls of a hooked method only on the given threads.
+	 *
+	 * @param hookMethod The hooked method
+	 * @param tids Up to 8 thread ids as returned by {@link android.os.Process#myTid()}
+	 */
+	public static void setHookThreadFilter(Member hookMethod, int[] tids) {
+		if (tids.length > MAX_FILTER_TIDS)
+			throw new IllegalArgumentException("at most " + MAX_FILTER_TIDS + " threads can be given");
+		if (!setThreadFilterNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod),
+				THREAD_FILTER_TIDS, tids))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	/**
+	 * Opt the current thread in to or out of the hooks with {@link #THREAD_FILTER_OPT_IN}.
+	 */
+	public static void setThreadOptIn(boolean optIn) {
+		setThreadOptInNative(optIn);
+	}
+
+	/**
+	 * Set what happens to calls of a hooked method which are made while the thread runs
+	 * callbacks, e.g. a hooked <code>toString()</code> called by a logging callback. Calls made
+	 * by the original method which the callbacks invoke are not affected. The callbacks of
+	 * asynchronous hooks count as callback code as well.
+	 *
+	 * @param hookMethod The hooked method
+	 * @param policy {@link #NESTED_DISPATCH} (the default) or {@link #NESTED_PASS_THROUGH}
+	 */
+	public static void setHookNestedPolicy(Member hookMethod, int policy) {
+		if (policy != NESTED_DISPATCH && policy != NESTED_PASS_THROUGH)
+			throw new IllegalArgumentException("unknown nested call policy " + policy);
+		if (!setNestedPolicyNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), policy))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	/**
+	 * Put a hooked method into a group of hooks which are enabled and disabled together.
+	 * Groups are created enabled when they are first used, a hook belongs to one group
+	 * at a time.
+	 *
+	 * @param hookMethod The hooked method
+	 * @param group Name of the group, <code>null</code> to remove the hook from its group
+	 */
+	public static void setHookGroup(Member hookMethod, String group) {
+		int groupId = group != null ? getHookGroupId(group) : 0;
+		if (!setHookGroupNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), groupId))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	/**
+	 * Enable or disable all hooks of a group at once. While a group is disabled, the calls of
+	 * its methods go directly from the native handler to the original methods. The methods stay
+	 * hooked, so this is cheap enough to be toggled at any time.
+	 */
+	public static void setHookGroupEnabled(String group, boolean enabled) {
+		int groupId = getHookGroupId(group);
+		synchronized (hookGroups) {
+			if (!setHookGroupEnabledNative(groupId, enabled))
+				throw new IllegalStateException("could not change hook group " + group);
+			if (enabled)
+				disabledHookGroups.remove(group);
+			else
+				disabledHookGroups.add(group);
+		}
+	}
+
+	public static boolean isHookGroupEnabled(String group) {
+		synchronized (hookGroups) {
+			return !disabledHookGroups.contains(group);
+		}
+	}
+
+	private static int getHookGroupId(String group) {
+		synchronized (hookGroups) {
+			Integer groupId = hookGroups.get(group);
+			if (groupId == null) {
+				// id 0 is the group of hooks without a group, it is always enabled
+				if (hookGroups.size() + 1 >= MAX_HOOK_GROUPS)
+					throw new IllegalStateException("too many hook groups");
+				groupId = hookGroups.size() + 1;
+				hookGroups.put(group, groupId);
+			}
+			return groupId;
+		}
+	}
+
+	/**
+	 * Create the trace file which {@link #setHookTracing} records calls to. The file is
+	 * a ring of <code>capacity</code> fixed-size records (rounded up to a power of two),
+	 * the oldest records are overwritten. Use the dexposed_trace_decoder host tool to
+	 * read it. Only one trace file can be opened per process.
+	 *
+	 * @param path Where to create the file, an existing file is overwritten
+	 * @param capacity Number of records the file keeps
+	 */
+	public static void openTraceFile(String path, int capacity) {
+		if (capacity < 1)
+			throw new IllegalArgumentException("capacity must be at least 1");
+		if (!openTraceFileNative(path, capacity))
+			throw new IllegalStateException("could not open trace file " + path);
+	}
+
+	/**
+	 * Record every call of a hooked method to the trace file: the thread, the time and
+	 * duration, the primitive arguments and result as their raw values and objects as their
+	 * identity hash code. The recording is done by the native handler and does not depend on
+	 * the callbacks of the method.
+	 */
+	public static void setHookTracing(Member hookMethod, boolean enabled) {
+		String name = hookMethod.getDeclaringClass().getName() + "."
+				+ (hookMethod instanceof Constructor<?> ? "<init>" : hookMethod.getName());
+		if (!setTracingNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), enabled, name))
+			throw new IllegalArgumentException("method is not hooked or trace file is not open: " + hookMethod);
+	}
+
+	/**
+	 * Write the trace file to disk. The records reach the file system without this as well,
+	 * even if the process crashes, but not if the device loses power.
+	 */
+	public static void syncTraceFile() {
+		syncTraceFileNative();
+	}
+
+	/**
+	 * Open the ftrace marker file for {@link #setHookSystrace}. Only needs to be called once per
+	 * process, later calls return <code>false</code>.
+	 *
+	 * @return <code>false</code> if the marker file was opened before or cannot be opened
+	 */
+	public static boolean startSystrace() {
+		return startSystraceNative();
+	}
+
+	/**
+	 * Show the calls of a hooked method as slices named after the method in systrace, next to
+	 * the slices of the framework. The native handler writes the markers itself and only while
+	 * the app is being traced, a hook costs nothing more while it is not.
+	 */
+	public static void setHookSystrace(Member hookMethod, boolean enabled) {
+		String name = hookMethod.getDeclaringClass().getName() + "."
+				+ (hookMethod instanceof Constructor<?> ? "<init>" : hookMethod.getName());
+		if (!setSystraceNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), enabled, name))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	/**
+	 * Create the stats file, a memory mapped file into which the native handlers count the calls
+	 * of the hooks with {@link #setHookStats}. Other processes can map it and read the counters
+	 * without calling into the app, e.g. with dexposed_stats_reader; the layout and the locking
+	 * are described in dexposed_stats_format.h. Only one stats file can be opened per process.
+	 *
+	 * @param path Where to create the file, an existing file is overwritten
+	 * @param capacity Number of hooks the file has room for
+	 */
+	public static void openStatsFile(String path, int capacity) {
+		if (capacity < 1)
+			throw new IllegalArgumentException("capacity must be at least 1");
+		if (!openStatsFileNative(path, capacity))
+			throw new IllegalStateException("could not open stats file " + path);
+	}
+
+	/**
+	 * Count the calls of a hooked method in the stats file: their number, the ones which threw,
+	 * and a histogram of their durations including the callbacks.
+	 */
+	public static void setHookStats(Member hookMethod, boolean enabled) {
+		String name = hookMethod.getDeclaringClass().getName() + "."
+				+ (hookMethod instanceof Constructor<?> ? "<init>" : hookMethod.getName());
+		if (!setStatsNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), enabled, name))
+			throw new IllegalArgumentException("method is not hooked or stats file is full or not open: " + hookMethod);
+	}
+
+	/**
+	 * Give the callbacks of a hooked method a cost budget, measured by the native handler
+	 * over a sliding window. When the dispatched calls exceed it, the hook switches to
+	 * pass-through mode (the original method is called directly) and the
+	 * {@link HookBudgetListener} is notified.
+	 *
+	 * @param hookMethod The hooked method
+	 * @param windowMillis Length of the sliding window, 0 disables the budget
+	 * @param maxMicros Time the dispatched calls may take per window, 0 for no limit
+	 * @param maxCalls Number of calls that may be dispatched per window, 0 for no limit
+	 * @param rearmPolicy {@link #BUDGET_REARM_MANUAL} or {@link #BUDGET_REARM_AFTER_COOLDOWN}
+	 * @param cooldownMillis Time to stay in pass-through mode for {@link #BUDGET_REARM_AFTER_COOLDOWN}
+	 */
+	public static void setHookBudget(Member hookMethod, int windowMillis, int maxMicros, int maxCalls,
+			int rearmPolicy, int cooldownMillis) {
+		if (windowMillis < 0 || maxMicros < 0 || maxCalls < 0 || cooldownMillis < 0)
+			throw new IllegalArgumentException("budget values must not be negative");
+		if (rearmPolicy != BUDGET_REARM_MANUAL && rearmPolicy != BUDGET_REARM_AFTER_COOLDOWN)
+			throw new IllegalArgumentException("unknown rearm policy " + rearmPolicy);
+		if (!setBudgetNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod),
+				windowMillis, maxMicros, maxCalls, rearmPolicy, cooldownMillis))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	/**
+	 * Dispatch calls of a hook which exceeded its budget to its callbacks again.
+	 */
+	public static void rearmHookBudget(Member hookMethod) {
+		if (!rearmBudgetNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod)))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	public static void setHookBudgetListener(HookBudgetListener listener) {
+		hookBudgetListener = listener;
+	}
+
+	/**
+	 * Cache the results of a hooked method in native code. A call with the same arguments as
+	 * an earlier one returns the earlier result without calling into Java, neither the callbacks
+	 * nor the original method run. Calls which throw are not cached. Only static methods with a
+	 * result whose parameters are primitives or Strings can be memoized, the method must be pure
+	 * with its callbacks included.
+	 *
+	 * @param hookMethod The hooked method
+	 * @param capacity Number of results to keep, 0 stops memoizing and drops the cache
+	 * @param maxAgeMillis Time after which a result is computed again, 0 keeps it until it is evicted
+	 */
+	public static void setHookMemoization(Member hookMethod, int capacity, int maxAgeMillis) {
+		if (capacity < 0 || maxAgeMillis < 0)
+			throw new IllegalArgumentException("memoization values must not be negative");
+		if (capacity > 0) {
+			if (!(hookMethod instanceof Method) || !Modifier.isStatic(hookMethod.getModifiers())
+					|| ((Method) hookMethod).getReturnType() == void.class)
+				throw new IllegalArgumentException("only static methods with a result can be memoized: " + hookMethod);
+			for (Class<?> type : ((Method) hookMethod).getParameterTypes()) {
+				if (!type.isPrimitive() && type != String.class)
+					throw new IllegalArgumentException("cannot memoize on parameters of type " + type.getName());
+			}
+		}
+		if (!setMemoizationNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod),
+				capacity, maxAgeMillis))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	/**
+	 * Drop all results cached for a memoized method, e.g. after the state it depends on changed.
+	 *
+	 * @return <code>false</code> if the method is not memoized
+	 */
+	public static boolean invalidateHookMemoization(Member hookMethod) {
+		return invalidateMemoizationNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod));
+	}
+
+	/**
+	 * @return <code>{ hits, misses, evictions }</code> of a memoized method, or <code>null</code>
+	 *         if it is not memoized
+	 */
+	public static int[] getHookMemoizationStats(Member hookMethod) {
+		return getMemoizationStatsNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod));
+	}
+
+	/**
+	 * Count the calls of a hooked method per call site, see {@link #getHookTopCallers}. The
+	 * native handler counts a call in a small hash table, no stack trace is taken.
+	 *
+	 * @param hookMethod The hooked method
+	 * @param capacity Number of call sites which can be counted, calls from further call sites
+	 *                 are dropped. 0 stops profiling and drops the counts.
+	 */
+	public static void setHookCallerProfile(Member hookMethod, int capacity) {
+		if (capacity < 0)
+			throw new IllegalArgumentException("capacity must not be negative");
+		if (!setCallerProfileNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), capacity))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	/**
+	 * @param max Maximum number of call sites to return
+	 * @return The call sites from which a profiled method was called most, most calls first, or
+	 *         <code>null</code> if its callers are not profiled
+	 */
+	public static HookCaller[] getHookTopCallers(Member hookMethod, int max) {
+		if (max < 1)
+			throw new IllegalArgumentException("max must be at least 1");
+		int[] counts = new int[2 + 2 * max];
+		String[] methods = getTopCallersNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), counts);
+		if (methods == null)
+			return null;
+		HookCaller[] callers = new HookCaller[methods.length];
+		for (int i = 0; i < methods.length; i++)
+			callers[i] = new HookCaller(methods[i], counts[2 + 2 * i], counts[3 + 2 * i]);
+		return callers;
+	}
+
+	/**
+	 * @return <code>{ calls, dropped }</code> of a profiled method, or <code>null</code> if its
+	 *         callers are not profiled
+	 */
+	public static int[] getHookCallerProfileStats(Member hookMethod) {
+		int[] counts = new int[4];
+		if (getTopCallersNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), counts) == null)
+			return null;
+		return new int[] { counts[0], counts[1] };
+	}
+
+	/**
+	 * Start sampling the call stacks of hooked methods, see {@link #setHookStackSampling}. The
+	 * stacks of all methods are kept in one table, identical stacks are only counted. Sampling
+	 * can only be started once per process.
+	 *
+	 * @param capacity Number of distinct frames which can be kept, stacks with frames beyond
+	 *                 that are dropped
+	 */
+	public static void startStackSampling(int capacity) {
+		if (capacity < 1)
+			throw new IllegalArgumentException("capacity must be at least 1");
+		if (!startStackSamplingNative(capacity))
+			throw new IllegalStateException("could not start stack sampling");
+	}
+
+	/**
+	 * Capture the call stack of one in <code>rate</code> calls of a hooked method. The native
+	 * handler walks the stack before the callbacks run, much cheaper than
+	 * {@link Thread#getStackTrace}. Method names are only looked up by {@link #dumpStackSamples}.
+	 *
+	 * @param hookMethod The hooked method
+	 * @param rate 1 captures every call, 0 stops capturing
+	 */
+	public static void setHookStackSampling(Member hookMethod, int rate) {
+		if (rate < 0)
+			throw new IllegalArgumentException("rate must not be negative");
+		if (!setStackSamplingNative(hookMethod, hookMethod.getDeclaringClass(), getMethodSlot(hookMethod), rate))
+			throw new IllegalArgumentException("method is not hooked: " + hookMethod);
+	}
+
+	/**
+	 * Write the sampled stacks to a file, one line per distinct stack with its frames from the
+	 * outermost to the hooked method separated by semicolons, followed by its count. Flame graph
+	 * tools read this format.
+	 *
+	 * @return The number of distinct stacks written
+	 */
+	public static int dumpStackSamples(String path) {
+		int stacks = dumpStackSamplesNative(path);
+		if (stacks < 0)
+			throw new IllegalStateException("could not write the stack samples to " + path);
+		return stacks;
+	}
+
+	/**
+	 * @return <code>{ samples, dropped, frames }</code>, or <code>null</code> if stack sampling
+	 *         was not started
+	 */
+	public static int[] getStackSamplingStats() {
+		return getStackSamplingStatsNative();
+	}
+
+	/**
+	 * Start profiling the allocation sites of classes, see {@link #profileAllocations}. The sites
+	 * of all classes are kept in one table. Profiling can only be started once per process.
+	 *
+	 * @param capacity Number of distinct allocation sites which can be kept, allocations at
+	 *                 sites beyond that are dropped
+	 */
+	public static void startAllocationProfiling(int capacity) {
+		if (capacity < 1)
+			throw new IllegalArgumentException("capacity must be at least 1");
+		if (!startAllocationProfilingNative(capacity))
+			throw new IllegalStateException("could not start allocation profiling");
+	}
+
+	/**
+	 * Count one in <code>rate</code> instances of a class by the method which creates them. The
+	 * constructors of the class are hooked if they are not yet, without callbacks they call the
+	 * original constructor directly from the native handler. Constructors called by
+	 * <code>this(...)</code> are not counted twice, instances of subclasses are counted by the
+	 * profiles of their own classes.
+	 *
+	 * @param clazz The profiled class
+	 * @param rate 1 counts every instance, 0 stops counting but leaves the constructors hooked
+	 */
+	public static void profileAllocations(Class<?> clazz, int rate) {
+		if (rate < 0)
+			throw new IllegalArgumentException("rate must not be negative");
+		ensureInit();
+		for (Constructor<?> constructor : clazz.getDeclaredConstructors()) {
+			synchronized (allocationProfiledConstructors) {
+				allocationProfiledConstructors.add(constructor);
+			}
+			boolean newMethod = false;
+			CopyOnWriteSortedSet<XC_MethodHook> callbacks;
+			synchronized (hookedMethodCallbacks) {
+				callbacks = hookedMethodCallbacks.get(constructor);
+				if (callbacks == null) {
+					callbacks = new CopyOnWriteSortedSet<XC_MethodHook>();
+					hookedMethodCallbacks.put(constructor, callbacks);
+					newMethod = true;
+				}
+			}
+			int slot = getMethodSlot(constructor);
+			if (newMethod)
+				hookMethodNative(constructor, clazz, slot, newAdditionalHookInfo(constructor, callbacks));
+			updateDispatchMode(constructor, callbacks);
+			setAllocationSamplingNative(constructor, clazz, slot, rate);
+		}
+	}
+
+	/**
+	 * Write the allocation sites to a file, one line per class and creating method with the
+	 * number of counted instances, the class and the method separated by tabs. Instances created
+	 * from native code or by reflection have <code>&lt;native&gt;</code> as their method.
+	 *
+	 * @return The number of allocation sites written
+	 */
+	public static int dumpAllocations(String path) {
+		int sites = dumpAllocationsNative(path);
+		if (sites < 0)
+			throw new IllegalStateException("could not write the allocation sites to " + path);
+		return sites;
+	}
+
+	/**
+	 * @return <code>{ samples, dropped }</code>, or <code>null</code> if allocation profiling was
+	 *         not started
+	 */
+	public static int[] getAllocationProfilingStats() {
+		return getAllocationProfilingStatsNative();
+	}
+
+	/**
+	 * Make a method return a constant without running any of its code. The method is pointed at
+	 * a native stub which only returns the value, no hook is dispatched and no Java code runs,
+	 * which makes this much cheaper than an {@link XC_MethodReplacement} returning a constant.
+	 * The replacement cannot be undone and the method cannot be hooked before, it can be
+	 * hooked afterwards, the hook then sees the constant as the original method.
+	 * <p>On ART stubs are only generated on ARM, elsewhere this throws.
+	 *
+	 * @param method A method which is not hooked
+	 * @param value The boxed result for a primitive return type, <code>null</code> for a void or
+	 *              reference return type, other objects cannot be returned by a stub
+	 */
+	public static void replaceWithConstant(Member method, Object value) {
+		if (!(method instanceof Method))
+			throw new IllegalArgumentException("only methods can be replaced by a constant");
+		replaceWithConstantBits(method, constantBits(((Method) method).getReturnType(), value));
+	}
+
+	/**
+	 * Make a method return immediately, with <code>0</code>, <code>false</code> or
+	 * <code>null</code> if it is not void. See {@link #replaceWithConstant}.
+	 */
+	public static void replaceWithNoOp(Member method) {
+		if (!(method instanceof Method))
+			throw new IllegalArgumentException("only methods can be replaced by a no-op");
+		replaceWithConstantBits(method, 0);
+	}
+
+	private static void replaceWithConstantBits(Member method, long bits) {
+		if (Modifier.isAbstract(method.getModifiers()))
+			throw new IllegalArgumentException("abstract methods cannot be replaced: " + method);
+		// fails early, the native code checks again together with the switch since a hook may be
+		// installed meanwhile
+		synchronized (hookedMethodCallbacks) {
+			if (hookedMethodCallbacks.containsKey(method))
+				throw new IllegalStateException("method is hooked: " + method);
+		}
+		ensureInit();
+
+		// the code of a static method is only set once its class is initialized, it would
+		// replace the stub
+		Class<?> declaringClass = method.getDeclaringClass();
+		try {
+			Class.forName(declaringClass.getName(), true, declaringClass.getClassLoader());
+		} catch (ClassNotFoundException e) {
+			throw new XposedHelpers.ClassNotFoundError(e);
+		}
+		if (!replaceWithConstantNative(method, declaringClass, getMethodSlot(method), bits))
+			throw new IllegalStateException("could not replace " + method + ", it may be hooked or counted");
+	}
+
+	/**
+	 * Hook the JNI function of a registered native method in native code. Every call of the method
+	 * runs the native callbacks of <code>hook</code> around the original function without going
+	 * through Java, for JNI-heavy paths where {@link #hookMethod} would cost too much. The
+	 * callbacks are described in dexposed_jni_hook.h. Hooking the method again wraps the previous
+	 * hook. Registering the natives of the method again drops its hooks. A method hooked with
+	 * {@link #hookMethod} on Dalvik keeps its callbacks, they invoke the hooked function as the
+	 * original method. JNI hooks are only supported on arm.
+	 *
+	 * @param method The native method, its JNI function must be registered already
+	 * @param hook The address of a <code>DexposedJniHook</code> in native memory, it is copied
+	 */
+	public static synchronized void hookJniFunction(Member method, long hook) {
+		if (hook == 0)
+			throw new IllegalArgumentException("hook must not be 0");
+		if (!Modifier.isNative(method.getModifiers()))
+			throw new IllegalArgumentException("not a native method: " + method);
+		if (!hookJniFunctionNative(method, method.getDeclaringClass(), getMethodSlot(method), hook))
+			throw new IllegalStateException("could not hook the JNI function of " + method
+					+ ", it is not registered or JNI hooks are not supported on this architecture");
+	}
+
+	/**
+	 * Remove the JNI hook added last to a native method, see {@link #hookJniFunction}. A call
+	 * which is already running still returns through the hook.
+	 *
+	 * @return <code>false</code> if the JNI function of the method is not hooked
+	 */
+	public static synchronized boolean unhookJniFunction(Member method) {
+		return unhookJniFunctionNative(method, method.getDeclaringClass(), getMethodSlot(method));
+	}
+
+	// the raw bits of value as the native stub returns them for a method returning type
+	private static long constantBits(Class<?> type, Object value) {
+		if (!type.isPrimitive() || type == void.class) {
+			if (value != null)
+				throw new IllegalArgumentException("only null can be returned for " + type);
+			return 0;
+		}
+		if (type == boolean.class) {
+			if (!(value instanceof Boolean))
+				throw new IllegalArgumentException("a Boolean is needed for " + type);
+			return ((Boolean) value) ? 1 : 0;
+		}
+		if (type == char.class) {
+			if (!(value instanceof Character))
+				throw new IllegalArgumentException("a Character is needed for " + type);
+			return (Character) value;
+		}
+		if (!(value instanceof Number))
+			throw new IllegalArgumentException("a Number is needed for " + type);
+		Number number = (Number) value;
+		if (type == long.class)
+			return number.longValue();
+		if (type == float.class)
+			return Float.floatToRawIntBits(number.floatValue()) & 0xffffffffL;
+		if (type == double.class)
+			return Double.doubleToRawLongBits(number.doubleValue());
+		if (type == byte.class)
+			return number.byteValue();
+		if (type == short.class)
+			return number.shortValue();
+		return number.intValue();
+	}
+
+	/**
+	 * Write the address ranges of the native stubs dexposed generates from now on to a perf map,
+	 * so profiles from perf or simpleperf attribute the time spent in them, e.g. to the constant
+	 * stub of a method. Every hook installed from now on is written as well, named after its
+	 * method at the start of the handler all hooks share. The profilers read the map from
+	 * <code>/tmp/perf-&lt;pid&gt;.map</code> on the machine doing the report, pull it from the
+	 * device to there. Can only be started once.
+	 *
+	 * @param path Where to create the map, an existing file is overwritten
+	 */
+	public static void startPerfMap(String path) {
+		if (!startPerfMapNative(path))
+			throw new IllegalStateException("could not create perf map " + path);
+	}
+
+	/**
+	 * Start the coverage mode, see {@link #coverMethod}. The counters are kept in a file which
+	 * can be read while the app runs, or pulled afterwards and printed with
+	 * dexposed_coverage_decoder. Coverage can only be started once per process.
+	 *
+	 * @param path Where to create the file, an existing file is overwritten. <code>null</code>
+	 *             keeps the counters in memory, they can still be read with {@link #getCoverageCounts}.
+	 * @param capacity Number of methods which can be counted
+	 */
+	public static void startCoverage(String path, int capacity) {
+		if (capacity < 1)
+			throw new IllegalArgumentException("capacity must be at least 1");
+		if (!startCoverageNative(path, capacity))
+			throw new IllegalStateException("could not start coverage" + (path != null ? " in " + path : ""));
+	}
+
+	/**
+	 * Count the calls of a method. Unlike a hook nothing is dispatched to Java, the native
+	 * handler increments the counter of the method and runs its original code. This is meant
+	 * for counting many thousands of methods, e.g. to find dead code. Counting cannot be
+	 * stopped, hooks can still be added and removed.
+	 * <p>Coverage is only supported on Dalvik. On ART a counter in front of compiled code breaks
+	 * the lookups of its method header, and counting through a hook costs a backup method and a
+	 * global reference per method, too much for the number of methods coverage is meant for.
+	 *
+	 * @return The coverage id of the method, the index of its counter
+	 * @throws UnsupportedOperationException On ART
+	 */
+	public static int coverMethod(Member method) {
+		if (!(method instanceof Method) && !(method instanceof Constructor<?>))
+			throw new IllegalArgumentException("only methods and constructors can be counted");
+		if(runtime == RUNTIME_UNKNOW)  runtime = getRuntime();
+		if (runtime == RUNTIME_ART)
+			throw new UnsupportedOperationException("coverage is not supported on ART: " + method);
+		if (Modifier.isAbstract(method.getModifiers()))
+			throw new IllegalArgumentException("abstract methods cannot be counted: " + method);
+		ensureInit();
+
+		synchronized (coverageIds) {
+			Integer existing = coverageIds.get(method);
+			if (existing != null)
+				return existing;
+
+			// the code of a static method is only set once its class is initialized, it would
+			// replace the stub
+			Class<?> declaringClass = method.getDeclaringClass();
+			try {
+				Class.forName(declaringClass.getName(), true, declaringClass.getClassLoader());
+			} catch (ClassNotFoundException e) {
+				throw new XposedHelpers.ClassNotFoundError(e);
+			}
+
+			int id = coverMethodNative(method, declaringClass, getMethodSlot(method), coverageName(method));
+			if (id < 0)
+				throw new IllegalStateException("could not count " + method + ", coverage is not started or full");
+			while (coveredMethods.size() < id)
+				coveredMethods.add(null);
+			coveredMethods.add(method);
+			coverageIds.put(method, id);
+			return id;
+		}
+	}
+
+	private static String coverageName(Member method) {
+		StringBuilder name = new StringBuilder(method.getDeclaringClass().getName()).append('.')
+				.append(method instanceof Constructor<?> ? "<init>" : method.getName()).append('(');
+		Class<?>[] parameterTypes = method instanceof Method ? ((Method) method).getParameterTypes()
+				: ((Constructor<?>) method).getParameterTypes();
+		for (int i = 0; i < parameterTypes.length; i++) {
+			if (i > 0)
+				name.append(',');
+			name.append(parameterTypes[i].getSimpleName());
+		}
+		return name.append(')').toString();
+	}
+
+	/**
+	 * @return The call counts of the counted methods indexed by coverage id, or <code>null</code>
+	 *         if coverage was not started
+	 */
+	public static int[] getCoverageCounts() {
+		return getCoverageCountsNative();
+	}
+
+	/**
+	 * @return The method with the given coverage id, or <code>null</code>
+	 */
+	public static Member getCoveredMethod(int id) {
+		synchronized (coverageIds) {
+			return id >= 0 && id < coveredMethods.size() ? coveredMethods.get(id) : null;
+		}
+	}
+
+	/**
+	 * Write the counters to the coverage file, e.g. before it is pulled from the device.
+	 */
+	public static void syncCoverage() {
+		syncCoverageNative();
+	}
+
+	/**
+	 * A call site of a method whose callers are profiled, see {@link #getHookTopCallers}.
+	 */
+	public static final class HookCaller {
+		/** The calling method, <code>null</code> for calls from native code or by reflection */
+		public final String method;
+		/** The dex pc of the call in the calling method, -1 if it is not known */
+		public final int dexPc;
+		/** Number of calls made from here */
+		public final int calls;
+
+		HookCaller(String method, int dexPc, int calls) {
+			this.method = method;
+			this.dexPc = dexPc;
+			this.calls = calls;
+		}
+
+		@Override
+		public String toString() {
+			return (method != null ? method : "<native>") + (dexPc >= 0 ? " @" + dexPc : "") + ": " + calls;
+		}
+	}
+
+	/**
+	 * Callbacks for several methods which are published together, see {@link #publishHookPatchSet}.
+	 * A set must not be changed after it was published. Only synchronous callbacks are supported.
+	 */
+	public static final class HookPatchSet {
+		final HashMap<Member, CopyOnWriteSortedSet<XC_MethodHook>> callbacks
+				= new HashMap<Member, CopyOnWriteSortedSet<XC_MethodHook>>();
+
+		public HookPatchSet add(Member hookMethod, XC_MethodHook callback) {
+			checkHookable(hookMethod);
+			if (callback instanceof XC_MethodAsyncHook)
+				throw new IllegalArgumentException("patch sets do not support asynchronous hooks");
+
+			CopyOnWriteSortedSet<XC_MethodHook> methodCallbacks = callbacks.get(hookMethod);
+			if (methodCallbacks == null) {
+				methodCallbacks = new CopyOnWriteSortedSet<XC_MethodHook>();
+				callbacks.put(hookMethod, methodCallbacks);
+			}
+			methodCallbacks.add(callback);
+			return this;
+		}
+	}
+
+	public interface HookBudgetListener {
+		/**
+		 * Called on the thread whose call exceeded the budget, after the hooked call returned.
+		 */
+		void onHookBudgetExceeded(Member hookMethod);
+	}
+
+	/**
+	 * This method is called by the native handler when a hook exceeded its budget.
+	 */
+	private static void onHookBudgetExceeded(Object additionalInfoObj) {
+		AdditionalHookInfo additionalInfo = (AdditionalHookInfo) additionalInfoObj;
+		log("Hook exceeded its budget, passing through: " + additionalInfo.method);
+
+		HookBudgetListener listener = hookBudgetListener;
+		if (listener == null)
+			return;
+		try {
+			listener.onHookBudgetExceeded(additionalInfo.method);
+		} catch (Throwable t) {
+			log(t);
+		}
 	}
 
 	public static Set<XC_MethodHook.Unhook> hookAllMethods(Class<?> hookClass, String methodName, XC_MethodHook callback) {
@@ -279,7 +1380,46 @@ public final class DexposedBridge {
 			return false;
 		}
 		//load dexposed lib for hook.
-		return loadDexposedLib(context);
+		if (!loadDexposedLib(context))
+			return false;
+		return lazyInit || init();
+	}
+
+	/**
+	 * Leave the initialization of the native bridge to the first hook or call of {@link #init}
+	 * instead of doing it in {@link #canDexposed}, which then only loads the library. Must be
+	 * called before {@link #canDexposed}.
+	 */
+	public synchronized static void setLazyInit(boolean lazy) {
+		lazyInit = lazy;
+	}
+
+	/**
+	 * Initialize the native bridge. It is only done once, later calls return the result of the
+	 * first. Methods which hook or invoke methods initialize it themselves.
+	 *
+	 * @return <code>false</code> if the bridge could not be initialized
+	 */
+	public static boolean init() {
+		if (initialized)
+			return true;
+		initialized = bootstrapNative();
+		return initialized;
+	}
+
+	static void ensureInit() {
+		if (!init())
+			throw new IllegalStateException("dexposed could not be initialized");
+	}
+
+	/**
+	 * Get the time spent in every phase of loading and initializing the native bridge.
+	 *
+	 * @return The nanoseconds per phase, indexed by <code>INIT_PHASE_*</code>, -1 for phases
+	 *         which were not run (yet)
+	 */
+	public static long[] getInitTimings() {
+		return getBootstrapTimingsNative();
 	}
 	
 	private static boolean loadDexposedLib(Context context) {
@@ -306,6 +1446,7 @@ public final class DexposedBridge {
                             InvocationTargetException;
 	
 	public static Object invokeSuper(Object obj, Member method, Object... args) throws NoSuchFieldException {
+		ensureInit();
 		
 		try {
 			if(runtime == RUNTIME_UNKNOW)  runtime = getRuntime();
@@ -338,6 +1479,125 @@ public final class DexposedBridge {
 			Class<?>[] parameterTypes, Class<?> returnType, Object thisObject, Object[] args)
 			throws IllegalAccessException, IllegalArgumentException, InvocationTargetException;
 
+	private native static boolean setSamplingRateNative(Member method, Class<?> declaringClass, int slot, int rate);
+
+	// field accessors, see FieldAccessor. resolveFieldNative throws IllegalArgumentException if the field cannot be resolved
+	native static long resolveFieldNative(Field field);
+
+	native static int getFieldIntNative(Object obj, long handle);
+
+	native static void setFieldIntNative(Object obj, long handle, int value);
+
+	native static long getFieldLongNative(Object obj, long handle);
+
+	native static void setFieldLongNative(Object obj, long handle, long value);
+
+	native static Object getFieldObjectNative(Object obj, long handle);
+
+	native static void setFieldObjectNative(Object obj, long handle, Object value);
+
+	private native static int publishPatchSetNative(Member[] methods, Class<?>[] declaringClasses, int[] slots,
+			Object[] additionalInfos);
+
+	private native static int reclaimPatchSetsNative();
+
+	private native static boolean setThreadFilterNative(Member method, Class<?> declaringClass, int slot, int filter,
+			int[] tids);
+
+	private native static void setThreadOptInNative(boolean optIn);
+
+	private native static boolean setNestedPolicyNative(Member method, Class<?> declaringClass, int slot, int policy);
+
+	private native static boolean openStatsFileNative(String path, int capacity);
+
+	private native static boolean setStatsNative(Member method, Class<?> declaringClass, int slot,
+			boolean enabled, String name);
+
+	private native static boolean startCoverageNative(String path, int capacity);
+
+	private native static int coverMethodNative(Member method, Class<?> declaringClass, int slot, String name);
+
+	private native static int[] getCoverageCountsNative();
+
+	private native static void syncCoverageNative();
+
+	private native static boolean startPerfMapNative(String path);
+
+	private native static boolean bootstrapNative();
+
+	private native static long[] getBootstrapTimingsNative();
+
+	private native static boolean replaceWithConstantNative(Member method, Class<?> declaringClass, int slot, long bits);
+
+	private native static boolean hookJniFunctionNative(Member method, Class<?> declaringClass, int slot, long hook);
+	private native static boolean unhookJniFunctionNative(Member method, Class<?> declaringClass, int slot);
+
+	private native static boolean setMemoizationNative(Member method, Class<?> declaringClass, int slot,
+			int capacity, int maxAgeMillis);
+
+	private native static boolean invalidateMemoizationNative(Member method, Class<?> declaringClass, int slot);
+
+	private native static int[] getMemoizationStatsNative(Member method, Class<?> declaringClass, int slot);
+
+	private native static boolean setCallerProfileNative(Member method, Class<?> declaringClass, int slot, int capacity);
+
+	private native static String[] getTopCallersNative(Member method, Class<?> declaringClass, int slot, int[] counts);
+
+	private native static boolean startStackSamplingNative(int capacity);
+
+	private native static boolean setStackSamplingNative(Member method, Class<?> declaringClass, int slot, int rate);
+
+	private native static int dumpStackSamplesNative(String path);
+
+	private native static int[] getStackSamplingStatsNative();
+
+	private native static boolean startAllocationProfilingNative(int capacity);
+
+	private native static boolean setAllocationSamplingNative(Member method, Class<?> declaringClass, int slot, int rate);
+
+	private native static int dumpAllocationsNative(String path);
+
+	private native static int[] getAllocationProfilingStatsNative();
+
+	private native static boolean setHookGroupNative(Member method, Class<?> declaringClass, int slot, int group);
+
+	private native static boolean setHookGroupEnabledNative(int group, boolean enabled);
+
+	private native static boolean openTraceFileNative(String path, int capacity);
+
+	private native static boolean setTracingNative(Member method, Class<?> declaringClass, int slot,
+			boolean enabled, String name);
+
+	private native static void syncTraceFileNative();
+
+	private native static boolean startSystraceNative();
+
+	private native static boolean setSystraceNative(Member method, Class<?> declaringClass, int slot,
+			boolean enabled, String name);
+
+	private native static boolean setDispatchModeNative(Member method, Class<?> declaringClass, int slot, int mode);
+
+	private native static boolean startAsyncHooksNative(int capacity);
+
+	private native static Object[] takeAsyncCallNative();
+
+	private native static void setAsyncOverflowPolicyNative(int policy);
+
+	private native static int[] getAsyncStatsNative();
+
+	private native static boolean setBudgetNative(Member method, Class<?> declaringClass, int slot,
+			int windowMillis, int maxMicros, int maxCalls, int rearmPolicy, int cooldownMillis);
+
+	private native static boolean rearmBudgetNative(Member method, Class<?> declaringClass, int slot);
+
+	private native synchronized static boolean removeHookNative(Member method, Class<?> declaringClass, int slot);
+
+	private native static int reclaimRemovedHooksNative();
+
+	private native static int[] getHookMemoryUsageNative(Member method, Class<?> declaringClass, int slot);
+
+	private native static int[] getMemoryUsageNative();
+
 
 	/**
 	 * Basically the same as {@link Method#invoke}, but calls the original method
@@ -361,6 +1621,7 @@ public final class DexposedBridge {
 	 */
 	public static Object invokeOriginalMethod(Member method, Object thisObject, Object[] args)
 			throws NullPointerException, IllegalAccessException, IllegalArgumentException, InvocationTargetException {
+		ensureInit();
 		if (args == null) {
 			args = EMPTY_ARRAY;
 		}
@@ -427,12 +1688,14 @@ public final class DexposedBridge {
 	}
 
 	private static class AdditionalHookInfo {
+		final Member method;
 		final CopyOnWriteSortedSet<XC_MethodHook> callbacks;
 		final Class<?>[] parameterTypes;
 		final Class<?> returnType;
 		String shorty;
 
-		private AdditionalHookInfo(CopyOnWriteSortedSet<XC_MethodHook> callbacks, Class<?>[] parameterTypes, Class<?> returnType) {
+		private AdditionalHookInfo(Member method, CopyOnWriteSortedSet<XC_MethodHook> callbacks, Class<?>[] parameterTypes, Class<?> returnType) {
+			this.method = method;
 			this.callbacks = callbacks;
 			this.parameterTypes = parameterTypes;
 			this.returnType = returnType;
@@ -447,6 +1710,9 @@ public final class DexposedBridge {
 		}
 
 		String Class2Shorty(Class<?> cls) {
+			// constructors have no return type, they return void
+			if(cls == null)
+				return "V";
 			if(cls.isPrimitive()){
 				return builtInMap.get(cls);
 			} else
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.taobao.android.dexposed;
+
+import java.lang.reflect.Field;
+import java.lang.reflect.Modifier;
+
+/**
+ * Reads and writes one field without reflection. The field is resolved once to its
+ * position in the object layout of the runtime, the accessors then read and write the
+ * object directly. Get one with {@link XposedHelpers#findFieldAccessor}.
+ * <p>The typed accessors must match the type of the field exactly, there is no widening
+ * or boxing. Volatile fields are accessed through reflection to keep their ordering.
+ */
+public final class FieldAccessor {
+	private final Field field;
+	private final Class<?> declaringClass;
+	private final Class<?> type;
+	private final boolean isStatic;
+	private final boolean useReflection;
+	private final long handle;
+
+	FieldAccessor(Field field) {
+		this.field = field;
+		this.declaringClass = field.getDeclaringClass();
+		this.type = field.getType();
+		int modifiers = field.getModifiers();
+		this.isStatic = Modifier.isStatic(modifiers);
+		this.useReflection = Modifier.isVolatile(modifiers);
+
+		if (isStatic) {
+			// reflection would initialize the class on first access
+			try {
+				Class.forName(declaringClass.getName(), true, declaringClass.getClassLoader());
+			} catch (ClassNotFoundException e) {
+				throw new XposedHelpers.ClassNotFoundError(e);
+			}
+		}
+		if (!useReflection)
+			DexposedBridge.ensureInit();
+		this.handle = useReflection ? 0 : DexposedBridge.resolveFieldNative(field);
+	}
+
+	public Field getField() {
+		return field;
+	}
+
+	private Object target(Object obj, Class<?> accessType) {
+		if (type != accessType)
+			throw new IllegalArgumentException("field " + field + " is not of type " + accessType);
+		if (isStatic)
+			return declaringClass;
+		if (obj == null)
+			throw new NullPointerException("null object for field " + field);
+		if (!declaringClass.isInstance(obj))
+			throw new IllegalArgumentException("expected receiver of type " + declaringClass.getName()
+					+ ", but got " + obj.getClass().getName());
+		return obj;
+	}
+
+	private static IllegalAccessError accessError(IllegalAccessException e) {
+		// should not happen
+		DexposedBridge.log(e);
+		return new IllegalAccessError(e.getMessage());
+	}
+
+	//#################################################################################################
+	public Object getObject(Object obj) {
+		if (type.isPrimitive())
+			throw new IllegalArgumentException("field " + field + " is of primitive type " + type);
+		if (useReflection) {
+			try {
+				return field.get(obj);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+		}
+		return DexposedBridge.getFieldObjectNative(target(obj, type), handle);
+	}
+
+	public boolean getBoolean(Object obj) {
+		if (useReflection) {
+			try {
+				return field.getBoolean(obj);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+		}
+		return DexposedBridge.getFieldIntNative(target(obj, boolean.class), handle) != 0;
+	}
+
+	public byte getByte(Object obj) {
+		if (useReflection) {
+			try {
+				return field.getByte(obj);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+		}
+		return (byte) DexposedBridge.getFieldIntNative(target(obj, byte.class), handle);
+	}
+
+	public char getChar(Object obj) {
+		if (useReflection) {
+			try {
+				return field.getChar(obj);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+		}
+		return (char) DexposedBridge.getFieldIntNative(target(obj, char.class), handle);
+	}
+
+	public short getShort(Object obj) {
+		if (useReflection) {
+			try {
+				return field.getShort(obj);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+		}
+		return (short) DexposedBridge.getFieldIntNative(target(obj, short.class), handle);
+	}
+
+	public int getInt(Object obj) {
+		if (useReflection) {
+			try {
+				return field.getInt(obj);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+		}
+		return DexposedBridge.getFieldIntNative(target(obj, int.class), handle);
+	}
+
+	public long getLong(Object obj) {
+		if (useReflection) {
+			try {
+				return field.getLong(obj);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+		}
+		return DexposedBridge.getFieldLongNative(target(obj, long.class), handle);
+	}
+
+	public float getFloat(Object obj) {
+		if (useReflection) {
+			try {
+				return field.getFloat(obj);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+		}
+		return Float.intBitsToFloat(DexposedBridge.getFieldIntNative(target(obj, float.class), handle));
+	}
+
+	public double getDouble(Object obj) {
+		if (useReflection) {
+			try {
+				return field.getDouble(obj);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+		}
+		return Double.longBitsToDouble(DexposedBridge.getFieldLongNative(target(obj, double.class), handle));
+	}
+
+	//#################################################################################################
+	public void setObject(Object obj, Object value) {
+		if (type.isPrimitive())
+			throw new IllegalArgumentException("field " + field + " is of primitive type " + type);
+		if (value != null && !type.isInstance(value))
+			throw new IllegalArgumentException("field " + field + " cannot be set to " + value.getClass().getName());
+		if (useReflection) {
+			try {
+				field.set(obj, value);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+			return;
+		}
+		DexposedBridge.setFieldObjectNative(target(obj, type), handle, value);
+	}
+
+	public void setBoolean(Object obj, boolean value) {
+		if (useReflection) {
+			try {
+				field.setBoolean(obj, value);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+			return;
+		}
+		DexposedBridge.setFieldIntNative(target(obj, boolean.class), handle, value ? 1 : 0);
+	}
+
+	public void setByte(Object obj, byte value) {
+		if (useReflection) {
+			try {
+				field.setByte(obj, value);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+			return;
+		}
+		DexposedBridge.setFieldIntNative(target(obj, byte.class), handle, value);
+	}
+
+	public void setChar(Object obj, char value) {
+		if (useReflection) {
+			try {
+				field.setChar(obj, value);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+			return;
+		}
+		DexposedBridge.setFieldIntNative(target(obj, char.class), handle, value);
+	}
+
+	public void setShort(Object obj, short value) {
+		if (useReflection) {
+			try {
+				field.setShort(obj, value);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+			return;
+		}
+		DexposedBridge.setFieldIntNative(target(obj, short.class), handle, value);
+	}
+
+	public void setInt(Object obj, int value) {
+		if (useReflection) {
+			try {
+				field.setInt(obj, value);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+			return;
+		}
+		DexposedBridge.setFieldIntNative(target(obj, int.class), handle, value);
+	}
+
+	public void setLong(Object obj, long value) {
+		if (useReflection) {
+			try {
+				field.setLong(obj, value);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+			return;
+		}
+		DexposedBridge.setFieldLongNative(target(obj, long.class), handle, value);
+	}
+
+	public void setFloat(Object obj, float value) {
+		if (useReflection) {
+			try {
+				field.setFloat(obj, value);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+			return;
+		}
+		DexposedBridge.setFieldIntNative(target(obj, float.class), handle, Float.floatToRawIntBits(value));
+	}
+
+	public void setDouble(Object obj, double value) {
+		if (useReflection) {
+			try {
+				field.setDouble(obj, value);
+			} catch (IllegalAccessException e) {
+				throw accessError(e);
+			}
+			return;
+		}
+		DexposedBridge.setFieldLongNative(target(obj, double.class), handle, Double.doubleToRawLongBits(value));
+	}
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.taobao.android.dexposed;
+
+/**
+ * A hook which only observes calls. The native handler copies the receiver, the arguments
+ * and the result (or exception) of each call into a queue, and {@link #afterHookedMethodAsync}
+ * runs later on a background thread. The calling thread only pays for the enqueue.
+ * <p>If a method has no other callbacks, its calls do not go through Java at all.
+ * <p>The arguments are the ones the method was called with, changes made by other
+ * callbacks are not visible. What happens when the queue is full is set with
+ * {@link DexposedBridge#setAsyncHookOverflowPolicy(int)}.
+ */
+public abstract class XC_MethodAsyncHook extends XC_MethodHook {
+	public XC_MethodAsyncHook() {
+		super();
+	}
+	public XC_MethodAsyncHook(int priority) {
+		super(priority);
+	}
+
+	@Override
+	protected final void beforeHookedMethod(MethodHookParam param) throws Throwable {}
+
+	@Override
+	protected final void afterHookedMethod(MethodHookParam param) throws Throwable {}
+
+	/**
+	 * Called on the background thread after the invocation of the method.
+	 * <p>Changing the result or the throwable of <code>param</code> has no effect.
+	 */
+	protected abstract void afterHookedMethodAsync(MethodHookParam param) throws Throwable;
+}
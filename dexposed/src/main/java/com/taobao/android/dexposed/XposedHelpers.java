@@ -97,6 +97,14 @@ public class XposedHelpers {
 		}
 	}
 	
+	/**
+	 * Look up a field like {@link #findField} and resolve it for fast access without
+	 * reflection. Keep the result instead of calling this for every access.
+	 */
+	public static FieldAccessor findFieldAccessor(Class<?> clazz, String fieldName) {
+		return new FieldAccessor(findField(clazz, fieldName));
+	}
+	
 	private static Field findFieldRecursiveImpl(Class<?> clazz, String fieldName) throws NoSuchFieldException {
 		try {
 			return clazz.getDeclaredField(fieldName);
@@ -2,11 +2,16 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
-	dexposed.cpp \
-	art_quick_dexposed_invoke_handler.S
+	dexposed.cpp
+
+# the trampoline of hooked methods, see QuickArgumentVisitor for the frame it sets up
+LOCAL_SRC_FILES_arm := art_quick_dexposed_invoke_handler.S
+LOCAL_SRC_FILES_arm64 := art_quick_dexposed_invoke_handler_arm64.S
+LOCAL_SRC_FILES_x86_64 := art_quick_dexposed_invoke_handler_x86_64.S
 
 LOCAL_CFLAGS += -std=c++0x -O0 -DPLATFORM_SDK_VERSION=$(PLATFORM_SDK_VERSION) -Wno-unused-parameter 
 LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../dexposed_common \
 	$(JNI_H_INCLUDE) \
 	art/runtime/ \
 	art/runtime/entrypoints/quick/ \
@@ -38,5 +43,6 @@ else
 endif
 
 LOCAL_MULTILIB := both
+LOCAL_MODULE_TARGET_ARCH := arm arm64 x86_64
 
 include $(BUILD_SHARED_LIBRARY)
@@ -27,7 +27,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <alloca.h>
 #include <entrypoints/entrypoint_utils.h>
+#include <entrypoints/interpreter/interpreter_entrypoints.h>
 
 #include "quick_argument_visitor.cpp"
 
@@ -36,6 +38,9 @@ namespace art {
 
 	jclass dexposed_class = NULL;
 	jmethodID dexposed_handle_hooked_method = NULL;
+	// handleHookedMethod itself, it is invoked without going through JNI. Methods are not moved.
+	ArtMethod* dexposed_handle_hooked_art_method = NULL;
+	jmethodID dexposed_on_hook_budget_exceeded = NULL;
 	jclass additionalhookinfo_class = NULL;
 	jfieldID  additionalhookinfo_shorty_field = NULL;
 
@@ -54,14 +59,6 @@ namespace art {
 			return false;
 		}
 
-		additionalhookinfo_class = env->FindClass(DEXPOSED_ADDITIONAL_CLASS);
-		additionalhookinfo_class = reinterpret_cast<jclass>(env->NewGlobalRef(additionalhookinfo_class));
-		if (additionalhookinfo_class == NULL) {
-			LOG(ERROR) << "dexposed: Error while loading Dexposed class " << DEXPOSED_ADDITIONAL_CLASS;
-			env->ExceptionClear();
-			return false;
-		}
-
 		LOG(INFO) << "dexposed: now initializing, Found Dexposed class " << DEXPOSED_CLASS;
 		if (register_com_taobao_android_dexposed_DexposedBridge(env) != JNI_OK) {
 			LOG(ERROR) << "dexposed: Could not register natives for " << DEXPOSED_CLASS;
@@ -76,6 +73,14 @@ namespace art {
 
 		LOG(INFO) << "dexposed: initNative";
 
+		additionalhookinfo_class = env->FindClass(DEXPOSED_ADDITIONAL_CLASS);
+		additionalhookinfo_class = reinterpret_cast<jclass>(env->NewGlobalRef(additionalhookinfo_class));
+		if (additionalhookinfo_class == NULL) {
+			LOG(ERROR) << "dexposed: Error while loading Dexposed class " << DEXPOSED_ADDITIONAL_CLASS;
+			env->ExceptionClear();
+			return false;
+		}
+
 		dexposed_handle_hooked_method =
 				env->GetStaticMethodID(dexposed_class, "handleHookedMethod",
 						"(Ljava/lang/reflect/Member;ILjava/lang/Object;Ljava/lang/Object;[Ljava/lang/Object;)Ljava/lang/Object;");
@@ -84,6 +89,18 @@ namespace art {
 			env->ExceptionClear();
 			return false;
 		}
+		{
+			ScopedObjectAccess soa(env);
+			dexposed_handle_hooked_art_method = soa.DecodeMethod(dexposed_handle_hooked_method);
+		}
+
+		dexposed_on_hook_budget_exceeded =
+				env->GetStaticMethodID(dexposed_class, "onHookBudgetExceeded", "(Ljava/lang/Object;)V");
+		if (dexposed_on_hook_budget_exceeded == NULL) {
+			LOG(ERROR) << "dexposed: Could not find method " << DEXPOSED_CLASS << ".onHookBudgetExceeded()";
+			env->ExceptionClear();
+			return false;
+		}
 
 
 		additionalhookinfo_shorty_field =
@@ -97,18 +114,33 @@ namespace art {
 		return true;
 	}
 
+	static bool BootstrapResolveMethods(JNIEnv* env) {
+		return initNative(env, NULL);
+	}
+
+	// ART needs no device info, offsets or access patches, see dexposed_bootstrap.h
+	static const DexposedBootstrapFunction dexposed_bootstrap_phases[DEXPOSED_BOOTSTRAP_PHASES] = {
+		NULL, NULL, NULL, NULL, BootstrapResolveMethods,
+	};
+
+	// Only registers the natives, the rest is done by bootstrapNative() on the first hook.
 	extern "C" JNIEXPORT jint JNI_OnLoad(JavaVM* vm, void*)
 	{
 		JNIEnv* env = NULL;
 		jint result = -1;
+		uint64_t start_ns = dexposedNanoTime();
 
 		if (vm->GetEnv((void**) &env, JNI_VERSION_1_6) != JNI_OK) {
 			return result;
 		}
 
-		int keepLoadingDexposed = dexposedOnVmCreated(env, NULL);
-		if(keepLoadingDexposed)
-			initNative(env, NULL);
+		if (!dexposedThreadStateInit()) {
+			LOG(ERROR) << "dexposed: Could not create thread state key";
+			return result;
+		}
+
+		dexposedOnVmCreated(env, NULL);
+		dexposedBootstrapTimed(DEXPOSED_BOOTSTRAP_LOAD, start_ns);
 
 		return JNI_VERSION_1_6;
 	}
@@ -118,12 +150,43 @@ namespace art {
 		return reinterpret_cast<void*>(art_quick_dexposed_invoke_handler);
 	}
 
+	// The JNI slot of a method, it holds the hook info while the method is hooked.
+	static inline void* GetJniSlot(ArtMethod* method)
+		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+#if PLATFORM_SDK_VERSION < 22
+		return const_cast<void*>(reinterpret_cast<const void*>(method->GetNativeMethod()));
+#else
+		return const_cast<void*>(method->GetEntryPointFromJni());
+#endif
+	}
+
+	static inline void SetJniSlot(ArtMethod* method, void* value)
+		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+#if PLATFORM_SDK_VERSION < 22
+		method->SetNativeMethod(reinterpret_cast<uint8_t *>(value));
+#else
+		method->SetEntryPointFromJni(value);
+#endif
+	}
+
+	// Returns the hook info of a method, or NULL if it is not hooked. Whether it is hooked and
+	// the hook info are read as one snapshot, see dexposed_publish.h.
+	static inline DexposedHookInfo* GetHookInfo(ArtMethod* method)
+		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		DexposedHookInfo* hookInfo;
+		uint32_t sequence;
+		do {
+			sequence = dexposedPublishReadBegin();
+			hookInfo = dexposedIsHooked(method) ? reinterpret_cast<DexposedHookInfo*>(GetJniSlot(method)) : NULL;
+		} while (dexposedPublishReadRetry(sequence));
+		return hookInfo;
+	}
+
 	JValue InvokeXposedHandleHookedMethod(ScopedObjectAccessAlreadyRunnable& soa, const char* shorty,
-	                                    jobject rcvr_jobj, jmethodID method,
-	                                    std::vector<jvalue>& args)
+	                                    jobject rcvr_jobj, jmethodID method, const DexposedHookInfo* hookInfo,
+	                                    jobject additional_info, std::vector<jvalue>& args)
 		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
 
-		LOG(INFO) << "dexposed: InvokeXposedHandleHookedMethod";
 		  // Build argument array possibly triggering GC.
 		  soa.Self()->AssertThreadSuspensionIsAllowable();
 		  jobjectArray args_jobj = NULL;
@@ -153,43 +216,43 @@ namespace art {
 		    }
 		  }
 
-#if PLATFORM_SDK_VERSION < 22
-        const DexposedHookInfo *hookInfo =
-                (DexposedHookInfo *) (soa.DecodeMethod(method)->GetNativeMethod());
-#else
-        const DexposedHookInfo *hookInfo =
-                (DexposedHookInfo *) (soa.DecodeMethod(method)->GetEntryPointFromJni());
-#endif
-
 	  // Call XposedBridge.handleHookedMethod(Member method, int originalMethodId, Object additionalInfoObj,
 	  //                                      Object thisObject, Object[] args)
-	  jvalue invocation_args[5];
-	  invocation_args[0].l = hookInfo->reflectedMethod;
-	  invocation_args[1].i = 0;
-	  invocation_args[2].l = hookInfo->additionalInfo;
-	  invocation_args[3].l = rcvr_jobj;
-	  invocation_args[4].l = args_jobj;
-	  jobject result =
-	      soa.Env()->CallStaticObjectMethodA(dexposed_class,
-											dexposed_handle_hooked_method,
-	                                         invocation_args);
+	  // The method was resolved by initNative() and is invoked directly with the argument words a
+	  // quick frame would hold, skipping the checks, the method ID decoding and the local reference
+	  // of the result of a JNI call. Nothing may suspend the thread between decoding the arguments
+	  // and the invoke, which keeps them in its frame.
+	  uint32_t invocation_args[5];
+	  invocation_args[0] = StackReference<mirror::Object>::FromMirrorPtr(
+			  soa.Decode<mirror::Object*>(hookInfo->reflectedMethod)).AsVRegValue();
+	  invocation_args[1] = 0;
+	  invocation_args[2] = StackReference<mirror::Object>::FromMirrorPtr(
+			  soa.Decode<mirror::Object*>(additional_info)).AsVRegValue();
+	  invocation_args[3] = StackReference<mirror::Object>::FromMirrorPtr(
+			  soa.Decode<mirror::Object*>(rcvr_jobj)).AsVRegValue();
+	  invocation_args[4] = StackReference<mirror::Object>::FromMirrorPtr(
+			  soa.Decode<mirror::Object*>(args_jobj)).AsVRegValue();
+	  JValue result;
+	  dexposed_handle_hooked_art_method->Invoke(soa.Self(), invocation_args, sizeof(invocation_args),
+			  &result, "LLILLL");
 
 	  // Unbox the result if necessary and return it.
 	  if (UNLIKELY(soa.Self()->IsExceptionPending())) {
 	    return zero;
 	  } else {
-	    if (shorty[0] == 'V' || (shorty[0] == 'L' && result == NULL)) {
+	    if (shorty[0] == 'V' || (shorty[0] == 'L' && result.GetL() == NULL)) {
 	      return zero;
 	    }
-	    StackHandleScope<1> hs(soa.Self());
+	    StackHandleScope<2> hs(soa.Self());
+	    // The result is only held by the handle from here, the lookups below may suspend.
+	    Handle<mirror::Object> result_ref(hs.NewHandle(result.GetL()));
 	    MethodHelper mh_method(hs.NewHandle(soa.DecodeMethod(method)));
 	    // This can cause thread suspension.
 	    mirror::Object* rcvr = soa.Decode<mirror::Object*>(rcvr_jobj);
 	    ThrowLocation throw_location(rcvr, mh_method.GetMethod(), -1);
-	    mirror::Object* result_ref = soa.Decode<mirror::Object*>(result);
 	    mirror::Class* result_type = mh_method.GetReturnType();
 	    JValue result_unboxed;
-	    if (!UnboxPrimitiveForResult(throw_location, result_ref, result_type, &result_unboxed)) {
+	    if (!UnboxPrimitiveForResult(throw_location, result_ref.Get(), result_type, &result_unboxed)) {
 	      DCHECK(soa.Self()->IsExceptionPending());
 	      return zero;
 	    }
@@ -197,17 +260,210 @@ namespace art {
 	  }
 	}
 
-	// Handler for invocation on proxy methods. On entry a frame will exist for the proxy object method
-	// which is responsible for recording callee save registers. We explicitly place into jobjects the
-	// incoming reference arguments (so they survive GC). We invoke the invocation handler, which is a
-	// field within the proxy object, which will box the primitive arguments and deal with error cases.
-	extern "C" uint64_t artQuickDexposedInvokeHandler(ArtMethod* proxy_method,
-			Object* receiver, Thread* self, StackReference<ArtMethod>* sp)
+	// Calls target with the arguments of method still sitting in the quick frame. Nothing is
+	// boxed and no JNI transition is made.
+	static uint64_t InvokeFromQuickFrame(ArtMethod* method, ArtMethod* target, const char* shorty,
+			Thread* self, StackReference<ArtMethod>* sp)
 	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		// Register the top of the managed stack, making stack crawlable.
+		self->SetTopOfStack(sp, 0);
 
-		const bool is_static = proxy_method->IsStatic();
+		uint32_t shorty_len = strlen(shorty);
+		// Every argument takes at most two words, plus one for the receiver.
+		uint32_t* arg_array = reinterpret_cast<uint32_t*>(alloca((2 * shorty_len + 1) * sizeof(uint32_t)));
+		BuildQuickArgArrayVisitor visitor(sp, method->IsStatic(), shorty, shorty_len, arg_array);
+		visitor.VisitArguments();
 
-		LOG(INFO) << "dexposed: artQuickDexposedInvokeHandler isStatic:" << is_static;
+		JValue result;
+		target->Invoke(self, arg_array, visitor.GetNumberOfWords() * sizeof(uint32_t), &result, shorty);
+		return result.GetJ();
+	}
+
+	// Calls the backup of a hooked method, this is the path for calls which are not dispatched
+	// to the Java callbacks.
+	static uint64_t InvokeOriginalFromQuickFrame(ArtMethod* method, const DexposedHookInfo* hookInfo,
+			Thread* self, StackReference<ArtMethod>* sp)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		return InvokeFromQuickFrame(method, hookInfo->originalMethod, hookInfo->shorty, self, sp);
+	}
+
+	// Calls a method whose hook was removed after the caller read its entry point, the method
+	// has its own code again.
+	static uint64_t InvokeUnhookedFromQuickFrame(ArtMethod* method, Thread* self, StackReference<ArtMethod>* sp)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		const char* shorty;
+		{
+			StackHandleScope<1> hs(self);
+			MethodHelper mh(hs.NewHandle(method));
+			shorty = mh.GetShorty();
+		}
+		return InvokeFromQuickFrame(method, method, shorty, self, sp);
+	}
+
+	// Tells DexposedBridge that a hook exceeded its budget and is passed through from now on.
+	// A pending exception of the hooked call is kept and thrown again afterwards, a reference
+	// result is held in a handle across the upcall and reloaded in case the GC moved it.
+	static void NotifyHookBudgetExceeded(ScopedObjectAccessUnchecked& soa, const DexposedHookInfo* hookInfo,
+			const char* shorty, JValue* result)
+		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		JNIEnv* env = soa.Env();
+		jthrowable pending = env->ExceptionOccurred();
+		env->ExceptionClear();
+		const bool is_reference = pending == NULL && dexposedAsyncIsReference(shorty[0]);
+		StackHandleScope<1> hs(soa.Self());
+		Handle<mirror::Object> result_ref(hs.NewHandle(is_reference ? result->GetL() : nullptr));
+		DexposedThreadState* state = dexposedEnterCallbacks();
+		env->CallStaticVoidMethod(dexposed_class, dexposed_on_hook_budget_exceeded, hookInfo->additionalInfo);
+		dexposedLeaveCallbacks(state);
+		env->ExceptionClear();
+		if (is_reference) {
+			result->SetL(result_ref.Get());
+		}
+		if (pending != NULL) {
+			env->Throw(pending);
+		}
+	}
+
+	// Charges a dispatched call to the budget of its hook once its result is final. Only the time
+	// spent outside of the original method counts, clock.start_ns is 0 if the call was not measured.
+	static void RecordDispatchCost(ScopedObjectAccessUnchecked& soa, DexposedHookInfo* hookInfo,
+			const DexposedCallbackClock& clock, DexposedThreadState* clock_state, JValue* result)
+		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		if (clock.startNs == 0 || !dexposedBudgetEnabled(&hookInfo->control)) {
+			return;
+		}
+		const uint64_t now_ns = dexposedNanoTime();
+		if (dexposedBudgetRecord(&hookInfo->control, dexposedCallbackClockCost(clock_state, &clock, now_ns), now_ns)) {
+			NotifyHookBudgetExceeded(soa, hookInfo, hookInfo->shorty, result);
+		}
+	}
+
+	// Copies a call for the asynchronous callbacks: the primitive arguments into a DexposedAsyncCall,
+	// the references into an Object[] which is pinned in the queue. Returns NULL if the call is dropped.
+	static jobjectArray CaptureAsyncCall(ScopedObjectAccessUnchecked& soa, DexposedAsyncQueue* queue,
+			const DexposedHookInfo* hookInfo, jobject rcvr_jobj, const std::vector<jvalue>& args,
+			DexposedAsyncCall** call_out)
+		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		JNIEnv* env = soa.Env();
+		const char* shorty = hookInfo->shorty;
+		DexposedAsyncCall* call = dexposedAsyncCallCreate(shorty);
+		if (call == NULL) {
+			dexposedAsyncDrop(queue, NULL);
+			return NULL;
+		}
+
+		jthrowable pending = env->ExceptionOccurred();
+		env->ExceptionClear();
+		jobjectArray refs = env->NewObjectArray(DEXPOSED_ASYNC_REF_ARGS + args.size(),
+				WellKnownClasses::java_lang_Object, NULL);
+		if (refs == NULL) {
+			env->ExceptionClear();
+			dexposedAsyncDrop(queue, call);
+		} else {
+			env->SetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_ADDITIONAL_INFO, hookInfo->additionalInfo);
+			env->SetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_THIS, rcvr_jobj);
+			for (size_t i = 0; i < args.size(); ++i) {
+				if (dexposedAsyncIsReference(shorty[i + 1])) {
+					env->SetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_ARGS + i, args[i].l);
+				} else {
+					call->args[i] = args[i];
+				}
+			}
+			*call_out = call;
+		}
+		if (pending != NULL) {
+			env->Throw(pending);
+			env->DeleteLocalRef(pending);
+		}
+		return refs;
+	}
+
+	// Adds the result or the pending exception of the call to a captured call and queues it.
+	// A reference result is passed in result_ref, which the caller holds until it returns the
+	// result, since with the block policy this waits for room in kNative state.
+	static void SubmitAsyncCall(ScopedObjectAccessUnchecked& soa, DexposedAsyncQueue* queue,
+			jobjectArray refs, DexposedAsyncCall* call, const JValue& result, Handle<mirror::Object> result_ref)
+		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		JNIEnv* env = soa.Env();
+		const char* shorty = call->shorty;
+		jthrowable throwable = env->ExceptionOccurred();
+		env->ExceptionClear();
+		if (throwable != NULL) {
+			env->SetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_THROWABLE, throwable);
+		} else if (dexposedAsyncIsReference(shorty[0])) {
+			jobject result_jobj = soa.AddLocalReference<jobject>(result_ref.Get());
+			env->SetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_RESULT, result_jobj);
+			env->DeleteLocalRef(result_jobj);
+		} else {
+			call->result.j = result.GetJ();
+		}
+
+		uint32_t pos;
+		uint32_t attempt = 0;
+		while (!dexposedAsyncTryReserve(queue, &pos)) {
+			if (!dexposedAsyncMayBlock(queue)) {
+				dexposedAsyncDrop(queue, call);
+				call = NULL;
+				break;
+			}
+			ScopedThreadStateChange tsc(soa.Self(), kNative);
+			dexposedAsyncBackoff(queue, attempt++);
+		}
+		if (call != NULL) {
+			env->SetObjectArrayElement(queue->pins, pos & queue->mask, refs);
+			dexposedAsyncPublish(queue, pos, call);
+		}
+		env->DeleteLocalRef(refs);
+
+		if (throwable != NULL) {
+			env->Throw(throwable);
+			env->DeleteLocalRef(throwable);
+		}
+	}
+
+	// Returns the additional info a call is dispatched with: the one of the published patch set
+	// if the set patches the hook, else the one the hook was installed with. The patch set may
+	// be reclaimed as soon as the read section is left, so its info is copied to a local ref.
+	static jobject GetDispatchAdditionalInfo(ScopedObjectAccessUnchecked& soa, const DexposedHookInfo* hookInfo)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		if (LIKELY(dexposedPatchSet == NULL)) {
+			return hookInfo->additionalInfo;
+		}
+		DexposedThreadState* state = dexposedGetThreadState();
+		if (state == NULL) {
+			return hookInfo->additionalInfo;
+		}
+
+		jobject additional_info = hookInfo->additionalInfo;
+		dexposedEpochEnter(state);
+		jobject patched = dexposedPatchSetLookup(hookInfo->control.hookId);
+		if (patched != NULL) {
+			additional_info = soa.AddLocalReference<jobject>(soa.Decode<Object*>(patched));
+		}
+		dexposedEpochExit(state);
+		return additional_info;
+	}
+
+	// We explicitly place into jobjects the incoming reference arguments (so they survive GC).
+	// We invoke the invocation handler, which will box the primitive arguments and deal with
+	// error cases.
+	// Calls which are not to be dispatched run the original method.
+	static uint64_t DispatchHookedCall(ArtMethod* proxy_method, DexposedHookInfo* hookInfo,
+			Object* receiver, Thread* self, StackReference<ArtMethod>* sp, bool dispatch)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+
+		if (!dispatch) {
+			return InvokeOriginalFromQuickFrame(proxy_method, hookInfo, self, sp);
+		}
+
+		const bool measure_cost = dexposedBudgetEnabled(&hookInfo->control);
+		DexposedThreadState* clock_state = measure_cost ? dexposedGetThreadState() : NULL;
+		DexposedCallbackClock clock = { 0, 0 };
+		if (measure_cost) {
+			dexposedCallbackClockStart(clock_state, &clock);
+		}
+
+		const bool is_static = proxy_method->IsStatic();
 
 		// Ensure we don't get thread suspension until the object arguments are safely in jobjects.
 		const char* old_cause = self->StartAssertNoThreadSuspension(
@@ -232,54 +488,461 @@ namespace art {
 
 		std::vector < jvalue > args;
 
-#if PLATFORM_SDK_VERSION < 22
-        const DexposedHookInfo *hookInfo =
-                (DexposedHookInfo *) (proxy_method->GetNativeMethod());
-#else
-        const DexposedHookInfo *hookInfo =
-                (DexposedHookInfo *) (proxy_method->GetEntryPointFromJni());
-#endif
-
-
 		uint32_t shorty_len = 0;
 //		const char* shorty = proxy_method->GetShorty(&shorty_len);
 		const char* shorty = hookInfo->shorty;
 		shorty_len = strlen(hookInfo->shorty);
 
-		for(int i=0; i<shorty_len; ++i){
-			LOG(INFO) << "dexposed: artQuickDexposedInvokeHandler " << "shorty[" << i << "]:" << shorty[i];
-		}
-
 		BuildQuickArgumentVisitor local_ref_visitor(sp, is_static, shorty, shorty_len, &soa, &args);
 		local_ref_visitor.VisitArguments();
 		if (!is_static) {
 			DCHECK_GT(args.size(), 0U) << PrettyMethod(proxy_method);
 			args.erase(args.begin());
 		}
-		LOG(INFO) << "dexposed: artQuickDexposedInvokeHandler args.size:" << args.size();
-	    jmethodID proxy_methodid = soa.EncodeMethod(proxy_method);
 	    self->EndAssertNoThreadSuspension(old_cause);
-	    JValue result = InvokeXposedHandleHookedMethod(soa, shorty, rcvr_jobj, proxy_methodid, args);
+
+	    const uint32_t dispatch_mode = hookInfo->control.dispatchMode;
+	    DexposedAsyncQueue* async_queue = NULL;
+	    if (dispatch_mode != DEXPOSED_DISPATCH_SYNC) {
+	    	async_queue = dexposedAsyncAcquireQueue();
+	    }
+
+	    // a reference result is held in result_ref from the moment it is returned to us until
+	    // it is returned to the caller, the code in between may suspend the thread
+	    const bool returns_reference = dexposedAsyncIsReference(shorty[0]);
+	    StackHandleScope<1> hs(self);
+
+	    if (dispatch_mode == DEXPOSED_DISPATCH_ASYNC_ONLY) {
+	    	// No Java code runs on this thread: the call is copied before the original method may
+	    	// change the arguments, which is then called with the (possibly moved) references.
+	    	DexposedAsyncCall* call = NULL;
+	    	jobjectArray refs = async_queue == NULL ? NULL
+	    			: CaptureAsyncCall(soa, async_queue, hookInfo, rcvr_jobj, args, &call);
+	    	local_ref_visitor.FixupReferences();
+	    	JValue result;
+	    	DexposedOriginalCall original_call;
+	    	dexposedOriginalBegin(clock_state, &original_call);
+	    	result.SetJ(InvokeOriginalFromQuickFrame(proxy_method, hookInfo, self, sp));
+	    	dexposedOriginalEnd(clock_state, &original_call);
+	    	Handle<mirror::Object> result_ref(hs.NewHandle(
+	    			returns_reference && !self->IsExceptionPending() ? result.GetL() : nullptr));
+	    	if (refs != NULL) {
+	    		SubmitAsyncCall(soa, async_queue, refs, call, result, result_ref);
+	    	}
+	    	if (returns_reference) {
+	    		result.SetL(result_ref.Get());
+	    	}
+	    	RecordDispatchCost(soa, hookInfo, clock, clock_state, &result);
+	    	return result.GetJ();
+	    }
+
+	    // the asynchronous callbacks see the arguments the method was called with
+	    DexposedAsyncCall* async_call = NULL;
+	    jobjectArray async_refs = async_queue == NULL ? NULL
+	    		: CaptureAsyncCall(soa, async_queue, hookInfo, rcvr_jobj, args, &async_call);
+
+	    jmethodID proxy_methodid = soa.EncodeMethod(proxy_method);
+	    jobject additional_info = GetDispatchAdditionalInfo(soa, hookInfo);
+	    DexposedThreadState* thread_state = dexposedEnterCallbacks();
+	    JValue result = InvokeXposedHandleHookedMethod(soa, shorty, rcvr_jobj, proxy_methodid,
+	    		hookInfo, additional_info, args);
+	    dexposedLeaveCallbacks(thread_state);
+	    Handle<mirror::Object> result_ref(hs.NewHandle(
+	    		returns_reference && !self->IsExceptionPending() ? result.GetL() : nullptr));
+	    if (async_refs != NULL) {
+	    	SubmitAsyncCall(soa, async_queue, async_refs, async_call, result, result_ref);
+	    }
+	    if (returns_reference) {
+	    	result.SetL(result_ref.Get());
+	    }
+	    RecordDispatchCost(soa, hookInfo, clock, clock_state, &result);
 	    local_ref_visitor.FixupReferences();
 	    return result.GetJ();
 	}
 
-	static void EnableXposedHook(JNIEnv* env, ArtMethod* art_method, jobject additional_info)
-	  SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+	// Records the arguments of a traced call into record. Objects are recorded as their identity
+	// hash, computing it may suspend the thread, so they are first put into local references
+	// like for a dispatched call. Returns the receiver, which may have been moved.
+	static Object* TraceArguments(ArtMethod* method, const DexposedHookInfo* hookInfo, Object* receiver,
+			Thread* self, StackReference<ArtMethod>* sp, DexposedTraceRecord* record)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		const bool is_static = method->IsStatic();
+		const char* shorty = hookInfo->shorty;
 
-	  LOG(INFO) << "dexposed: >>> EnableXposedHook" << art_method << " " << PrettyMethod(art_method);
-	  if (dexposedIsHooked(art_method)) {
-		// Already hooked
-		return;
-	  }
-//	  else if (UNLIKELY(art_method->IsXposedOriginalMethod())) {
-//		// This should never happen
-//		ThrowIllegalArgumentException(nullptr, StringPrintf("Cannot hook the method backup: %s", PrettyMethod(art_method).c_str()).c_str());
-//		return;
-//	  }
+		const char* old_cause = self->StartAssertNoThreadSuspension("Adding to IRT traced arguments");
+		self->SetTopOfStack(sp, 0);
+		JNIEnvExt* env = self->GetJniEnv();
+		ScopedObjectAccessUnchecked soa(env);
+		ScopedJniEnvLocalRefState env_state(env);
+		std::vector<jvalue> args;
+		BuildQuickArgumentVisitor local_ref_visitor(sp, is_static, shorty, strlen(shorty), &soa, &args);
+		local_ref_visitor.VisitArguments();
+		self->EndAssertNoThreadSuspension(old_cause);
 
-	  ScopedObjectAccess soa(env);
+		size_t first_arg = 0;
+		if (!is_static) {
+			record->thisHash = soa.Decode<Object*>(args[0].l)->IdentityHashCode();
+			first_arg = 1;
+		}
+		for (size_t i = first_arg; i < args.size(); ++i) {
+			switch (shorty[i - first_arg + 1]) {
+			case 'L': {
+				Object* obj = soa.Decode<Object*>(args[i].l);
+				dexposedTraceArg(record, obj != NULL ? (uint32_t) obj->IdentityHashCode() : 0);
+				break;
+			}
+			case 'J':
+			case 'D':
+				dexposedTraceArg(record, args[i].j);
+				break;
+			default:
+				dexposedTraceArg(record, (uint32_t) args[i].i);
+			}
+		}
+
+		if (!is_static) {
+			receiver = soa.Decode<Object*>(args[0].l);
+		}
+		local_ref_visitor.FixupReferences();
+		return receiver;
+	}
+
+	// Records the result of a traced call and writes the record to the trace file. An object
+	// result is kept in a handle while it is hashed, result is updated if it moved.
+	static void TraceResult(Thread* self, const DexposedHookInfo* hookInfo, uint64_t* result,
+			DexposedTraceRecord* record)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		if (self->IsExceptionPending()) {
+			dexposedTraceEnd(record, (uint32_t) self->GetException(nullptr)->IdentityHashCode(), true);
+		} else if (hookInfo->shorty[0] == 'L' && *result != 0) {
+			StackHandleScope<1> hs(self);
+			Handle<Object> h_result(hs.NewHandle(reinterpret_cast<Object*>(static_cast<uintptr_t>(*result))));
+			uint32_t hash = h_result->IdentityHashCode();
+			*result = reinterpret_cast<uintptr_t>(h_result.Get());
+			dexposedTraceEnd(record, hash, false);
+		} else {
+			dexposedTraceEnd(record, hookInfo->shorty[0] == 'L' ? 0 : *result, false);
+		}
+	}
+
+	// Dispatches a call which passed the thread filter, recording it first if the hook is traced.
+	static uint64_t HandleHookedCall(ArtMethod* proxy_method, DexposedHookInfo* hookInfo,
+			Object* receiver, Thread* self, StackReference<ArtMethod>* sp, bool dispatch)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		if (LIKELY(!dexposedTraceEnabled(&hookInfo->control))) {
+			return DispatchHookedCall(proxy_method, hookInfo, receiver, self, sp, dispatch);
+		}
+
+		DexposedTraceRecord record;
+		dexposedTraceBegin(&record, &hookInfo->control);
+		receiver = TraceArguments(proxy_method, hookInfo, receiver, self, sp, &record);
+		uint64_t result = DispatchHookedCall(proxy_method, hookInfo, receiver, self, sp, dispatch);
+		TraceResult(self, hookInfo, &result, &record);
+		return result;
+	}
+
+	// Builds the memoization key of a call from the arguments in the quick frame, String arguments
+	// are keyed by their characters. Returns false if the call cannot be memoized.
+	static bool BuildMemoKey(ArtMethod* method, const DexposedHookInfo* hookInfo,
+			StackReference<ArtMethod>* sp, DexposedMemoKey* key)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		if (!method->IsStatic()) {
+			return false;
+		}
+		const char* shorty = hookInfo->shorty;
+		uint32_t shorty_len = strlen(shorty);
+		uint32_t* arg_array = reinterpret_cast<uint32_t*>(alloca(2 * shorty_len * sizeof(uint32_t)));
+		BuildQuickArgArrayVisitor visitor(sp, true, shorty, shorty_len, arg_array);
+		visitor.VisitArguments();
+
+		// The references are read in place, nothing here may suspend the thread.
+		dexposedMemoKeyInit(key);
+		uint32_t word = 0;
+		for (uint32_t i = 1; i < shorty_len; ++i) {
+			switch (shorty[i]) {
+			case 'L': {
+				mirror::String* string = reinterpret_cast<mirror::String*>(static_cast<uintptr_t>(arg_array[word++]));
+				if (string == NULL) {
+					dexposedMemoKeyAdd(key, 0);
+				} else {
+					dexposedMemoKeyAddChars(key, string->GetCharArray()->GetData() + string->GetOffset(),
+							string->GetLength());
+				}
+				break;
+			}
+			case 'J':
+			case 'D':
+				dexposedMemoKeyAdd(key, arg_array[word++]);
+				dexposedMemoKeyAdd(key, arg_array[word++]);
+				break;
+			default:
+				dexposedMemoKeyAdd(key, arg_array[word++]);
+			}
+		}
+		return !key->overflow;
+	}
+
+	// Answers a call of a memoized hook which is to be dispatched from its cache. Calls which miss
+	// are handled like any other and store their result unless they threw or the cache was
+	// invalidated meanwhile.
+	static uint64_t MemoizedCall(ArtMethod* proxy_method, DexposedHookInfo* hookInfo,
+			Object* receiver, Thread* self, StackReference<ArtMethod>* sp)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		DexposedMemoKey key;
+		DexposedThreadState* state = dexposedGetThreadState();
+		if (state == NULL || !BuildMemoKey(proxy_method, hookInfo, sp, &key)) {
+			return HandleHookedCall(proxy_method, hookInfo, receiver, self, sp, true);
+		}
+		const uint32_t hash = dexposedMemoKeyHash(&key);
+
+		bool hit = false;
+		uint64_t result = 0;
+		uint32_t generation = 0;
+		dexposedEpochEnter(state);
+		DexposedMemoCache* cache = hookInfo->control.memoCache;
+		DexposedMemoCache* missed_cache = cache;
+		if (cache != NULL) {
+			ObjectArray<Object>* pins = cache->referenceResult
+					? self->DecodeJObject(cache->pins)->AsObjectArray<Object>() : NULL;
+			generation = dexposedMemoGeneration(cache);
+			uint32_t set = dexposedMemoSetOf(cache, hash);
+			dexposedMemoLock(cache, set);
+			DexposedMemoEntry* entry = dexposedMemoFindLocked(cache, set, &key, hash, generation);
+			if (entry != NULL) {
+				hit = true;
+				result = pins != NULL ? reinterpret_cast<uintptr_t>(pins->Get(dexposedMemoIndexOf(cache, entry)))
+						: entry->result;
+			}
+			dexposedMemoUnlock(cache, set);
+		}
+		dexposedEpochExit(state);
+		if (hit) {
+			return result;
+		}
+
+		result = HandleHookedCall(proxy_method, hookInfo, receiver, self, sp, true);
+		if (self->IsExceptionPending()) {
+			return result;
+		}
+
+		uint32_t* key_copy = dexposedMemoCopyKey(&key);
+		if (key_copy == NULL) {
+			return result;
+		}
+		uint32_t* old_key = key_copy;
+		dexposedEpochEnter(state);
+		cache = hookInfo->control.memoCache;
+		// a cache installed meanwhile may already have dropped what the result depends on
+		if (cache != NULL && cache == missed_cache) {
+			ObjectArray<Object>* pins = cache->referenceResult
+					? self->DecodeJObject(cache->pins)->AsObjectArray<Object>() : NULL;
+			uint32_t set = dexposedMemoSetOf(cache, hash);
+			dexposedMemoLock(cache, set);
+			DexposedMemoEntry* entry = dexposedMemoClaimLocked(cache, set, &key, hash, generation,
+					key_copy, &old_key);
+			// NULL if the cache was invalidated while the result was computed
+			if (entry != NULL && pins != NULL) {
+				pins->Set<false>(dexposedMemoIndexOf(cache, entry),
+						reinterpret_cast<Object*>(static_cast<uintptr_t>(result)));
+			} else if (entry != NULL) {
+				entry->result = result;
+			}
+			dexposedMemoUnlock(cache, set);
+		}
+		dexposedEpochExit(state);
+		free(old_key);
+		return result;
+	}
+
+	// Collects the frames of a sampled call stack. Frames of compiled code keep their return pc,
+	// frames of the interpreter keep their dex pc and have the low bit of their method set.
+	class CaptureStackVisitor : public StackVisitor {
+	public:
+		CaptureStackVisitor(Thread* thread, DexposedStackFrame* frames, uint32_t depth)
+			SHARED_LOCKS_REQUIRED(Locks::mutator_lock_)
+			: StackVisitor(thread, nullptr), frames_(frames), depth_(depth) {}
+
+		bool VisitFrame() SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+			if (depth_ >= DEXPOSED_STACK_MAX_DEPTH) {
+				return false;
+			}
+			ArtMethod* method = GetMethod();
+			if (method->IsRuntimeMethod()) {
+				return true;
+			}
+			DexposedStackFrame* frame = &frames_[depth_++];
+			if (GetCurrentQuickFrame() != nullptr) {
+				frame->method = method;
+				frame->pc = GetCurrentQuickFramePc();
+			} else {
+				frame->method = reinterpret_cast<uint8_t*>(method) + 1;
+				frame->pc = GetDexPc(false);
+			}
+			return true;
+		}
+
+		uint32_t GetDepth() const {
+			return depth_;
+		}
+
+	private:
+		DexposedStackFrame* const frames_;
+		uint32_t depth_;
+	};
+
+	// Captures the stack of a sampled call into the buffer of the thread and adds it to the trie.
+	// The frame size of the hooked method cannot be looked up from its code, which is the
+	// handler now, so its frame is added by hand and the walk starts at the caller.
+	static void SampleStack(ArtMethod* proxy_method, Thread* self, StackReference<ArtMethod>* sp,
+			DexposedStackFrame* frames)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		frames[0].method = proxy_method;
+		frames[0].pc = 0;
+		StackReference<ArtMethod>* caller_sp = reinterpret_cast<StackReference<ArtMethod>*>(
+				reinterpret_cast<byte*>(sp)
+				+ Runtime::Current()->GetCalleeSaveMethod(Runtime::kRefsAndArgs)->GetFrameSizeInBytes());
+		self->SetTopOfStack(caller_sp, QuickArgumentVisitor::GetCallingPc(sp));
+		CaptureStackVisitor visitor(self, frames, 1);
+		visitor.WalkStack();
+		self->SetTopOfStack(sp, 0);
+		dexposedStackRecord(frames, visitor.GetDepth());
+	}
 
+	// Counts a sampled call of a profiled constructor for its class and calling method. Calls made
+	// by another constructor of the class, i.e. this(...), do not allocate. The class may be moved by
+	// a compacting collection, it is counted by its descriptor in the dex file, which stays mapped.
+	// ArtMethods are not moved.
+	static void RecordAllocation(ArtMethod* constructor, const DexposedHookInfo* hookInfo,
+			StackReference<ArtMethod>* sp, DexposedThreadState* state)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		if (!dexposedAllocationSampled(&hookInfo->control, state)) {
+			return;
+		}
+		ArtMethod* caller = QuickArgumentVisitor::GetCallingMethod(sp);
+		Class* klass = constructor->GetDeclaringClass();
+		if (caller != NULL && caller->IsConstructor() && caller->GetDeclaringClass() == klass) {
+			return;
+		}
+		dexposedAllocationRecord(constructor->GetDeclaringClassDescriptor(), caller);
+	}
+
+	// Passes a call through if its thread is filtered out, else answers it from the memoization
+	// cache or handles it. Only calls which are to be dispatched may use the cache, a disabled
+	// group, a tripped budget or a nested call passed through must run the original method.
+	static uint64_t RouteHookedCall(ArtMethod* proxy_method, DexposedHookInfo* hookInfo,
+			Object* receiver, Thread* self, StackReference<ArtMethod>* sp)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		if (UNLIKELY(!dexposedThreadFilterAccepts(&hookInfo->control))) {
+			return InvokeOriginalFromQuickFrame(proxy_method, hookInfo, self, sp);
+		}
+		const bool dispatch = dexposedShouldDispatch(&hookInfo->control);
+		if (UNLIKELY(hookInfo->control.memoCache != NULL) && dispatch) {
+			return MemoizedCall(proxy_method, hookInfo, receiver, self, sp);
+		}
+		return HandleHookedCall(proxy_method, hookInfo, receiver, self, sp, dispatch);
+	}
+
+	// Handler for invocation on hooked methods. On entry a frame will exist for the hooked method
+	// which is responsible for recording callee save registers.
+	extern "C" uint64_t artQuickDexposedInvokeHandler(ArtMethod* proxy_method,
+			Object* receiver, Thread* self, StackReference<ArtMethod>* sp)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+
+		// The hook info stays allocated until the call ended, see dexposed_memory.h.
+		DexposedThreadState* state = dexposedGetThreadState();
+		if (LIKELY(state != NULL)) {
+			dexposedEpochEnter(state);
+		}
+		DexposedHookInfo *hookInfo = GetHookInfo(proxy_method);
+		if (LIKELY(hookInfo != NULL)) {
+			dexposedHookCallBegin(&hookInfo->control);
+			// The caller profile is read in the same section, the return pc becomes a dex pc
+			// only when the profile is queried.
+			DexposedCallerTable* callers = hookInfo->control.callerTable;
+			if (UNLIKELY(callers != NULL) && LIKELY(state != NULL)) {
+				dexposedCallerRecord(callers, QuickArgumentVisitor::GetCallingMethod(sp),
+						QuickArgumentVisitor::GetCallingPc(sp));
+			}
+		}
+		if (LIKELY(state != NULL)) {
+			dexposedEpochExit(state);
+		}
+		if (UNLIKELY(hookInfo == NULL)) {
+			return InvokeUnhookedFromQuickFrame(proxy_method, self, sp);
+		}
+		DexposedStackFrame* stack_frames = dexposedStackSample(&hookInfo->control, state);
+		if (UNLIKELY(stack_frames != NULL)) {
+			SampleStack(proxy_method, self, sp, stack_frames);
+		}
+		if (UNLIKELY(hookInfo->control.allocationSamplingRate != 0)) {
+			RecordAllocation(proxy_method, hookInfo, sp, state);
+		}
+		const bool systrace = dexposedSystraceActive(&hookInfo->control);
+		if (UNLIKELY(systrace)) {
+			dexposedSystraceBegin(&hookInfo->control);
+		}
+
+		uint64_t result;
+		DexposedStatsSlot* stats_slot = hookInfo->control.statsSlot;
+		if (LIKELY(stats_slot == NULL)) {
+			result = RouteHookedCall(proxy_method, hookInfo, receiver, self, sp);
+		} else {
+			const uint64_t start_ns = dexposedNanoTime();
+			result = RouteHookedCall(proxy_method, hookInfo, receiver, self, sp);
+			dexposedStatsRecord(stats_slot, dexposedNanoTime() - start_ns, self->IsExceptionPending());
+		}
+		if (UNLIKELY(systrace)) {
+			dexposedSystraceEnd();
+		}
+		dexposedHookCallEnd(&hookInfo->control);
+		return result;
+	}
+
+	// Switches art_method to the handler while other threads may be calling it, between
+	// dexposedBeginPublish() and dexposedEndPublish(). The quick entry point is the switch, it is
+	// a single aligned word, so a caller runs either the original code or the complete hook. The
+	// JNI slot is not used by the code of a non-native method, the hook info is in place before
+	// the entry point and the access flags stay as they are. Native methods are not hooked, see
+	// EnableXposedHook().
+	static void PublishHook(ArtMethod* art_method, DexposedHookInfo* hookInfo)
+		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		SetJniSlot(art_method, hookInfo);
+		__sync_synchronize();
+		art_method->SetEntryPointFromQuickCompiledCode(GetQuickDexposedInvokeHandler());
+	}
+
+	// Gives art_method back the code of its backup, the reverse of PublishHook().
+	static void UnpublishHook(ArtMethod* art_method, DexposedHookInfo* hookInfo)
+		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		ArtMethod* backup_method = hookInfo->originalMethod;
+		art_method->SetEntryPointFromQuickCompiledCode(backup_method->GetEntryPointFromQuickCompiledCode());
+		__sync_synchronize();
+		SetJniSlot(art_method, GetJniSlot(backup_method));
+	}
+
+	// Frees a removed hook once no call uses it anymore, see dexposed_memory.h.
+	static void FreeHookInfo(DexposedHookControl* control, JNIEnv* env) {
+		DexposedHookInfo* hookInfo = reinterpret_cast<DexposedHookInfo*>(
+				reinterpret_cast<uint8_t*>(control) - offsetof(DexposedHookInfo, control));
+		// the backup ArtMethod is only reachable through its Method object
+		env->DeleteGlobalRef(hookInfo->reflectedMethod);
+		env->DeleteGlobalRef(hookInfo->additionalInfo);
+		free(const_cast<char*>(hookInfo->shorty));
+		dexposedSystraceFree(control);
+		// installed by a JNI method which held the hook while it was removed, no call can read them anymore
+		if (control->memoCache != NULL) {
+			dexposedMemoFree(control->memoCache, env);
+		}
+		if (control->callerTable != NULL) {
+			dexposedCallerFree(control->callerTable, env);
+		}
+		free(hookInfo);
+	}
+
+	// Creates the hook info of art_method, with a backup of the method as it is now.
+	static DexposedHookInfo* CreateHookInfo(JNIEnv* env, ScopedObjectAccess& soa, ArtMethod* art_method,
+			jobject additional_info, const char* shorty, uint32_t* hook_bytes)
+	  SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
 	  // Create a backup of the ArtMethod object
 	  ArtMethod* backup_method = down_cast<ArtMethod*>(art_method->Clone(soa.Self()));
 	  // Set private flag to avoid virtual table lookups during invocation
@@ -291,28 +954,192 @@ namespace art {
 	  } else {
 	    reflect_method = env->AllocObject(WellKnownClasses::java_lang_reflect_Method);
 	  }
-	  env->SetObjectField(reflect_method, WellKnownClasses::java_lang_reflect_AbstractMethod_artMethod,
-	      env->NewGlobalRef(soa.AddLocalReference<jobject>(backup_method)));
+	  // The Method object keeps the backup alive, it needs no reference of its own
+	  jobject backup_ref = soa.AddLocalReference<jobject>(backup_method);
+	  env->SetObjectField(reflect_method, WellKnownClasses::java_lang_reflect_AbstractMethod_artMethod, backup_ref);
+	  env->DeleteLocalRef(backup_ref);
 	  // Save extra information in a separate structure, stored instead of the native method
 	  DexposedHookInfo* hookInfo = reinterpret_cast<DexposedHookInfo*>(calloc(1, sizeof(DexposedHookInfo)));
 	  hookInfo->reflectedMethod = env->NewGlobalRef(reflect_method);
 	  hookInfo->additionalInfo = env->NewGlobalRef(additional_info);
 	  hookInfo->originalMethod = backup_method;
+	  hookInfo->shorty = strdup(shorty);
+	  dexposedHookControlInit(&hookInfo->control);
+
+	  *hook_bytes = sizeof(DexposedHookInfo) + strlen(hookInfo->shorty) + 1
+			  + backup_method->SizeOf() + soa.Decode<Object*>(reflect_method)->SizeOf();
+	  return hookInfo;
+	}
+
+	static void EnableXposedHook(JNIEnv* env, ArtMethod* art_method, jobject additional_info)
+	  SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+
+	  LOG(INFO) << "dexposed: >>> EnableXposedHook" << art_method << " " << PrettyMethod(art_method);
+	  if (dexposedIsHooked(art_method)) {
+		// Already hooked
+		return;
+	  }
+//	  else if (UNLIKELY(art_method->IsXposedOriginalMethod())) {
+//		// This should never happen
+//		ThrowIllegalArgumentException(nullptr, StringPrintf("Cannot hook the method backup: %s", PrettyMethod(art_method).c_str()).c_str());
+//		return;
+//	  }
+	  if (art_method->IsNative()) {
+		// The hook info would take the JNI slot and the method would stop being native while calls
+		// may still be in its JNI stub, whose frames are then walked as the wrong kind. Java rejects
+		// native methods, their JNI function can be hooked instead, see dexposed_jni_hook.h.
+		LOG(ERROR) << "dexposed: native methods cannot be hooked: " << PrettyMethod(art_method);
+		return;
+	  }
+
+	  ScopedObjectAccess soa(env);
 
 	  jstring shorty = (jstring)env->GetObjectField(additional_info,additionalhookinfo_shorty_field);
-	  hookInfo->shorty = env->GetStringUTFChars(shorty, 0);
-	  LOG(INFO) << "dexposed: >>> EnableXposedHook shorty:" << hookInfo->shorty;
+	  const char* shorty_chars = env->GetStringUTFChars(shorty, 0);
+	  uint32_t hook_bytes;
+	  DexposedHookInfo* hookInfo = CreateHookInfo(env, soa, art_method, additional_info, shorty_chars,
+			  &hook_bytes);
+	  env->ReleaseStringUTFChars(shorty, shorty_chars);
+
+	  // Publish the hook, nothing in between may suspend the thread
+	  dexposedBeginPublish();
+	  if (dexposedIsHooked(art_method)) {
+		// Hooked by another thread meanwhile
+		dexposedEndPublish();
+		FreeHookInfo(&hookInfo->control, env);
+		return;
+	  }
+	  PublishHook(art_method, hookInfo);
+	  dexposedMemoryAccount(&hookInfo->control, hook_bytes, 2);
+	  dexposedEndPublish();
 
-#if PLATFORM_SDK_VERSION < 22
-        art_method->SetNativeMethod(reinterpret_cast<uint8_t *>(hookInfo));
+	  if (dexposedPerfMapStarted()) {
+		dexposedPerfMapAddHook(GetQuickDexposedInvokeHandler(), PrettyMethod(art_method).c_str());
+	  }
+	}
+
+	// Coverage is not supported on ART, DexposedBridge.coverMethod() does not get here. Counting
+	// takes either a stub in front of the compiled code, which breaks the lookups of its method
+	// header (frame info, dex pcs), or a hook per method, whose backup, Method object and global
+	// reference are too much for the thousands of methods coverage is meant for, and whose
+	// handler is far from a counting stub.
+	static jint com_taobao_android_dexposed_DexposedBridge_coverMethodNative(
+			JNIEnv*, jclass, jobject, jobject, jint, jstring) {
+		return -1;
+	}
+
+	// Constant stubs return the bits of a constant without any frame or call, r0 holds the low and
+	// r1 the high word of the result, which is how quick code returns every type.
+#if defined(__arm__)
+	static const uint32_t kConstantStubTemplate[] = {
+		0xe59f0004,  // ldr   r0, [pc, #4]       @ low word
+		0xe59f1004,  // ldr   r1, [pc, #4]       @ high word
+		0xe12fff1e,  // bx    lr
+		0,           // low word
+		0,           // high word
+	};
+	static const size_t kConstantStubLowWord = 3;
+	static const size_t kConstantStubHighWord = 4;
+#endif
+
+	// Returns a stub returning bits, or NULL if stubs are not supported on this architecture.
+	static const void* CreateConstantStub(uint64_t bits, const char* name) {
+#if defined(__arm__)
+		const size_t stub_size = sizeof(kConstantStubTemplate);
+		uint32_t* stub = reinterpret_cast<uint32_t*>(dexposedAllocateStub(stub_size));
+		if (stub == NULL) {
+			return NULL;
+		}
+		memcpy(stub, kConstantStubTemplate, stub_size);
+		stub[kConstantStubLowWord] = static_cast<uint32_t>(bits);
+		stub[kConstantStubHighWord] = static_cast<uint32_t>(bits >> 32);
+		__builtin___clear_cache(reinterpret_cast<char*>(stub), reinterpret_cast<char*>(stub) + stub_size);
+		dexposedPerfMapAdd(stub, stub_size, "constant", name);
+		return stub;
 #else
-        art_method->SetEntryPointFromJni(reinterpret_cast<void *>(hookInfo));
+		return NULL;
 #endif
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_replaceWithConstantNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jlong bits) {
+
+		ScopedObjectAccess soa(env);
+		jobject javaArtMethod = env->GetObjectField(java_method,
+				WellKnownClasses::java_lang_reflect_AbstractMethod_artMethod);
+		ArtMethod* method = soa.Decode<mirror::ArtMethod*>(javaArtMethod);
+		if (method == NULL || method->IsAbstract()) {
+			return false;
+		}
+
+		const void* stub = CreateConstantStub(bits, PrettyMethod(method).c_str());
+		if (stub == NULL) {
+			return false;
+		}
+		// A hook installed after the check would have its entry point replaced by the stub, the
+		// check and the switch are one publish. The stub of a method hooked meanwhile is never
+		// used, like any stub it is not freed.
+		dexposedBeginPublish();
+		if (dexposedIsHooked(method)) {
+			dexposedEndPublish();
+			return false;
+		}
+		// The interpreter calls through the compiled code bridge from now on, else it would run
+		// the dex code of the method itself. The quick entry point is the switch.
+		method->SetEntryPointFromInterpreter(artInterpreterToCompiledCodeBridge);
+		__sync_synchronize();
+		method->SetEntryPointFromQuickCompiledCode(stub);
+		dexposedEndPublish();
+		return true;
+	}
+
+	// The JNI stub of a native method calls the function in the JNI slot on every call, so a hook is
+	// switched in with a single store, see dexposed_jni_hook.h. Native methods are not hooked from
+	// Java, the slot holds their JNI function only.
+	static jboolean com_taobao_android_dexposed_DexposedBridge_hookJniFunctionNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jlong hook) {
+
+		ScopedObjectAccess soa(env);
+		jobject javaArtMethod = env->GetObjectField(java_method,
+				WellKnownClasses::java_lang_reflect_AbstractMethod_artMethod);
+		ArtMethod* method = soa.Decode<mirror::ArtMethod*>(javaArtMethod);
+		// an unregistered method still has the dlsym lookup stub, which would replace the function
+		if (method == NULL || hook == 0 || !method->IsNative() || !method->IsRegistered()) {
+			return false;
+		}
 
-	  art_method->SetEntryPointFromQuickCompiledCode(GetQuickDexposedInvokeHandler());
-//	  art_method->SetEntryPointFromInterpreter(art::artInterpreterToCompiledCodeBridge);
-	  // Adjust access flags
-	  art_method->SetAccessFlags((art_method->GetAccessFlags() & ~kAccNative) /*| kAccXposedHookedMethod*/);
+		DexposedJniHookStub* stub = dexposedJniHookCreate(
+				reinterpret_cast<const DexposedJniHook*>(static_cast<uintptr_t>(hook)),
+				PrettyMethod(method).c_str());
+		if (stub == NULL) {
+			return false;
+		}
+		dexposedBeginPublish();
+		stub->original = GetJniSlot(method);
+		__sync_synchronize();
+		SetJniSlot(method, const_cast<void*>(stub->code));
+		dexposedEndPublish();
+		return true;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_unhookJniFunctionNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint) {
+
+		ScopedObjectAccess soa(env);
+		jobject javaArtMethod = env->GetObjectField(java_method,
+				WellKnownClasses::java_lang_reflect_AbstractMethod_artMethod);
+		ArtMethod* method = soa.Decode<mirror::ArtMethod*>(javaArtMethod);
+		if (method == NULL || !method->IsNative()) {
+			return false;
+		}
+
+		dexposedBeginPublish();
+		DexposedJniHookStub* stub = dexposedJniHookFind(GetJniSlot(method));
+		if (stub != NULL) {
+			SetJniSlot(method, stub->original);
+		}
+		dexposedEndPublish();
+		return stub != NULL;
 	}
 
 	static void com_taobao_android_dexposed_DexposedBridge_hookMethodNative(
@@ -330,6 +1157,586 @@ namespace art {
 	    EnableXposedHook(env, method, additional_info);
 	}
 
+	// Returns the hook info for a hooked java.lang.reflect.Method/Constructor, or NULL if it is not hooked.
+	// It counts as an active call until dexposedHookCallEnd(), so a concurrent removeHookNative() does
+	// not free it meanwhile.
+	static DexposedHookInfo* AcquireHookInfo(ScopedObjectAccess& soa, jobject java_method)
+		SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		jobject javaArtMethod = soa.Env()->GetObjectField(java_method,
+				WellKnownClasses::java_lang_reflect_AbstractMethod_artMethod);
+		ArtMethod* method = soa.Decode<mirror::ArtMethod*>(javaArtMethod);
+		DexposedThreadState* state = dexposedGetThreadState();
+		if (method == NULL || state == NULL) {
+			return NULL;
+		}
+		dexposedEpochEnter(state);
+		DexposedHookInfo* hookInfo = GetHookInfo(method);
+		if (hookInfo != NULL) {
+			dexposedHookCallBegin(&hookInfo->control);
+		}
+		dexposedEpochExit(state);
+		return hookInfo;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_removeHookNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint) {
+
+		ScopedObjectAccess soa(env);
+		jobject javaArtMethod = env->GetObjectField(java_method,
+				WellKnownClasses::java_lang_reflect_AbstractMethod_artMethod);
+		ArtMethod* method = soa.Decode<mirror::ArtMethod*>(javaArtMethod);
+		if (method == NULL) {
+			return false;
+		}
+
+		dexposedBeginPublish();
+		if (!dexposedIsHooked(method)) {
+			dexposedEndPublish();
+			return false;
+		}
+		DexposedHookInfo* hookInfo = reinterpret_cast<DexposedHookInfo*>(GetJniSlot(method));
+		UnpublishHook(method, hookInfo);
+		dexposedEndPublish();
+
+		dexposedMemoInstall(env, &hookInfo->control, NULL);
+		dexposedCallerInstall(env, &hookInfo->control, NULL);
+		dexposedHookRemoved(env, &hookInfo->control, FreeHookInfo);
+		return true;
+	}
+
+	static jint com_taobao_android_dexposed_DexposedBridge_reclaimRemovedHooksNative(JNIEnv* env, jclass) {
+		return dexposedHookCollect(env, FreeHookInfo);
+	}
+
+	static jintArray com_taobao_android_dexposed_DexposedBridge_getHookMemoryUsageNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return NULL;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		return dexposedHookMemoryUsage(env, &hookInfo->control);
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setSamplingRateNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jint rate) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		hookInfo->control.samplingRate = rate;
+		return true;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setDispatchModeNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jint mode) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		hookInfo->control.dispatchMode = mode;
+		// the mode changes with the callbacks, results cached for the old ones are dropped
+		dexposedMemoInvalidate(&hookInfo->control);
+		return true;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setNestedPolicyNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jint policy) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		hookInfo->control.nestedPolicy = policy;
+		return true;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setThreadFilterNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jint filter, jintArray java_tids) {
+
+		uint32_t tids[DEXPOSED_MAX_FILTER_TIDS];
+		jsize tid_count = java_tids == NULL ? 0 : env->GetArrayLength(java_tids);
+		if (tid_count > DEXPOSED_MAX_FILTER_TIDS) {
+			return false;
+		}
+		if (tid_count > 0) {
+			env->GetIntArrayRegion(java_tids, 0, tid_count, reinterpret_cast<jint*>(tids));
+		}
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		return dexposedSetThreadFilter(&hookInfo->control, filter, tids, tid_count);
+	}
+
+	static void com_taobao_android_dexposed_DexposedBridge_setThreadOptInNative(
+			JNIEnv*, jclass, jboolean opt_in) {
+		DexposedThreadState* state = dexposedGetThreadState();
+		if (state != NULL) {
+			state->filterOptIn = opt_in;
+		}
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setStatsNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jboolean enabled, jstring name) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		const char* name_chars = env->GetStringUTFChars(name, NULL);
+		if (name_chars == NULL) {
+			return false;
+		}
+		bool set = dexposedStatsEnable(&hookInfo->control, enabled, name_chars);
+		env->ReleaseStringUTFChars(name, name_chars);
+		return set;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setMemoizationNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jint capacity, jint max_age_ms) {
+
+		DexposedHookInfo* hookInfo;
+		{
+			ScopedObjectAccess soa(env);
+			hookInfo = AcquireHookInfo(soa, java_method);
+		}
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		DexposedMemoCache* cache = NULL;
+		if (capacity > 0) {
+			cache = dexposedMemoCreate(env, capacity, max_age_ms, hookInfo->shorty[0] == 'L');
+			if (cache == NULL) {
+				return false;
+			}
+		}
+		dexposedMemoInstall(env, &hookInfo->control, cache);
+		return true;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_invalidateMemoizationNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		return dexposedMemoInvalidate(&hookInfo->control);
+	}
+
+	static jintArray com_taobao_android_dexposed_DexposedBridge_getMemoizationStatsNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint) {
+
+		DexposedHookInfo* hookInfo;
+		{
+			ScopedObjectAccess soa(env);
+			hookInfo = AcquireHookInfo(soa, java_method);
+		}
+		if (hookInfo == NULL) {
+			return NULL;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		return dexposedMemoStats(env, &hookInfo->control);
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setCallerProfileNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jint capacity) {
+
+		DexposedHookInfo* hookInfo;
+		{
+			ScopedObjectAccess soa(env);
+			hookInfo = AcquireHookInfo(soa, java_method);
+		}
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		DexposedCallerTable* table = NULL;
+		if (capacity > 0) {
+			table = dexposedCallerCreate(capacity);
+			if (table == NULL) {
+				return false;
+			}
+		}
+		dexposedCallerInstall(env, &hookInfo->control, table);
+		return true;
+	}
+
+	// Returns the dex pc of a return pc in the compiled code of caller, or -1. The pc is looked up
+	// in the code the caller has now, so it is only looked up if that is its compiled code: after
+	// the caller was hooked or deoptimized the pc belongs to other code.
+	static jint CallerDexPc(ArtMethod* caller, uintptr_t pc)
+	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
+		if (caller == NULL || caller->IsNative() || caller->IsRuntimeMethod() || caller->IsProxyMethod()) {
+			return -1;
+		}
+		if (caller->GetEntryPointFromQuickCompiledCode()
+				!= Runtime::Current()->GetClassLinker()->GetQuickOatCodeFor(caller)) {
+			return -1;
+		}
+		uint32_t dex_pc = caller->ToDexPc(pc, false);
+		return dex_pc != DexFile::kDexNoIndex ? static_cast<jint>(dex_pc) : -1;
+	}
+
+	static jint DescribeCaller(JNIEnv* env, const DexposedCallerEntry* site, jstring* name) {
+		ScopedObjectAccess soa(env);
+		ArtMethod* caller = reinterpret_cast<ArtMethod*>(const_cast<void*>(site->caller));
+		if (caller == NULL || caller->IsRuntimeMethod()) {
+			*name = NULL;
+			return -1;
+		}
+		*name = env->NewStringUTF(PrettyMethod(caller).c_str());
+		return CallerDexPc(caller, site->pc);
+	}
+
+	static jobjectArray com_taobao_android_dexposed_DexposedBridge_getTopCallersNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jintArray counts) {
+
+		DexposedHookInfo* hookInfo;
+		{
+			ScopedObjectAccess soa(env);
+			hookInfo = AcquireHookInfo(soa, java_method);
+		}
+		if (hookInfo == NULL) {
+			return NULL;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		return dexposedCallerTopCallers(env, &hookInfo->control, counts, DescribeCaller);
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setStackSamplingNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jint rate) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		hookInfo->control.stackSamplingRate = rate;
+		return true;
+	}
+
+	// Names a frame of a sampled stack like com.example.Foo.bar:12, the context is the JNIEnv.
+	static void DescribeStackFrame(void* context, const DexposedStackFrame* frame, char* name, size_t size) {
+		ScopedObjectAccess soa(reinterpret_cast<JNIEnv*>(context));
+		uintptr_t method_bits = reinterpret_cast<uintptr_t>(frame->method);
+		ArtMethod* method = reinterpret_cast<ArtMethod*>(method_bits & ~static_cast<uintptr_t>(1));
+		jint dex_pc = (method_bits & 1) != 0 ? static_cast<jint>(frame->pc) : CallerDexPc(method, frame->pc);
+		std::string pretty(PrettyMethod(method, false));
+		if (dex_pc >= 0) {
+			snprintf(name, size, "%s:%d", pretty.c_str(), dex_pc);
+		} else {
+			snprintf(name, size, "%s", pretty.c_str());
+		}
+	}
+
+	static jint com_taobao_android_dexposed_DexposedBridge_dumpStackSamplesNative(JNIEnv* env, jclass, jstring path) {
+		const char* path_chars = env->GetStringUTFChars(path, NULL);
+		if (path_chars == NULL) {
+			return -1;
+		}
+		jint stacks = dexposedStacksDump(path_chars, DescribeStackFrame, env);
+		env->ReleaseStringUTFChars(path, path_chars);
+		return stacks;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setAllocationSamplingNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jint rate) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		hookInfo->control.allocationSamplingRate = rate;
+		return true;
+	}
+
+	// Names an allocation site, the context is the JNIEnv. The class is its descriptor, see
+	// RecordAllocation(), methods are not moved or unloaded.
+	static void DescribeAllocation(void* context, const void* clazz, const void* caller,
+			char* name, size_t size) {
+		ScopedObjectAccess soa(reinterpret_cast<JNIEnv*>(context));
+		std::string class_name(PrettyDescriptor(reinterpret_cast<const char*>(clazz)));
+		if (caller == NULL) {
+			snprintf(name, size, "%s\t<native>", class_name.c_str());
+			return;
+		}
+		std::string caller_name(PrettyMethod(reinterpret_cast<ArtMethod*>(const_cast<void*>(caller)), false));
+		snprintf(name, size, "%s\t%s", class_name.c_str(), caller_name.c_str());
+	}
+
+	static jint com_taobao_android_dexposed_DexposedBridge_dumpAllocationsNative(JNIEnv* env, jclass, jstring path) {
+		const char* path_chars = env->GetStringUTFChars(path, NULL);
+		if (path_chars == NULL) {
+			return -1;
+		}
+		jint sites = dexposedAllocationsDump(path_chars, DescribeAllocation, env);
+		env->ReleaseStringUTFChars(path, path_chars);
+		return sites;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setHookGroupNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jint group) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		return dexposedSetHookGroup(&hookInfo->control, group);
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setHookGroupEnabledNative(
+			JNIEnv*, jclass, jint group, jboolean enabled) {
+		return dexposedSetHookGroupEnabled(group, enabled);
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setTracingNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jboolean enabled, jstring name) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		if (enabled) {
+			const char* name_chars = env->GetStringUTFChars(name, NULL);
+			bool registered = name_chars != NULL
+					&& dexposedTraceRegisterHook(hookInfo->control.hookId, hookInfo->shorty, name_chars);
+			if (name_chars != NULL) {
+				env->ReleaseStringUTFChars(name, name_chars);
+			}
+			if (!registered) {
+				return false;
+			}
+		}
+		hookInfo->control.traceEnabled = enabled;
+		return true;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_bootstrapNative(JNIEnv* env, jclass) {
+		return dexposedBootstrap(env, dexposed_bootstrap_phases);
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setSystraceNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jboolean enabled, jstring name) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		return dexposedSystraceEnable(env, &hookInfo->control, enabled, name);
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_setBudgetNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint, jint window_ms, jint max_us,
+			jint max_calls, jint rearm_policy, jint cooldown_ms) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		DexposedHookControl* control = &hookInfo->control;
+		control->budgetWindowMs = 0;
+		control->budgetMaxUs = max_us;
+		control->budgetMaxCalls = max_calls;
+		control->budgetRearmPolicy = rearm_policy;
+		control->budgetCooldownMs = cooldown_ms;
+		dexposedBudgetReset(control);
+		control->budgetWindowMs = window_ms;
+		return true;
+	}
+
+	static jboolean com_taobao_android_dexposed_DexposedBridge_rearmBudgetNative(
+			JNIEnv* env, jclass, jobject java_method, jobject, jint) {
+
+		ScopedObjectAccess soa(env);
+		DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+		if (hookInfo == NULL) {
+			return false;
+		}
+		DexposedHookCallScope hook_call(&hookInfo->control);
+		dexposedBudgetReset(&hookInfo->control);
+		return true;
+	}
+
+	static jint com_taobao_android_dexposed_DexposedBridge_publishPatchSetNative(
+			JNIEnv* env, jclass, jobjectArray java_methods, jobjectArray, jintArray,
+			jobjectArray additional_infos) {
+
+		DexposedPatchSet* patch_set = NULL;
+		if (java_methods != NULL) {
+			patch_set = dexposedPatchSetCreate();
+			if (patch_set == NULL) {
+				return 0;
+			}
+			ScopedObjectAccess soa(env);
+			jsize count = env->GetArrayLength(java_methods);
+			for (jsize i = 0; i < count; i++) {
+				jobject java_method = env->GetObjectArrayElement(java_methods, i);
+				DexposedHookInfo* hookInfo = AcquireHookInfo(soa, java_method);
+				env->DeleteLocalRef(java_method);
+				uint32_t hook_id = hookInfo != NULL ? hookInfo->control.hookId : patch_set->capacity;
+				if (hookInfo != NULL) {
+					dexposedHookCallEnd(&hookInfo->control);
+				}
+				if (hook_id >= patch_set->capacity) {
+					dexposedPatchSetFree(patch_set, env);
+					return 0;
+				}
+				jobject additional_info = env->GetObjectArrayElement(additional_infos, i);
+				patch_set->additionalInfos[hook_id] = env->NewGlobalRef(additional_info);
+				env->DeleteLocalRef(additional_info);
+			}
+		}
+		uint32_t version = dexposedPatchSetPublish(env, patch_set);
+		// the results cached before were computed by the callbacks of the previous set
+		dexposedMemoFlushAll();
+		return version;
+	}
+
+	// The handle of a field is its offset in the object in the low 32 bits and its primitive type
+	// above, static fields are accessed on their declaring class. Floats take a full 32 bit slot.
+	// Booleans, bytes, chars and shorts do so as well up to 5.0, from 5.1 on they are packed and
+	// must be accessed with their own width.
+	static jlong com_taobao_android_dexposed_DexposedBridge_resolveFieldNative(
+			JNIEnv* env, jclass, jobject java_field) {
+
+		jfieldID field_id = env->FromReflectedField(java_field);
+		ScopedObjectAccess soa(env);
+		mirror::ArtField* field = field_id != NULL ? soa.DecodeField(field_id) : NULL;
+		if (field == NULL) {
+			// 0 is a valid handle, the offset of the class pointer
+			if (!soa.Self()->IsExceptionPending()) {
+				ThrowLocation throw_location = soa.Self()->GetCurrentLocationForThrow();
+				soa.Self()->ThrowNewException(throw_location, "Ljava/lang/IllegalArgumentException;",
+						"cannot resolve the field");
+			}
+			return 0;
+		}
+		return static_cast<jlong>(field->GetOffset().Uint32Value())
+				| (static_cast<jlong>(field->GetTypeAsPrimitiveType()) << 32);
+	}
+
+	static inline MemberOffset FieldHandleOffset(jlong handle) {
+		return MemberOffset(static_cast<uint32_t>(handle));
+	}
+
+	static inline Primitive::Type FieldHandleType(jlong handle) {
+		return static_cast<Primitive::Type>(handle >> 32);
+	}
+
+	static jint com_taobao_android_dexposed_DexposedBridge_getFieldIntNative(
+			JNIEnv* env, jclass, jobject java_object, jlong handle) {
+
+		ScopedObjectAccess soa(env);
+		Object* obj = soa.Decode<Object*>(java_object);
+		const MemberOffset offset = FieldHandleOffset(handle);
+#if PLATFORM_SDK_VERSION >= 22
+		switch (FieldHandleType(handle)) {
+		case Primitive::kPrimBoolean:
+			return obj->GetFieldBoolean(offset);
+		case Primitive::kPrimByte:
+			return obj->GetFieldByte(offset);
+		case Primitive::kPrimChar:
+			return obj->GetFieldChar(offset);
+		case Primitive::kPrimShort:
+			return obj->GetFieldShort(offset);
+		default:
+			break;
+		}
+#endif
+		return obj->GetField32(offset);
+	}
+
+	static void com_taobao_android_dexposed_DexposedBridge_setFieldIntNative(
+			JNIEnv* env, jclass, jobject java_object, jlong handle, jint value) {
+
+		ScopedObjectAccess soa(env);
+		Object* obj = soa.Decode<Object*>(java_object);
+		const MemberOffset offset = FieldHandleOffset(handle);
+#if PLATFORM_SDK_VERSION >= 22
+		switch (FieldHandleType(handle)) {
+		case Primitive::kPrimBoolean:
+			obj->SetFieldBoolean<false>(offset, static_cast<uint8_t>(value));
+			return;
+		case Primitive::kPrimByte:
+			obj->SetFieldByte<false>(offset, static_cast<int8_t>(value));
+			return;
+		case Primitive::kPrimChar:
+			obj->SetFieldChar<false>(offset, static_cast<uint16_t>(value));
+			return;
+		case Primitive::kPrimShort:
+			obj->SetFieldShort<false>(offset, static_cast<int16_t>(value));
+			return;
+		default:
+			break;
+		}
+#endif
+		obj->SetField32<false>(offset, value);
+	}
+
+	static jlong com_taobao_android_dexposed_DexposedBridge_getFieldLongNative(
+			JNIEnv* env, jclass, jobject java_object, jlong handle) {
+
+		ScopedObjectAccess soa(env);
+		Object* obj = soa.Decode<Object*>(java_object);
+		return obj->GetField64(FieldHandleOffset(handle));
+	}
+
+	static void com_taobao_android_dexposed_DexposedBridge_setFieldLongNative(
+			JNIEnv* env, jclass, jobject java_object, jlong handle, jlong value) {
+
+		ScopedObjectAccess soa(env);
+		Object* obj = soa.Decode<Object*>(java_object);
+		obj->SetField64<false>(FieldHandleOffset(handle), value);
+	}
+
+	static jobject com_taobao_android_dexposed_DexposedBridge_getFieldObjectNative(
+			JNIEnv* env, jclass, jobject java_object, jlong handle) {
+
+		ScopedObjectAccess soa(env);
+		Object* obj = soa.Decode<Object*>(java_object);
+		return soa.AddLocalReference<jobject>(obj->GetFieldObject<Object>(FieldHandleOffset(handle)));
+	}
+
+	static void com_taobao_android_dexposed_DexposedBridge_setFieldObjectNative(
+			JNIEnv* env, jclass, jobject java_object, jlong handle, jobject java_value) {
+
+		ScopedObjectAccess soa(env);
+		Object* obj = soa.Decode<Object*>(java_object);
+		// marks the card of obj for the garbage collector
+		obj->SetFieldObject<false>(FieldHandleOffset(handle), soa.Decode<Object*>(java_value));
+	}
+
 	static bool dexposedIsHooked(ArtMethod* method) {
 		return (method->GetEntryPointFromQuickCompiledCode())
 				== (void *) GetQuickDexposedInvokeHandler();
@@ -340,14 +1747,17 @@ namespace art {
 			jobject thiz, jobject args)
 	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
 
-		LOG(INFO) << "dexposed: >>> invokeOriginalMethodNative";
-
 		ScopedObjectAccess soa(env);
+		DexposedThreadState* state = dexposedGetThreadState();
+		DexposedOriginalCall original_call;
+		dexposedSuspendCallbacks(state, &original_call);
 #if PLATFORM_SDK_VERSION >= 21
-		return art::InvokeMethod(soa, java_method, thiz, args, true);
+		jobject result = art::InvokeMethod(soa, java_method, thiz, args, true);
 #else
-		return art::InvokeMethod(soa, java_method, thiz, args);
+		jobject result = art::InvokeMethod(soa, java_method, thiz, args);
 #endif
+		dexposedResumeCallbacks(state, &original_call);
+		return result;
 	}
 
 	extern "C" jobject com_taobao_android_dexposed_DexposedBridge_invokeSuperNative(
@@ -356,8 +1766,6 @@ namespace art {
 
 	SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
 
-		LOG(INFO) << "dexposed: >>> invokeSuperNative";
-
 		ScopedObjectAccess soa(env);
 		ArtMethod* method = ArtMethod::FromReflectedMethod(soa, java_method);
 
@@ -367,8 +1775,7 @@ namespace art {
 		jobject reflect_method = env->AllocObject(WellKnownClasses::java_lang_reflect_Method);
 		env->SetObjectField(reflect_method,
 						WellKnownClasses::java_lang_reflect_AbstractMethod_artMethod,
-						env->NewGlobalRef(
-								soa.AddLocalReference < jobject > (mm)));
+						soa.AddLocalReference < jobject > (mm));
 #if PLATFORM_SDK_VERSION >= 21
 		return art::InvokeMethod(soa, reflect_method, thiz, args, true);
 #else
@@ -385,6 +1792,118 @@ namespace art {
 							(void*) com_taobao_android_dexposed_DexposedBridge_invokeOriginalMethodNative },
 		{ "invokeSuperNative", "(Ljava/lang/Object;[Ljava/lang/Object;Ljava/lang/reflect/Member;Ljava/lang/Class;[Ljava/lang/Class;Ljava/lang/Class;I)Ljava/lang/Object;",
 				(void*) com_taobao_android_dexposed_DexposedBridge_invokeSuperNative},
+		{ "setSamplingRateNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setSamplingRateNative },
+		{ "setDispatchModeNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setDispatchModeNative },
+		{ "setBudgetNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IIIIII)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setBudgetNative },
+		{ "rearmBudgetNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_rearmBudgetNative },
+		{ "setNestedPolicyNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setNestedPolicyNative },
+		{ "setThreadFilterNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II[I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setThreadFilterNative },
+		{ "setThreadOptInNative", "(Z)V",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setThreadOptInNative },
+		{ "startCoverageNative", "(Ljava/lang/String;I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_startCoverageNative },
+		{ "coverMethodNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;ILjava/lang/String;)I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_coverMethodNative },
+		{ "getCoverageCountsNative", "()[I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getCoverageCountsNative },
+		{ "syncCoverageNative", "()V",
+							(void*) com_taobao_android_dexposed_DexposedBridge_syncCoverageNative },
+		{ "startPerfMapNative", "(Ljava/lang/String;)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_startPerfMapNative },
+		{ "replaceWithConstantNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IJ)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_replaceWithConstantNative },
+		{ "hookJniFunctionNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IJ)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_hookJniFunctionNative },
+		{ "unhookJniFunctionNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_unhookJniFunctionNative },
+		{ "openStatsFileNative", "(Ljava/lang/String;I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_openStatsFileNative },
+		{ "setStatsNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IZLjava/lang/String;)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setStatsNative },
+		{ "removeHookNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_removeHookNative },
+		{ "reclaimRemovedHooksNative", "()I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_reclaimRemovedHooksNative },
+		{ "getHookMemoryUsageNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)[I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getHookMemoryUsageNative },
+		{ "getMemoryUsageNative", "()[I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getMemoryUsageNative },
+		{ "setMemoizationNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;III)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setMemoizationNative },
+		{ "invalidateMemoizationNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_invalidateMemoizationNative },
+		{ "getMemoizationStatsNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)[I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getMemoizationStatsNative },
+		{ "setCallerProfileNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setCallerProfileNative },
+		{ "getTopCallersNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I[I)[Ljava/lang/String;",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getTopCallersNative },
+		{ "startStackSamplingNative", "(I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_startStackSamplingNative },
+		{ "setStackSamplingNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setStackSamplingNative },
+		{ "dumpStackSamplesNative", "(Ljava/lang/String;)I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_dumpStackSamplesNative },
+		{ "getStackSamplingStatsNative", "()[I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getStackSamplingStatsNative },
+		{ "startAllocationProfilingNative", "(I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_startAllocationProfilingNative },
+		{ "setAllocationSamplingNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setAllocationSamplingNative },
+		{ "dumpAllocationsNative", "(Ljava/lang/String;)I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_dumpAllocationsNative },
+		{ "getAllocationProfilingStatsNative", "()[I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getAllocationProfilingStatsNative },
+		{ "setHookGroupNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setHookGroupNative },
+		{ "setHookGroupEnabledNative", "(IZ)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setHookGroupEnabledNative },
+		{ "setTracingNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IZLjava/lang/String;)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setTracingNative },
+		{ "bootstrapNative", "()Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_bootstrapNative },
+		{ "getBootstrapTimingsNative", "()[J",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getBootstrapTimingsNative },
+		{ "startSystraceNative", "()Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_startSystraceNative },
+		{ "setSystraceNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IZLjava/lang/String;)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setSystraceNative },
+		{ "openTraceFileNative", "(Ljava/lang/String;I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_openTraceFileNative },
+		{ "syncTraceFileNative", "()V",
+							(void*) com_taobao_android_dexposed_DexposedBridge_syncTraceFileNative },
+		{ "startAsyncHooksNative", "(I)Z",
+							(void*) com_taobao_android_dexposed_DexposedBridge_startAsyncHooksNative },
+		{ "takeAsyncCallNative", "()[Ljava/lang/Object;",
+							(void*) com_taobao_android_dexposed_DexposedBridge_takeAsyncCallNative },
+		{ "setAsyncOverflowPolicyNative", "(I)V",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setAsyncOverflowPolicyNative },
+		{ "getAsyncStatsNative", "()[I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getAsyncStatsNative },
+		{ "resolveFieldNative", "(Ljava/lang/reflect/Field;)J",
+							(void*) com_taobao_android_dexposed_DexposedBridge_resolveFieldNative },
+		{ "getFieldIntNative", "(Ljava/lang/Object;J)I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getFieldIntNative },
+		{ "setFieldIntNative", "(Ljava/lang/Object;JI)V",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setFieldIntNative },
+		{ "getFieldLongNative", "(Ljava/lang/Object;J)J",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getFieldLongNative },
+		{ "setFieldLongNative", "(Ljava/lang/Object;JJ)V",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setFieldLongNative },
+		{ "getFieldObjectNative", "(Ljava/lang/Object;J)Ljava/lang/Object;",
+							(void*) com_taobao_android_dexposed_DexposedBridge_getFieldObjectNative },
+		{ "setFieldObjectNative", "(Ljava/lang/Object;JLjava/lang/Object;)V",
+							(void*) com_taobao_android_dexposed_DexposedBridge_setFieldObjectNative },
+		{ "publishPatchSetNative", "([Ljava/lang/reflect/Member;[Ljava/lang/Class;[I[Ljava/lang/Object;)I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_publishPatchSetNative },
+		{ "reclaimPatchSetsNative", "()I",
+							(void*) com_taobao_android_dexposed_DexposedBridge_reclaimPatchSetsNative },
 	};
 
 	static int register_com_taobao_android_dexposed_DexposedBridge(JNIEnv* env) {
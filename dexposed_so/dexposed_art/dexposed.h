@@ -21,9 +21,13 @@
 
 #include <jni.h>
 #include <mirror/art_method.h>
+#include <mirror/art_field.h>
+#include <mirror/art_field-inl.h>
 #include <mirror/object.h>
 #include <mirror/array.h>
 #include <mirror/class.h>
+#include <mirror/string.h>
+#include <mirror/string-inl.h>
 #include <well_known_classes.h>
 #include <class_linker.h>
 #include <primitive.h>
@@ -39,6 +43,23 @@
 #include <jni_internal.h>
 #include <dex_file.h>
 
+#include "dexposed_hook_control.h"
+#include "dexposed_async.h"
+#include "dexposed_trace.h"
+#include "dexposed_patch_set.h"
+#include "dexposed_memo.h"
+#include "dexposed_callers.h"
+#include "dexposed_stacks.h"
+#include "dexposed_allocations.h"
+#include "dexposed_systrace.h"
+#include "dexposed_perf_map.h"
+#include "dexposed_jni_hook.h"
+#include "dexposed_bootstrap.h"
+#include "dexposed_coverage.h"
+#include "dexposed_stats.h"
+#include "dexposed_publish.h"
+#include "dexposed_memory.h"
+
 using art::mirror::ArtMethod;
 using art::mirror::Array;
 using art::mirror::ObjectArray;
@@ -63,6 +84,7 @@ using art::StackReference;
 using art::ClassLinker;
 using art::ScopedJniEnvLocalRefState;
 using art::ThrowLocation;
+using art::MemberOffset;
 
 #define DEXPOSED_CLASS "com/taobao/android/dexposed/DexposedBridge"
 #define DEXPOSED_ADDITIONAL_CLASS "com/taobao/android/dexposed/DexposedBridge$AdditionalHookInfo"
@@ -78,6 +100,7 @@ namespace art {
         jobject additionalInfo;
         mirror::ArtMethod* originalMethod;
         const char *shorty;
+        DexposedHookControl control;
     };
 
     static bool dexposedIsHooked(ArtMethod* method);
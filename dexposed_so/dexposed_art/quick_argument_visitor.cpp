@@ -188,9 +188,10 @@ class QuickArgumentVisitor {
 #endif
 
  public:
+  // The frames of the dexposed handler hold the hooked method instead of the callee save method,
+  // their layout is the same.
   static mirror::ArtMethod* GetCallingMethod(StackReference<mirror::ArtMethod>* sp)
       SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
-    DCHECK(sp->AsMirrorPtr()->IsCalleeSaveMethod());
     byte* previous_sp = reinterpret_cast<byte*>(sp) + kQuickCalleeSaveFrame_RefAndArgs_FrameSize;
     return reinterpret_cast<StackReference<mirror::ArtMethod>*>(previous_sp)->AsMirrorPtr();
   }
@@ -198,7 +199,6 @@ class QuickArgumentVisitor {
   // For the given quick ref and args quick frame, return the caller's PC.
   static uintptr_t GetCallingPc(StackReference<mirror::ArtMethod>* sp)
       SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) {
-    DCHECK(sp->AsMirrorPtr()->IsCalleeSaveMethod());
     byte* lr = reinterpret_cast<byte*>(sp) + kQuickCalleeSaveFrame_RefAndArgs_LrOffset;
     return *reinterpret_cast<uintptr_t*>(lr);
   }
@@ -514,6 +514,57 @@ void BuildQuickArgumentVisitor::FixupReferences() {
   }
 }
 
+// Visits arguments on the stack placing them into a word array as expected by ArtMethod::Invoke.
+// References are copied as they are, so there must be no thread suspension until the invoke.
+class BuildQuickArgArrayVisitor FINAL : public QuickArgumentVisitor {
+ public:
+  BuildQuickArgArrayVisitor(StackReference<mirror::ArtMethod>* sp, bool is_static,
+                            const char* shorty, uint32_t shorty_len, uint32_t* args) :
+      QuickArgumentVisitor(sp, is_static, shorty, shorty_len), args_(args), cur_word_(0) {}
+
+  void Visit() SHARED_LOCKS_REQUIRED(Locks::mutator_lock_) OVERRIDE;
+
+  uint32_t GetNumberOfWords() const {
+    return cur_word_;
+  }
+
+ private:
+  uint32_t* const args_;
+  uint32_t cur_word_;
+
+  DISALLOW_COPY_AND_ASSIGN(BuildQuickArgArrayVisitor);
+};
+
+void BuildQuickArgArrayVisitor::Visit() {
+  Primitive::Type type = GetParamPrimitiveType();
+  switch (type) {
+    case Primitive::kPrimLong:  // Fall-through.
+    case Primitive::kPrimDouble: {
+        uint64_t val;
+        if (IsSplitLongOrDouble()) {
+          val = ReadSplitLongParam();
+        } else {
+          val = *reinterpret_cast<uint64_t*>(GetParamAddress());
+        }
+        args_[cur_word_++] = static_cast<uint32_t>(val);
+        args_[cur_word_++] = static_cast<uint32_t>(val >> 32);
+      }
+      break;
+    case Primitive::kPrimNot:      // Fall-through.
+    case Primitive::kPrimBoolean:  // Fall-through.
+    case Primitive::kPrimByte:     // Fall-through.
+    case Primitive::kPrimChar:     // Fall-through.
+    case Primitive::kPrimShort:    // Fall-through.
+    case Primitive::kPrimInt:      // Fall-through.
+    case Primitive::kPrimFloat:
+      args_[cur_word_++] = *reinterpret_cast<uint32_t*>(GetParamAddress());
+      break;
+    case Primitive::kPrimVoid:
+      LOG(FATAL) << "UNREACHABLE";
+      break;
+  }
+}
+
 
 
 }  // namespace art
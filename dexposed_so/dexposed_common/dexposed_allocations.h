@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Allocation sites of profiled classes.
+ *
+ * The constructors of a profiled class are hooked without callbacks
+ * (DEXPOSED_DISPATCH_NONE), their handler counts a sample of the calls by
+ * allocated class and calling method and calls the constructor directly.
+ * A constructor called by another constructor of its class, i.e. this(...),
+ * is not counted, a constructor called by the constructor of a subclass is
+ * counted for the subclass constructor.
+ *
+ * All sites are kept in one caller table (dexposed_callers.h) whose call
+ * sites are the calling method and the allocated class in place of a pc.
+ * It is created once and never freed, names are looked up when it is
+ * dumped. Both are keys which must not change while the process runs: a
+ * runtime whose collector moves classes passes something stable naming the
+ * class instead, e.g. its descriptor in the dex file.
+ */
+
+#ifndef DEXPOSED_ALLOCATIONS_H_
+#define DEXPOSED_ALLOCATIONS_H_
+
+#include <jni.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "dexposed_callers.h"
+#include "dexposed_hook_control.h"
+#include "dexposed_thread.h"
+
+#define DEXPOSED_ALLOCATION_MAX_NAME 512
+
+// set once, the table is never freed since handlers may be counting at any time
+static DexposedCallerTable* volatile dexposedAllocations = NULL;
+
+static bool dexposedAllocationsStart(uint32_t capacity) {
+    if (dexposedAllocations != NULL || capacity == 0)
+        return false;
+    DexposedCallerTable* table = dexposedCallerCreate(capacity);
+    if (table == NULL)
+        return false;
+    if (!__sync_bool_compare_and_swap(&dexposedAllocations, NULL, table)) {
+        dexposedCallerFree(table, NULL);
+        return false;
+    }
+    return true;
+}
+
+// true if the call of a profiled constructor is counted
+static inline bool dexposedAllocationSampled(const DexposedHookControl* control, DexposedThreadState* state) {
+    uint32_t rate = control->allocationSamplingRate;
+    if (rate == 0 || dexposedAllocations == NULL)
+        return false;
+    return rate == 1 || (state != NULL && dexposedNextRandom(state) % rate == 0);
+}
+
+// clazz is the stable key of the class, see above, caller is NULL if it is not known
+static inline void dexposedAllocationRecord(const void* clazz, const void* caller) {
+    dexposedCallerRecord(dexposedAllocations, caller, (uintptr_t) clazz);
+}
+
+// writes "<class>\t<calling method>" into name, context is the one passed to dexposedAllocationsDump()
+typedef void (*DexposedAllocationDescribeFunction)(void* context, const void* clazz, const void* caller,
+        char* name, size_t size);
+
+// writes a line "<samples>\t<class>\t<calling method>" per allocation site to path, returns the
+// number of sites or -1
+static int32_t dexposedAllocationsDump(const char* path, DexposedAllocationDescribeFunction describe,
+        void* context) {
+    DexposedCallerTable* table = dexposedAllocations;
+    if (table == NULL)
+        return -1;
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+        return -1;
+
+    int32_t sites = 0;
+    char name[DEXPOSED_ALLOCATION_MAX_NAME];
+    for (uint32_t i = 0; i <= table->mask; i++) {
+        const DexposedCallerEntry* entry = &table->entries[i];
+        uint32_t count = entry->count;
+        if (count == 0)
+            continue;
+        __sync_synchronize();
+        describe(context, (const void*) entry->pc, entry->caller, name, sizeof(name));
+        fprintf(out, "%u\t%s\n", count, name);
+        sites++;
+    }
+    bool failed = ferror(out) != 0;
+    if (fclose(out) != 0 || failed)
+        return -1;
+    return sites;
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native boolean startAllocationProfilingNative(int capacity)
+ */
+static jboolean com_taobao_android_dexposed_DexposedBridge_startAllocationProfilingNative(JNIEnv* env, jclass clazz,
+            jint capacity) {
+    return dexposedAllocationsStart(capacity);
+}
+
+/*
+ * private static native int[] getAllocationProfilingStatsNative()
+ *
+ * Returns {samples, dropped samples}, or null before profiling was started.
+ */
+static jintArray com_taobao_android_dexposed_DexposedBridge_getAllocationProfilingStatsNative(JNIEnv* env,
+            jclass clazz) {
+    DexposedCallerTable* table = dexposedAllocations;
+    if (table == NULL)
+        return NULL;
+
+    jint stats[2] = { (jint) table->calls, (jint) table->dropped };
+    jintArray result = env->NewIntArray(2);
+    if (result != NULL)
+        env->SetIntArrayRegion(result, 0, 2, stats);
+    return result;
+}
+
+#endif  // DEXPOSED_ALLOCATIONS_H_
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Queue of hooked calls waiting for their asynchronous callbacks.
+ *
+ * The native handlers are the producers: they copy the primitive arguments
+ * and result of a call into a DexposedAsyncCall and put the references into
+ * an Object[] ("refs", layout below). The only consumer is the worker thread
+ * started by DexposedBridge, which takes the calls with takeAsyncCallNative()
+ * and runs the callbacks.
+ *
+ * The queue is a bounded array of cells with a sequence number each
+ * (D. Vyukov's bounded MPMC queue, used with one consumer). Producers only
+ * do a compare-and-swap on the enqueue position; nothing is locked unless the
+ * worker sleeps on an empty queue. The refs of cell i are kept reachable by
+ * slot i of the pins array, a global reference, so that neither runtime
+ * needs a global reference per queued object.
+ *
+ * Reserving a cell and publishing the call are separate steps because the
+ * pin slot must be written in between, which only the runtime specific code
+ * can do without a JNI transition.
+ */
+
+#ifndef DEXPOSED_ASYNC_H_
+#define DEXPOSED_ASYNC_H_
+
+#include <jni.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dexposed_thread.h"
+
+enum DexposedAsyncOverflowPolicy {
+    // a call which finds the queue full is dropped
+    DEXPOSED_ASYNC_OVERFLOW_DROP = 0,
+    // the calling thread waits for the worker to make room
+    DEXPOSED_ASYNC_OVERFLOW_BLOCK = 1,
+};
+
+// layout of the refs array of a call, this is also what the worker receives
+enum {
+    DEXPOSED_ASYNC_REF_ADDITIONAL_INFO = 0,
+    DEXPOSED_ASYNC_REF_THIS = 1,
+    DEXPOSED_ASYNC_REF_RESULT = 2,
+    DEXPOSED_ASYNC_REF_THROWABLE = 3,
+    DEXPOSED_ASYNC_REF_ARGS = 4,
+};
+
+struct DexposedAsyncCall {
+    const char* shorty;     // copy of the one of the hooked method, [0] is the return type
+    jvalue result;          // primitive result, object results are in the refs
+    jvalue args[0];         // primitive arguments, object arguments are in the refs
+};
+
+struct DexposedAsyncCell {
+    volatile uint32_t sequence;
+    DexposedAsyncCall* call;
+};
+
+struct DexposedAsyncQueue {
+    DexposedAsyncCell* cells;
+    uint32_t mask;
+    jobjectArray pins;
+
+    volatile uint32_t overflowPolicy;
+
+    // statistics, read by DexposedBridge.getAsyncHookStats()
+    volatile uint32_t enqueued;
+    volatile uint32_t dropped;
+    volatile uint32_t blocked;
+
+    // keep the producers' and the consumer's position on separate cache lines
+    char padding0[64];
+    volatile uint32_t enqueuePos;
+    char padding1[64];
+    volatile uint32_t dequeuePos;
+    volatile int32_t consumerWaiting;
+    pthread_mutex_t lock;
+    pthread_cond_t nonEmpty;
+};
+
+struct DexposedAsyncBoxing {
+    jclass clazz;
+    jmethodID valueOf;
+};
+
+static DexposedAsyncQueue* volatile dexposedAsyncQueue = NULL;
+static DexposedAsyncBoxing dexposedAsyncBoxing[8];  // indexed by dexposedAsyncBoxingIndex()
+static const char dexposedAsyncPrimitives[] = "ZBCSIJFD";
+
+static inline int dexposedAsyncBoxingIndex(char type) {
+    const char* found = strchr(dexposedAsyncPrimitives, type);
+    return found != NULL && type != '\0' ? found - dexposedAsyncPrimitives : -1;
+}
+
+static inline bool dexposedAsyncIsReference(char type) {
+    return type == 'L' || type == '[';
+}
+
+// the shorty is copied behind the arguments, a queued call may outlive the hook it was made by
+static inline DexposedAsyncCall* dexposedAsyncCallCreate(const char* shorty) {
+    size_t length = strlen(shorty);
+    size_t argCount = length - 1;
+    DexposedAsyncCall* call = (DexposedAsyncCall*) malloc(sizeof(DexposedAsyncCall) + argCount * sizeof(jvalue) + length + 1);
+    if (call != NULL) {
+        char* shortyCopy = (char*) &call->args[argCount];
+        memcpy(shortyCopy, shorty, length + 1);
+        call->shorty = shortyCopy;
+        call->result.j = 0;
+    }
+    return call;
+}
+
+// a cheap check before a call is captured, counts the call as dropped if the
+// queue is not running or is full while calls may not wait
+static inline DexposedAsyncQueue* dexposedAsyncAcquireQueue() {
+    DexposedAsyncQueue* queue = dexposedAsyncQueue;
+    if (queue == NULL)
+        return NULL;
+
+    uint32_t used = queue->enqueuePos - queue->dequeuePos;
+    if (used > queue->mask && queue->overflowPolicy == DEXPOSED_ASYNC_OVERFLOW_DROP) {
+        __sync_add_and_fetch(&queue->dropped, 1);
+        return NULL;
+    }
+    return queue;
+}
+
+static inline bool dexposedAsyncTryReserve(DexposedAsyncQueue* queue, uint32_t* pos) {
+    uint32_t current = queue->enqueuePos;
+    for (;;) {
+        DexposedAsyncCell* cell = &queue->cells[current & queue->mask];
+        uint32_t sequence = cell->sequence;
+        __sync_synchronize();
+        int32_t diff = (int32_t) (sequence - current);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&queue->enqueuePos, current, current + 1)) {
+                *pos = current;
+                return true;
+            }
+        } else if (diff < 0) {
+            // the cell still holds the call of the previous round, the queue is full
+            return false;
+        }
+        current = queue->enqueuePos;
+    }
+}
+
+static inline void dexposedAsyncPublish(DexposedAsyncQueue* queue, uint32_t pos, DexposedAsyncCall* call) {
+    DexposedAsyncCell* cell = &queue->cells[pos & queue->mask];
+    cell->call = call;
+    __sync_synchronize();
+    cell->sequence = pos + 1;
+    __sync_add_and_fetch(&queue->enqueued, 1);
+
+    __sync_synchronize();
+    if (queue->consumerWaiting) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_signal(&queue->nonEmpty);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+static inline void dexposedAsyncDrop(DexposedAsyncQueue* queue, DexposedAsyncCall* call) {
+    __sync_add_and_fetch(&queue->dropped, 1);
+    free(call);
+}
+
+// whether the current thread may wait for room in a full queue, the worker
+// itself must not or it would wait for itself
+static inline bool dexposedAsyncMayBlock(DexposedAsyncQueue* queue) {
+    if (queue->overflowPolicy != DEXPOSED_ASYNC_OVERFLOW_BLOCK)
+        return false;
+    DexposedThreadState* state = dexposedGetThreadState();
+    return state == NULL || !state->asyncWorker;
+}
+
+// called by a blocked producer between two attempts, with the thread in a
+// state which does not hold up the garbage collector
+static inline void dexposedAsyncBackoff(DexposedAsyncQueue* queue, uint32_t attempt) {
+    if (attempt == 0)
+        __sync_add_and_fetch(&queue->blocked, 1);
+    if (attempt < 16)
+        sched_yield();
+    else
+        usleep(100);
+}
+
+static inline DexposedAsyncCall* dexposedAsyncPeek(DexposedAsyncQueue* queue, uint32_t* pos) {
+    uint32_t current = queue->dequeuePos;
+    DexposedAsyncCell* cell = &queue->cells[current & queue->mask];
+    uint32_t sequence = cell->sequence;
+    __sync_synchronize();
+    if ((int32_t) (sequence - (current + 1)) < 0)
+        return NULL;
+    *pos = current;
+    return cell->call;
+}
+
+// hands the cell at pos back to the producers, the pin slot must be cleared before
+static inline void dexposedAsyncRelease(DexposedAsyncQueue* queue, uint32_t pos) {
+    DexposedAsyncCell* cell = &queue->cells[pos & queue->mask];
+    cell->call = NULL;
+    queue->dequeuePos = pos + 1;
+    __sync_synchronize();
+    cell->sequence = pos + queue->mask + 1;
+}
+
+static inline void dexposedAsyncWaitForCalls(DexposedAsyncQueue* queue) {
+    uint32_t pos;
+    pthread_mutex_lock(&queue->lock);
+    queue->consumerWaiting = 1;
+    __sync_synchronize();
+    if (dexposedAsyncPeek(queue, &pos) == NULL) {
+        // the timeout only bounds the delay if a producer was preempted between
+        // reserving and publishing its cell
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&queue->nonEmpty, &queue->lock, &deadline);
+    }
+    queue->consumerWaiting = 0;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static inline jobject dexposedAsyncBox(JNIEnv* env, char type, jvalue value) {
+    int index = dexposedAsyncBoxingIndex(type);
+    if (index < 0)
+        return NULL;
+
+    jmethodID valueOf = dexposedAsyncBoxing[index].valueOf;
+    jclass clazz = dexposedAsyncBoxing[index].clazz;
+    switch (type) {
+    case 'Z': return env->CallStaticObjectMethod(clazz, valueOf, (jboolean) (value.i != 0));
+    case 'B': return env->CallStaticObjectMethod(clazz, valueOf, (jbyte) value.i);
+    case 'C': return env->CallStaticObjectMethod(clazz, valueOf, (jchar) value.i);
+    case 'S': return env->CallStaticObjectMethod(clazz, valueOf, (jshort) value.i);
+    case 'I': return env->CallStaticObjectMethod(clazz, valueOf, value.i);
+    case 'J': return env->CallStaticObjectMethod(clazz, valueOf, value.j);
+    case 'F': return env->CallStaticObjectMethod(clazz, valueOf, value.f);
+    case 'D': return env->CallStaticObjectMethod(clazz, valueOf, value.d);
+    }
+    return NULL;
+}
+
+static bool dexposedAsyncInitBoxing(JNIEnv* env) {
+    static const char* classes[] = {
+        "java/lang/Boolean", "java/lang/Byte", "java/lang/Character", "java/lang/Short",
+        "java/lang/Integer", "java/lang/Long", "java/lang/Float", "java/lang/Double",
+    };
+    char signature[32];
+    for (int i = 0; i < 8; i++) {
+        jclass clazz = env->FindClass(classes[i]);
+        if (clazz == NULL)
+            return false;
+        snprintf(signature, sizeof(signature), "(%c)L%s;", dexposedAsyncPrimitives[i], classes[i]);
+        dexposedAsyncBoxing[i].valueOf = env->GetStaticMethodID(clazz, "valueOf", signature);
+        dexposedAsyncBoxing[i].clazz = (jclass) env->NewGlobalRef(clazz);
+        env->DeleteLocalRef(clazz);
+        if (dexposedAsyncBoxing[i].valueOf == NULL)
+            return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native boolean startAsyncHooksNative(int capacity)
+ *
+ * Creates the queue, the capacity is rounded up to a power of two. Called
+ * once, before the worker thread starts.
+ */
+static jboolean com_taobao_android_dexposed_DexposedBridge_startAsyncHooksNative(JNIEnv* env, jclass clazz,
+            jint capacity) {
+    if (dexposedAsyncQueue != NULL)
+        return true;
+
+    uint32_t size = 16;
+    while (size < (uint32_t) capacity && size < (1u << 20))
+        size <<= 1;
+
+    if (!dexposedAsyncInitBoxing(env)) {
+        env->ExceptionClear();
+        return false;
+    }
+
+    jclass objectClass = env->FindClass("java/lang/Object");
+    jobjectArray pins = objectClass != NULL ? env->NewObjectArray(size, objectClass, NULL) : NULL;
+    if (pins == NULL) {
+        env->ExceptionClear();
+        return false;
+    }
+
+    DexposedAsyncQueue* queue = (DexposedAsyncQueue*) calloc(1, sizeof(DexposedAsyncQueue));
+    DexposedAsyncCell* cells = (DexposedAsyncCell*) calloc(size, sizeof(DexposedAsyncCell));
+    if (queue == NULL || cells == NULL) {
+        free(queue);
+        free(cells);
+        return false;
+    }
+    for (uint32_t i = 0; i < size; i++)
+        cells[i].sequence = i;
+
+    queue->cells = cells;
+    queue->mask = size - 1;
+    queue->pins = (jobjectArray) env->NewGlobalRef(pins);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->nonEmpty, NULL);
+    env->DeleteLocalRef(pins);
+    env->DeleteLocalRef(objectClass);
+
+    __sync_synchronize();
+    dexposedAsyncQueue = queue;
+    return true;
+}
+
+/*
+ * private static native Object[] takeAsyncCallNative()
+ *
+ * Waits for the next queued call and returns its refs array with the
+ * primitive arguments and result boxed.
+ */
+static jobjectArray com_taobao_android_dexposed_DexposedBridge_takeAsyncCallNative(JNIEnv* env, jclass clazz) {
+    DexposedAsyncQueue* queue = dexposedAsyncQueue;
+    if (queue == NULL)
+        return NULL;
+
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state != NULL)
+        state->asyncWorker = 1;
+
+    uint32_t pos;
+    DexposedAsyncCall* call;
+    while ((call = dexposedAsyncPeek(queue, &pos)) == NULL)
+        dexposedAsyncWaitForCalls(queue);
+
+    jobjectArray refs = (jobjectArray) env->GetObjectArrayElement(queue->pins, pos & queue->mask);
+    env->SetObjectArrayElement(queue->pins, pos & queue->mask, NULL);
+    dexposedAsyncRelease(queue, pos);
+
+    const char* shorty = call->shorty;
+    for (size_t i = 0; shorty[i + 1] != '\0'; i++) {
+        if (dexposedAsyncIsReference(shorty[i + 1]))
+            continue;
+        jobject boxed = dexposedAsyncBox(env, shorty[i + 1], call->args[i]);
+        env->SetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_ARGS + i, boxed);
+        env->DeleteLocalRef(boxed);
+    }
+    jobject throwable = env->GetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_THROWABLE);
+    if (throwable == NULL && !dexposedAsyncIsReference(shorty[0])) {
+        jobject boxed = dexposedAsyncBox(env, shorty[0], call->result);
+        env->SetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_RESULT, boxed);
+        env->DeleteLocalRef(boxed);
+    }
+    env->DeleteLocalRef(throwable);
+    free(call);
+    return refs;
+}
+
+/*
+ * private static native void setAsyncOverflowPolicyNative(int policy)
+ */
+static void com_taobao_android_dexposed_DexposedBridge_setAsyncOverflowPolicyNative(JNIEnv* env, jclass clazz,
+            jint policy) {
+    DexposedAsyncQueue* queue = dexposedAsyncQueue;
+    if (queue != NULL)
+        queue->overflowPolicy = policy;
+}
+
+/*
+ * private static native int[] getAsyncStatsNative()
+ *
+ * Returns { enqueued, dropped, blocked, pending }, or null before the queue was started.
+ */
+static jintArray com_taobao_android_dexposed_DexposedBridge_getAsyncStatsNative(JNIEnv* env, jclass clazz) {
+    DexposedAsyncQueue* queue = dexposedAsyncQueue;
+    if (queue == NULL)
+        return NULL;
+
+    jint stats[4];
+    stats[0] = queue->enqueued;
+    stats[1] = queue->dropped;
+    stats[2] = queue->blocked;
+    stats[3] = queue->enqueuePos - queue->dequeuePos;
+
+    jintArray result = env->NewIntArray(4);
+    if (result != NULL)
+        env->SetIntArrayRegion(result, 0, 4, stats);
+    return result;
+}
+
+#endif  // DEXPOSED_ASYNC_H_
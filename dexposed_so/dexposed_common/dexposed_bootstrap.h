@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Bootstrap of the native bridge.
+ *
+ * JNI_OnLoad only creates the thread state key and registers the natives,
+ * so loading the library stays cheap. Everything else the runtime needs
+ * before a method can be hooked (device info, structure offsets, the access
+ * check patches, the methods and fields handlers call) is done by the
+ * bootstrap, which runs once on the first hook or explicit init from Java.
+ *
+ * The time of every phase is kept, -1 for a phase which was not run, so
+ * the cost of loading and of the bootstrap can be read from Java.
+ */
+
+#ifndef DEXPOSED_BOOTSTRAP_H_
+#define DEXPOSED_BOOTSTRAP_H_
+
+#include <jni.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "dexposed_hook_control.h"
+
+// must match the INIT_PHASE_* constants of DexposedBridge
+enum DexposedBootstrapPhase {
+    DEXPOSED_BOOTSTRAP_LOAD = 0,            // JNI_OnLoad
+    DEXPOSED_BOOTSTRAP_DEVICE_INFO = 1,
+    DEXPOSED_BOOTSTRAP_MEMBER_OFFSETS = 2,
+    DEXPOSED_BOOTSTRAP_ACCESS_PATCHES = 3,
+    DEXPOSED_BOOTSTRAP_RESOLVE_METHODS = 4,
+    DEXPOSED_BOOTSTRAP_PHASES = 5,
+};
+
+enum DexposedBootstrapState {
+    DEXPOSED_BOOTSTRAP_NOT_RUN = 0,
+    DEXPOSED_BOOTSTRAP_DONE = 1,
+    DEXPOSED_BOOTSTRAP_FAILED = 2,
+};
+
+// one phase of the bootstrap, false if the bridge cannot be used
+typedef bool (*DexposedBootstrapFunction)(JNIEnv* env);
+
+static pthread_mutex_t dexposedBootstrapLock = PTHREAD_MUTEX_INITIALIZER;
+// written under dexposedBootstrapLock, read without it once it is not DEXPOSED_BOOTSTRAP_NOT_RUN
+static volatile int dexposedBootstrapState = DEXPOSED_BOOTSTRAP_NOT_RUN;
+static int64_t dexposedBootstrapNanos[DEXPOSED_BOOTSTRAP_PHASES] = { -1, -1, -1, -1, -1 };
+
+static inline void dexposedBootstrapTimed(DexposedBootstrapPhase phase, uint64_t startNs) {
+    dexposedBootstrapNanos[phase] = (int64_t) (dexposedNanoTime() - startNs);
+}
+
+// runs the phases after DEXPOSED_BOOTSTRAP_LOAD in order until one fails, phases[i] is NULL if the
+// runtime has nothing to do in phase i. Only the first call runs them, the others return its result.
+static bool dexposedBootstrap(JNIEnv* env, const DexposedBootstrapFunction* phases) {
+    if (dexposedBootstrapState != DEXPOSED_BOOTSTRAP_NOT_RUN)
+        return dexposedBootstrapState == DEXPOSED_BOOTSTRAP_DONE;
+
+    pthread_mutex_lock(&dexposedBootstrapLock);
+    if (dexposedBootstrapState == DEXPOSED_BOOTSTRAP_NOT_RUN) {
+        int state = DEXPOSED_BOOTSTRAP_DONE;
+        for (int i = DEXPOSED_BOOTSTRAP_LOAD + 1; i < DEXPOSED_BOOTSTRAP_PHASES; i++) {
+            if (phases[i] == NULL)
+                continue;
+            uint64_t startNs = dexposedNanoTime();
+            bool done = phases[i](env);
+            dexposedBootstrapTimed((DexposedBootstrapPhase) i, startNs);
+            if (!done) {
+                state = DEXPOSED_BOOTSTRAP_FAILED;
+                break;
+            }
+        }
+        __sync_synchronize();
+        dexposedBootstrapState = state;
+    }
+    pthread_mutex_unlock(&dexposedBootstrapLock);
+    return dexposedBootstrapState == DEXPOSED_BOOTSTRAP_DONE;
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native long[] getBootstrapTimingsNative()
+ *
+ * Returns the nanoseconds spent in every phase, -1 for phases which were not run.
+ */
+static jlongArray com_taobao_android_dexposed_DexposedBridge_getBootstrapTimingsNative(JNIEnv* env, jclass clazz) {
+    jlong timings[DEXPOSED_BOOTSTRAP_PHASES];
+    pthread_mutex_lock(&dexposedBootstrapLock);
+    for (int i = 0; i < DEXPOSED_BOOTSTRAP_PHASES; i++)
+        timings[i] = dexposedBootstrapNanos[i];
+    pthread_mutex_unlock(&dexposedBootstrapLock);
+
+    jlongArray result = env->NewLongArray(DEXPOSED_BOOTSTRAP_PHASES);
+    if (result != NULL)
+        env->SetLongArrayRegion(result, 0, DEXPOSED_BOOTSTRAP_PHASES, timings);
+    return result;
+}
+
+#endif  // DEXPOSED_BOOTSTRAP_H_
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Caller profiles of hooks.
+ *
+ * A profiled hook counts its calls per call site, a call site being the
+ * calling method and a position in it: the return pc on ART, which is
+ * turned into a dex pc when the profile is read, and the dex pc on Dalvik.
+ * Calls made from native code or by reflection have no calling method.
+ *
+ * The table is open addressed and takes no lock. A handler claims a free
+ * entry by setting its tag with a compare and swap, writes the call site
+ * and publishes it by counting the first call. Entries are never freed, a
+ * call which finds no entry within DEXPOSED_CALLERS_MAX_PROBES is counted
+ * as dropped.
+ *
+ * Handlers record inside the epoch read section in which they look up the
+ * hook info, a table which is replaced is reclaimed like a memoization
+ * cache.
+ */
+
+#ifndef DEXPOSED_CALLERS_H_
+#define DEXPOSED_CALLERS_H_
+
+#include <jni.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dexposed_epoch.h"
+#include "dexposed_hook_control.h"
+
+#define DEXPOSED_CALLERS_MAX_PROBES 8
+#define DEXPOSED_CALLERS_MAX_CAPACITY (1u << 16)
+
+struct DexposedCallerEntry {
+    volatile uint32_t tag;          // hash of the call site, 0 while the entry is free
+    volatile uint32_t count;        // 0 until the call site is written
+    const void* volatile caller;    // the calling method, NULL if it is not known
+    volatile uintptr_t pc;
+};
+
+struct DexposedCallerTable {
+    uint32_t mask;
+    volatile uint32_t calls;
+    volatile uint32_t dropped;
+    DexposedCallerEntry* entries;
+};
+
+// never 0
+static inline uint32_t dexposedCallerHash(const void* caller, uintptr_t pc) {
+    uint64_t key = (uint64_t) (uintptr_t) caller ^ ((uint64_t) pc * 0x9e3779b97f4a7c15ULL);
+    uint32_t hash = (uint32_t) (key ^ (key >> 32));
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash != 0 ? hash : 1;
+}
+
+static void dexposedCallerRecord(DexposedCallerTable* table, const void* caller, uintptr_t pc) {
+    const uint32_t tag = dexposedCallerHash(caller, pc);
+    uint32_t index = tag & table->mask;
+    for (uint32_t probe = 0; probe < DEXPOSED_CALLERS_MAX_PROBES; probe++, index = (index + 1) & table->mask) {
+        DexposedCallerEntry* entry = &table->entries[index];
+        uint32_t current = entry->tag;
+        if (current == 0) {
+            if (__sync_bool_compare_and_swap(&entry->tag, 0, tag)) {
+                entry->caller = caller;
+                entry->pc = pc;
+                // a full barrier, the call site is written before the count
+                __sync_add_and_fetch(&entry->count, 1);
+                __sync_add_and_fetch(&table->calls, 1);
+                return;
+            }
+            current = entry->tag;
+        }
+        if (current != tag)
+            continue;
+        if (entry->count == 0) {
+            // claimed by another thread which did not write the call site yet, maybe this one
+            break;
+        }
+        __sync_synchronize();
+        if (entry->caller == caller && entry->pc == pc) {
+            __sync_add_and_fetch(&entry->count, 1);
+            __sync_add_and_fetch(&table->calls, 1);
+            return;
+        }
+    }
+    __sync_add_and_fetch(&table->dropped, 1);
+}
+
+// capacity is rounded up to a power of two, at least DEXPOSED_CALLERS_MAX_PROBES entries
+static DexposedCallerTable* dexposedCallerCreate(uint32_t capacity) {
+    if (capacity > DEXPOSED_CALLERS_MAX_CAPACITY)
+        capacity = DEXPOSED_CALLERS_MAX_CAPACITY;
+    uint32_t size = DEXPOSED_CALLERS_MAX_PROBES;
+    while (size < capacity)
+        size <<= 1;
+
+    DexposedCallerTable* table = (DexposedCallerTable*) calloc(1, sizeof(DexposedCallerTable));
+    if (table == NULL)
+        return NULL;
+    table->mask = size - 1;
+    table->entries = (DexposedCallerEntry*) calloc(size, sizeof(DexposedCallerEntry));
+    if (table->entries == NULL) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+static void dexposedCallerFree(void* data, void* context) {
+    DexposedCallerTable* table = (DexposedCallerTable*) data;
+    free(table->entries);
+    free(table);
+}
+
+// makes table (NULL to stop profiling) the caller profile of the hook, the previous one is
+// reclaimed once no handler can use it anymore
+static void dexposedCallerInstall(JNIEnv* env, DexposedHookControl* control, DexposedCallerTable* table) {
+    __sync_synchronize();
+    DexposedCallerTable* previous = __sync_lock_test_and_set(&control->callerTable, table);
+    if (previous != NULL)
+        dexposedEpochRetire(previous, dexposedCallerFree);
+    dexposedEpochReclaim(env);
+}
+
+// copies the max (at least 1) most frequent call sites of the hook into top, most frequent
+// first, and stores { calls, dropped } in totals. Returns the number of call sites copied, or
+// -1 if the hook is not profiled.
+static int32_t dexposedCallerTop(DexposedHookControl* control, DexposedCallerEntry* top, uint32_t max,
+        uint32_t* totals) {
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state == NULL)
+        return -1;
+
+    uint32_t found = 0;
+    dexposedEpochEnter(state);
+    DexposedCallerTable* table = control->callerTable;
+    if (table != NULL) {
+        totals[0] = table->calls;
+        totals[1] = table->dropped;
+        for (uint32_t i = 0; i <= table->mask; i++) {
+            const DexposedCallerEntry* entry = &table->entries[i];
+            uint32_t count = entry->count;
+            if (count == 0 || (found == max && count <= top[max - 1].count))
+                continue;
+            __sync_synchronize();
+
+            // insertion into the sorted top, the last one falls off when it is full
+            uint32_t position = found < max ? found++ : max - 1;
+            while (position > 0 && top[position - 1].count < count) {
+                top[position] = top[position - 1];
+                position--;
+            }
+            top[position].tag = entry->tag;
+            top[position].count = count;
+            top[position].caller = entry->caller;
+            top[position].pc = entry->pc;
+        }
+    }
+    dexposedEpochExit(state);
+    return table != NULL ? (int32_t) found : -1;
+}
+
+// stores the name of the calling method of a call site, NULL if it is not known, and returns the
+// dex pc of the call in it, -1 if it is not known
+typedef jint (*DexposedCallerDescribeFunction)(JNIEnv* env, const DexposedCallerEntry* site, jstring* name);
+
+// returns the names of the most frequent callers of the hook, or NULL if it is not profiled. counts
+// receives { calls, dropped, dex pc 0, count 0, dex pc 1, count 1, ... }, its length bounds the
+// number of callers.
+static jobjectArray dexposedCallerTopCallers(JNIEnv* env, DexposedHookControl* control, jintArray counts,
+        DexposedCallerDescribeFunction describe) {
+    jsize length = env->GetArrayLength(counts);
+    if (length < 4)
+        return NULL;
+    uint32_t max = (length - 2) / 2;
+    DexposedCallerEntry* top = (DexposedCallerEntry*) malloc(max * sizeof(DexposedCallerEntry));
+    jint* values = (jint*) malloc(length * sizeof(jint));
+    if (top == NULL || values == NULL) {
+        free(top);
+        free(values);
+        return NULL;
+    }
+
+    uint32_t totals[2];
+    jobjectArray names = NULL;
+    int32_t found = dexposedCallerTop(control, top, max, totals);
+    jclass stringClass = found >= 0 ? env->FindClass("java/lang/String") : NULL;
+    if (stringClass != NULL)
+        names = env->NewObjectArray(found, stringClass, NULL);
+    if (names != NULL) {
+        values[0] = totals[0];
+        values[1] = totals[1];
+        for (int32_t i = 0; i < found; i++) {
+            jstring name = NULL;
+            values[2 + 2 * i] = describe(env, &top[i], &name);
+            values[3 + 2 * i] = top[i].count;
+            env->SetObjectArrayElement(names, i, name);
+            env->DeleteLocalRef(name);
+        }
+        env->SetIntArrayRegion(counts, 0, 2 + 2 * found, values);
+    }
+    env->DeleteLocalRef(stringClass);
+    free(top);
+    free(values);
+    return names;
+}
+
+#endif  // DEXPOSED_CALLERS_H_
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Transactions patching the code of several functions at once.
+ *
+ * Patches are gathered first and written by one commit: they are sorted
+ * by address and the pages they touch are merged into ranges, each range
+ * is made writable with one mprotect(), every patch is written, the
+ * instruction cache is flushed once per range and the range is made
+ * read-only and executable again. Patches on the same or adjacent pages
+ * cost no more than one.
+ *
+ * A commit writes all patches or none: every range is made writable before
+ * the first patch is written, if one cannot be nothing is written. A
+ * transaction a patch could not be added to must be aborted, committing
+ * the rest would apply only part of it.
+ */
+
+#ifndef DEXPOSED_CODE_PATCH_H_
+#define DEXPOSED_CODE_PATCH_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DEXPOSED_CODE_PATCH_MAX 16
+#define DEXPOSED_CODE_PATCH_MAX_BYTES 16
+
+struct DexposedCodePatch {
+    uintptr_t address;
+    uint32_t length;
+    uint8_t code[DEXPOSED_CODE_PATCH_MAX_BYTES];
+};
+
+// pages [start, end) and the patches [first, last) on them
+struct DexposedCodePatchRange {
+    uintptr_t start;
+    uintptr_t end;
+    uint32_t first;
+    uint32_t last;
+};
+
+// lives on the stack of the thread patching, it is not thread safe
+struct DexposedCodePatchTransaction {
+    uint32_t count;
+    DexposedCodePatch patches[DEXPOSED_CODE_PATCH_MAX];
+};
+
+static inline void dexposedCodePatchBegin(DexposedCodePatchTransaction* transaction) {
+    transaction->count = 0;
+}
+
+// adds a patch writing code over length bytes at address, false if the transaction is full or the
+// code too long. Thumb functions are patched at their address without the mode bit.
+static bool dexposedCodePatchAdd(DexposedCodePatchTransaction* transaction, uintptr_t address,
+        const void* code, size_t length) {
+    if (transaction->count == DEXPOSED_CODE_PATCH_MAX || length == 0 || length > DEXPOSED_CODE_PATCH_MAX_BYTES)
+        return false;
+    DexposedCodePatch* patch = &transaction->patches[transaction->count++];
+    patch->address = address;
+    patch->length = length;
+    memcpy(patch->code, code, length);
+    return true;
+}
+
+// drops the patches added so far, nothing is written
+static inline void dexposedCodePatchAbort(DexposedCodePatchTransaction* transaction) {
+    transaction->count = 0;
+}
+
+// sorts the patches by address, false if two of them overlap
+static bool dexposedCodePatchSort(DexposedCodePatchTransaction* transaction) {
+    DexposedCodePatch* patches = transaction->patches;
+    for (uint32_t i = 1; i < transaction->count; i++) {
+        DexposedCodePatch patch = patches[i];
+        uint32_t j = i;
+        for (; j > 0 && patches[j - 1].address > patch.address; j--)
+            patches[j] = patches[j - 1];
+        patches[j] = patch;
+    }
+    for (uint32_t i = 1; i < transaction->count; i++) {
+        if (patches[i - 1].address + patches[i - 1].length > patches[i].address)
+            return false;
+    }
+    return true;
+}
+
+// merges the pages of the sorted patches into ranges, returns the number of ranges
+static uint32_t dexposedCodePatchRanges(const DexposedCodePatchTransaction* transaction,
+        DexposedCodePatchRange* ranges) {
+    const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < transaction->count; i++) {
+        const DexposedCodePatch* patch = &transaction->patches[i];
+        uintptr_t start = patch->address & ~(pageSize - 1);
+        uintptr_t end = (patch->address + patch->length + pageSize - 1) & ~(pageSize - 1);
+        if (count > 0 && start <= ranges[count - 1].end) {
+            if (end > ranges[count - 1].end)
+                ranges[count - 1].end = end;
+            ranges[count - 1].last = i + 1;
+            continue;
+        }
+        ranges[count].start = start;
+        ranges[count].end = end;
+        ranges[count].first = i;
+        ranges[count].last = i + 1;
+        count++;
+    }
+    return count;
+}
+
+// code pages are read-only and executable while they are not patched
+static void dexposedCodePatchClose(const DexposedCodePatchRange* ranges, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++)
+        mprotect((void*) ranges[i].start, ranges[i].end - ranges[i].start, PROT_READ | PROT_EXEC);
+}
+
+static void dexposedCodePatchFlush(const DexposedCodePatchTransaction* transaction,
+        const DexposedCodePatchRange* range) {
+    const DexposedCodePatch* first = &transaction->patches[range->first];
+    const DexposedCodePatch* last = &transaction->patches[range->last - 1];
+    __builtin___clear_cache((char*) first->address, (char*) (last->address + last->length));
+}
+
+// writes all patches of the transaction or none, see above. The transaction can be committed only once.
+static bool dexposedCodePatchCommit(DexposedCodePatchTransaction* transaction) {
+    if (transaction->count == 0)
+        return true;
+    if (!dexposedCodePatchSort(transaction))
+        return false;
+
+    DexposedCodePatchRange ranges[DEXPOSED_CODE_PATCH_MAX];
+    const uint32_t rangeCount = dexposedCodePatchRanges(transaction, ranges);
+    for (uint32_t i = 0; i < rangeCount; i++) {
+        if (mprotect((void*) ranges[i].start, ranges[i].end - ranges[i].start,
+                PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+            dexposedCodePatchClose(ranges, i);
+            return false;
+        }
+    }
+
+    // the pages are writable, the writes cannot fail
+    for (uint32_t i = 0; i < transaction->count; i++) {
+        const DexposedCodePatch* patch = &transaction->patches[i];
+        memcpy((void*) patch->address, patch->code, patch->length);
+    }
+
+    for (uint32_t i = 0; i < rangeCount; i++)
+        dexposedCodePatchFlush(transaction, &ranges[i]);
+    dexposedCodePatchClose(ranges, rangeCount);
+    return true;
+}
+
+#endif  // DEXPOSED_CODE_PATCH_H_
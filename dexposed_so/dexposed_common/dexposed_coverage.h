@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Counters of the coverage mode, the layout is described in
+ * dexposed_coverage_format.h.
+ *
+ * A counted method is not hooked: its handler increments the counter and
+ * runs the original code, there is no hook info and no callbacks. Only
+ * dalvik counts methods. On art foreign code in front of compiled code
+ * breaks the lookups of its method header and a hook per method costs a
+ * backup and a global reference, too much for thousands of methods. The
+ * counters are mapped from a file when a path is given, else from
+ * anonymous memory.
+ */
+
+#ifndef DEXPOSED_COVERAGE_H_
+#define DEXPOSED_COVERAGE_H_
+
+#include <jni.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dexposed_coverage_format.h"
+
+struct DexposedCoverageFile {
+    DexposedCoverageHeader* header;
+    volatile uint32_t* counters;
+    DexposedCoverageName* names;
+    size_t size;
+};
+
+// set once, the mapping is never removed since stubs may be counting at any time
+static DexposedCoverageFile* volatile dexposedCoverageFile = NULL;
+
+// creates the counters for capacity methods, in the file at path if it is not NULL
+static bool dexposedCoverageStart(const char* path, uint32_t capacity) {
+    if (dexposedCoverageFile != NULL || capacity == 0 || capacity > (1u << 20))
+        return false;
+
+    size_t countersOffset = DEXPOSED_COVERAGE_HEADER_SIZE;
+    // the names start on their own page, the counters are the hot part
+    size_t namesOffset = (countersOffset + capacity * sizeof(uint32_t) + 4095) & ~(size_t) 4095;
+    size_t size = namesOffset + (size_t) capacity * sizeof(DexposedCoverageName);
+
+    void* mapping;
+    if (path != NULL) {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            return false;
+        }
+        mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (mapping == MAP_FAILED)
+        return false;
+
+    DexposedCoverageFile* file = (DexposedCoverageFile*) calloc(1, sizeof(DexposedCoverageFile));
+    if (file == NULL) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    DexposedCoverageHeader* header = (DexposedCoverageHeader*) mapping;
+    header->version = DEXPOSED_COVERAGE_VERSION;
+    header->headerSize = DEXPOSED_COVERAGE_HEADER_SIZE;
+    header->countersOffset = countersOffset;
+    header->namesOffset = namesOffset;
+    header->nameSize = sizeof(DexposedCoverageName);
+    header->capacity = capacity;
+    header->pid = getpid();
+    __sync_synchronize();
+    memcpy(header->magic, DEXPOSED_COVERAGE_MAGIC, sizeof(DEXPOSED_COVERAGE_MAGIC));
+
+    file->header = header;
+    file->counters = (volatile uint32_t*) ((char*) mapping + countersOffset);
+    file->names = (DexposedCoverageName*) ((char*) mapping + namesOffset);
+    file->size = size;
+    __sync_synchronize();
+    dexposedCoverageFile = file;
+    return true;
+}
+
+// hands out the next coverage id and names it, returns -1 if all are taken or coverage
+// was not started. The counter of the id is only incremented by stubs.
+static int32_t dexposedCoverageAdd(const char* name) {
+    DexposedCoverageFile* file = dexposedCoverageFile;
+    if (file == NULL)
+        return -1;
+
+    DexposedCoverageHeader* header = file->header;
+    uint32_t id;
+    do {
+        id = header->count;
+        if (id >= header->capacity)
+            return -1;
+    } while (!__sync_bool_compare_and_swap(&header->count, id, id + 1));
+
+    // the first character is written last, it marks the name as complete
+    if (name[0] == '\0')
+        name = "?";
+    char* dst = file->names[id].name;
+    strncpy(dst + 1, name + 1, sizeof(DexposedCoverageName) - 2);
+    __sync_synchronize();
+    dst[0] = name[0];
+    return id;
+}
+
+static inline volatile uint32_t* dexposedCoverageCounter(uint32_t id) {
+    return &dexposedCoverageFile->counters[id];
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native boolean startCoverageNative(String path, int capacity)
+ */
+static jboolean com_taobao_android_dexposed_DexposedBridge_startCoverageNative(JNIEnv* env, jclass clazz,
+            jstring path, jint capacity) {
+    if (path == NULL)
+        return dexposedCoverageStart(NULL, capacity);
+
+    const char* pathChars = env->GetStringUTFChars(path, NULL);
+    if (pathChars == NULL)
+        return false;
+    bool started = dexposedCoverageStart(pathChars, capacity);
+    env->ReleaseStringUTFChars(path, pathChars);
+    return started;
+}
+
+/*
+ * private static native int[] getCoverageCountsNative()
+ *
+ * Returns the counters of all coverage ids handed out, or null before coverage was started.
+ */
+static jintArray com_taobao_android_dexposed_DexposedBridge_getCoverageCountsNative(JNIEnv* env, jclass clazz) {
+    DexposedCoverageFile* file = dexposedCoverageFile;
+    if (file == NULL)
+        return NULL;
+
+    uint32_t count = file->header->count;
+    jintArray result = env->NewIntArray(count);
+    if (result != NULL)
+        env->SetIntArrayRegion(result, 0, count, (const jint*) file->counters);
+    return result;
+}
+
+/*
+ * private static native void syncCoverageNative()
+ */
+static void com_taobao_android_dexposed_DexposedBridge_syncCoverageNative(JNIEnv* env, jclass clazz) {
+    DexposedCoverageFile* file = dexposedCoverageFile;
+    if (file != NULL)
+        msync(file->header, file->size, MS_SYNC);
+}
+
+#endif  // DEXPOSED_COVERAGE_H_
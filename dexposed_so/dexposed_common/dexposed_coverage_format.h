@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Coverage file of counted methods, written by the coverage stubs and read
+ * by the host decoder in dexposed_tools.
+ *
+ * Every counted method has a coverage id, its calls are counted in the
+ * counter with that index. The counters are one dense array apart from
+ * the names, so the stubs only touch a few cache lines. Layout:
+ *
+ *   offset 0                 DexposedCoverageHeader
+ *   countersOffset           capacity x uint32_t, counter of coverage id i
+ *   namesOffset              capacity x DexposedCoverageName, name of coverage id i
+ *
+ * Counters wrap around at 2^32. A name is complete once its first byte is
+ * not 0, methods are counted from then on.
+ */
+
+#ifndef DEXPOSED_COVERAGE_FORMAT_H_
+#define DEXPOSED_COVERAGE_FORMAT_H_
+
+#include <stdint.h>
+
+#define DEXPOSED_COVERAGE_MAGIC "DXCOVER"
+#define DEXPOSED_COVERAGE_VERSION 1
+#define DEXPOSED_COVERAGE_HEADER_SIZE 4096
+
+struct DexposedCoverageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t countersOffset;
+    uint32_t namesOffset;
+    uint32_t nameSize;
+    uint32_t capacity;
+    uint32_t pid;
+    volatile uint32_t count;        // coverage ids handed out so far
+};
+
+struct DexposedCoverageName {
+    char name[128];
+};
+
+#endif  // DEXPOSED_COVERAGE_FORMAT_H_
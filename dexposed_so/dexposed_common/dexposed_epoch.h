@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Epoch based reclamation of data read by the hook handlers.
+ *
+ * A handler reads shared data inside a read section: it announces the
+ * current global epoch in its thread state, reads, and clears the
+ * announcement again. Read sections take no lock and nest.
+ *
+ * A writer first unpublishes the data (e.g. swaps a pointer to a new
+ * version), then retires it, which advances the global epoch. The data is
+ * reclaimed once no thread is inside a read section it entered before the
+ * retirement. Read sections must therefore stay short, they must not call
+ * into Java or block.
+ */
+
+#ifndef DEXPOSED_EPOCH_H_
+#define DEXPOSED_EPOCH_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dexposed_thread.h"
+
+typedef void (*DexposedReclaimFunction)(void* data, void* context);
+
+struct DexposedRetired {
+    DexposedRetired* next;
+    // value of the global epoch after the data was retired
+    uint32_t epoch;
+    void* data;
+    DexposedReclaimFunction reclaim;
+};
+
+// starts at 1, an announced epoch of 0 means the thread is not reading
+static volatile uint32_t dexposedEpoch = 1;
+
+static pthread_mutex_t dexposedRetiredLock = PTHREAD_MUTEX_INITIALIZER;
+static DexposedRetired* dexposedRetired = NULL;
+
+static inline void dexposedEpochEnter(DexposedThreadState* state) {
+    if (state->epochNesting++ != 0)
+        return;
+    state->epoch = dexposedEpoch;
+    // the announcement must be visible before any shared pointer is read
+    __sync_synchronize();
+}
+
+static inline void dexposedEpochExit(DexposedThreadState* state) {
+    if (--state->epochNesting != 0)
+        return;
+    __sync_synchronize();
+    state->epoch = 0;
+}
+
+// queues data which readers can no longer find for reclamation, returns false if
+// the entry could not be allocated, the data is then leaked
+static bool dexposedEpochRetire(void* data, DexposedReclaimFunction reclaim) {
+    DexposedRetired* retired = (DexposedRetired*) malloc(sizeof(DexposedRetired));
+    if (retired == NULL)
+        return false;
+
+    retired->data = data;
+    retired->reclaim = reclaim;
+    // a full barrier, readers which announce this epoch or a later one see the new version
+    retired->epoch = __sync_add_and_fetch(&dexposedEpoch, 1);
+
+    pthread_mutex_lock(&dexposedRetiredLock);
+    retired->next = dexposedRetired;
+    dexposedRetired = retired;
+    pthread_mutex_unlock(&dexposedRetiredLock);
+    return true;
+}
+
+// returns the oldest epoch a thread is still reading in, or 0 if no thread is reading
+static uint32_t dexposedEpochOldestReader() {
+    uint32_t oldest = 0;
+    pthread_mutex_lock(&dexposedThreadStatesLock);
+    for (DexposedThreadState* state = dexposedThreadStates; state != NULL; state = state->next) {
+        uint32_t epoch = state->epoch;
+        if (epoch != 0 && (oldest == 0 || epoch < oldest))
+            oldest = epoch;
+    }
+    pthread_mutex_unlock(&dexposedThreadStatesLock);
+    return oldest;
+}
+
+// reclaims the retired data no reader can see anymore, context is passed on to the
+// reclaim functions. Returns the number of entries which are still waiting.
+static uint32_t dexposedEpochReclaim(void* context) {
+    pthread_mutex_lock(&dexposedRetiredLock);
+    __sync_synchronize();
+    uint32_t oldest = dexposedEpochOldestReader();
+
+    uint32_t waiting = 0;
+    DexposedRetired** link = &dexposedRetired;
+    while (*link != NULL) {
+        DexposedRetired* retired = *link;
+        if (oldest != 0 && oldest < retired->epoch) {
+            waiting++;
+            link = &retired->next;
+            continue;
+        }
+        *link = retired->next;
+        retired->reclaim(retired->data, context);
+        free(retired);
+    }
+    pthread_mutex_unlock(&dexposedRetiredLock);
+    return waiting;
+}
+
+#endif  // DEXPOSED_EPOCH_H_
@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runtime independent per-hook settings. Both runtimes embed a
+ * DexposedHookControl in their DexposedHookInfo and ask
+ * dexposedShouldDispatch() at the top of the native handler whether a call
+ * goes through the Java callbacks or straight to the original method.
+ *
+ * All fields are 32 bits wide so that they can be updated with the atomic
+ * builtins on every ABI we build for (armeabi has no 64 bit atomics).
+ */
+
+#ifndef DEXPOSED_HOOK_CONTROL_H_
+#define DEXPOSED_HOOK_CONTROL_H_
+
+#include "dexposed_thread.h"
+
+enum DexposedBudgetRearmPolicy {
+    // stay in pass-through mode until the budget is re-armed explicitly
+    DEXPOSED_BUDGET_REARM_MANUAL = 0,
+    // dispatch again once budgetCooldownMs have passed since the trip
+    DEXPOSED_BUDGET_REARM_AFTER_COOLDOWN = 1,
+};
+
+enum DexposedDispatchMode {
+    // only synchronous callbacks, calls go through the Java handler
+    DEXPOSED_DISPATCH_SYNC = 0,
+    // calls go through the Java handler and are queued for the asynchronous callbacks afterwards
+    DEXPOSED_DISPATCH_SYNC_AND_ASYNC = 1,
+    // only asynchronous callbacks, the original method is called directly and the call is queued
+    DEXPOSED_DISPATCH_ASYNC_ONLY = 2,
+    // no callbacks, the hook only profiles and the original method is called directly
+    DEXPOSED_DISPATCH_NONE = 3,
+};
+
+enum DexposedNestedPolicy {
+    // calls made by callback code are dispatched like any other call
+    DEXPOSED_NESTED_DISPATCH = 0,
+    // calls made by callback code go straight to the original method
+    DEXPOSED_NESTED_PASS_THROUGH = 1,
+};
+
+enum DexposedThreadFilter {
+    // every thread
+    DEXPOSED_THREAD_FILTER_ALL = 0,
+    // only the main thread
+    DEXPOSED_THREAD_FILTER_MAIN = 1,
+    // every thread but the main thread
+    DEXPOSED_THREAD_FILTER_BACKGROUND = 2,
+    // only the threads in filterTids
+    DEXPOSED_THREAD_FILTER_TIDS = 3,
+    // only the threads which opted in, see DexposedThreadState.filterOptIn
+    DEXPOSED_THREAD_FILTER_OPT_IN = 4,
+};
+
+#define DEXPOSED_MAX_FILTER_TIDS 8
+
+// group 0 holds the hooks which were not put into a group and is never disabled
+#define DEXPOSED_MAX_HOOK_GROUPS 256
+
+// one flag per hook group, the hooks of a disabled group are passed through
+static volatile uint32_t dexposedHookGroupDisabled[DEXPOSED_MAX_HOOK_GROUPS];
+
+struct DexposedHookControl {
+    // unique per hooked method, assigned when the hook is installed
+    uint32_t hookId;
+
+    // the flag of the group of the hook, shared by all its hooks
+    volatile uint32_t* volatile groupDisabled;
+
+    // dispatch only one in samplingRate calls, 0 and 1 dispatch every call
+    volatile uint32_t samplingRate;
+
+    // a DexposedDispatchMode, set from Java whenever the callbacks change
+    volatile uint32_t dispatchMode;
+
+    // a DexposedNestedPolicy
+    volatile uint32_t nestedPolicy;
+
+    // a DexposedThreadFilter, calls on other threads are passed through before anything else
+    volatile uint32_t threadFilter;
+    volatile uint32_t filterTidCount;
+    volatile uint32_t filterTids[DEXPOSED_MAX_FILTER_TIDS];
+
+    // the stack of one in stackSamplingRate calls is sampled, 0 samples none, see dexposed_stacks.h
+    volatile uint32_t stackSamplingRate;
+
+    // one in allocationSamplingRate calls of a constructor is counted as an allocation, 0 counts
+    // none, see dexposed_allocations.h
+    volatile uint32_t allocationSamplingRate;
+
+    // calls are recorded to the trace file, see dexposed_trace.h
+    volatile uint32_t traceEnabled;
+
+    // calls are written as systrace slices, the begin marker is formatted when systrace is first
+    // enabled and freed with the hook, see dexposed_systrace.h
+    volatile uint32_t systraceEnabled;
+    struct DexposedSystraceMarker* volatile systraceMarker;
+
+    // results of earlier calls, NULL while the hook is not memoized, see dexposed_memo.h
+    struct DexposedMemoCache* volatile memoCache;
+
+    // call sites of the calls, NULL while the callers are not profiled, see dexposed_callers.h
+    struct DexposedCallerTable* volatile callerTable;
+
+    // the slot of the hook in the stats file, NULL while no stats are kept, see dexposed_stats.h
+    struct DexposedStatsSlot* volatile statsSlot;
+
+    // cost budget of the dispatched calls, the breaker is off while budgetWindowMs is 0
+    volatile uint32_t budgetWindowMs;
+    volatile uint32_t budgetMaxUs;      // 0 means no limit on the time spent
+    volatile uint32_t budgetMaxCalls;   // 0 means no limit on the number of calls
+    volatile uint32_t budgetRearmPolicy;
+    volatile uint32_t budgetCooldownMs;
+
+    // sliding window made of the current and the previous fixed window
+    volatile uint32_t windowStartMs;
+    volatile uint32_t windowUs;
+    volatile uint32_t windowCalls;
+    volatile uint32_t previousWindowUs;
+    volatile uint32_t previousWindowCalls;
+
+    // set while the hook is passed through because it exceeded its budget
+    volatile int32_t budgetTripped;
+    volatile uint32_t budgetTrippedAtMs;
+    volatile uint32_t budgetTripCount;
+
+    // calls which are in the handler of the hook, see dexposed_memory.h
+    volatile uint32_t activeCalls;
+    // native memory and global references held by the hook, set when it is installed
+    uint32_t nativeBytes;
+    uint32_t globalRefs;
+    // next removed hook waiting to be freed
+    DexposedHookControl* nextRemoved;
+};
+
+static volatile uint32_t dexposedLastHookId = 0;
+
+static inline uint32_t dexposedNextHookId() {
+    return __sync_add_and_fetch(&dexposedLastHookId, 1);
+}
+
+// must be called when a hook is installed, before the handler can see it
+static inline void dexposedHookControlInit(DexposedHookControl* control) {
+    control->hookId = dexposedNextHookId();
+    control->groupDisabled = &dexposedHookGroupDisabled[0];
+}
+
+static inline bool dexposedSetHookGroup(DexposedHookControl* control, uint32_t group) {
+    if (group >= DEXPOSED_MAX_HOOK_GROUPS)
+        return false;
+    control->groupDisabled = &dexposedHookGroupDisabled[group];
+    return true;
+}
+
+static inline bool dexposedSetHookGroupEnabled(uint32_t group, bool enabled) {
+    if (group == 0 || group >= DEXPOSED_MAX_HOOK_GROUPS)
+        return false;
+    dexposedHookGroupDisabled[group] = !enabled;
+    __sync_synchronize();
+    return true;
+}
+
+// a call racing with the update may be filtered by the old or the new settings
+static bool dexposedSetThreadFilter(DexposedHookControl* control, uint32_t filter,
+        const uint32_t* tids, uint32_t tidCount) {
+    if (filter > DEXPOSED_THREAD_FILTER_OPT_IN || tidCount > DEXPOSED_MAX_FILTER_TIDS)
+        return false;
+
+    control->threadFilter = DEXPOSED_THREAD_FILTER_ALL;
+    control->filterTidCount = 0;
+    __sync_synchronize();
+    for (uint32_t i = 0; i < tidCount; i++)
+        control->filterTids[i] = tids[i];
+    control->filterTidCount = tidCount;
+    __sync_synchronize();
+    control->threadFilter = filter;
+    return true;
+}
+
+// called at the top of the handlers, before any argument is looked at
+static inline bool dexposedThreadFilterAccepts(const DexposedHookControl* control) {
+    uint32_t filter = control->threadFilter;
+    if (filter == DEXPOSED_THREAD_FILTER_ALL)
+        return true;
+
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state == NULL)
+        return true;
+
+    switch (filter) {
+    case DEXPOSED_THREAD_FILTER_MAIN:
+        return state->tid == dexposedMainTid;
+    case DEXPOSED_THREAD_FILTER_BACKGROUND:
+        return state->tid != dexposedMainTid;
+    case DEXPOSED_THREAD_FILTER_TIDS: {
+        uint32_t count = control->filterTidCount;
+        for (uint32_t i = 0; i < count; i++) {
+            if (control->filterTids[i] == state->tid)
+                return true;
+        }
+        return false;
+    }
+    case DEXPOSED_THREAD_FILTER_OPT_IN:
+        return state->filterOptIn != 0;
+    }
+    return true;
+}
+
+static inline uint64_t dexposedNanoTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline bool dexposedBudgetEnabled(const DexposedHookControl* control) {
+    return control->budgetWindowMs != 0;
+}
+
+static inline void dexposedBudgetReset(DexposedHookControl* control) {
+    control->windowStartMs = (uint32_t) (dexposedNanoTime() / 1000000);
+    control->windowUs = 0;
+    control->windowCalls = 0;
+    control->previousWindowUs = 0;
+    control->previousWindowCalls = 0;
+    __sync_synchronize();
+    control->budgetTripped = 0;
+}
+
+// returns true if a tripped hook may be dispatched again
+static inline bool dexposedBudgetTryRearm(DexposedHookControl* control) {
+    if (control->budgetRearmPolicy != DEXPOSED_BUDGET_REARM_AFTER_COOLDOWN)
+        return false;
+
+    uint32_t nowMs = (uint32_t) (dexposedNanoTime() / 1000000);
+    if (nowMs - control->budgetTrippedAtMs < control->budgetCooldownMs)
+        return false;
+
+    // only one thread resets the window, the others keep passing through meanwhile
+    if (!__sync_bool_compare_and_swap(&control->budgetTripped, 1, 2))
+        return control->budgetTripped == 0;
+
+    dexposedBudgetReset(control);
+    return true;
+}
+
+/*
+ * Accounts one dispatched call whose callbacks ran for costNs, the call ended
+ * at endNs. Returns true if this call tripped the breaker, the caller then
+ * notifies the Java side. Updates from concurrent callers are not
+ * serialized, the window is an estimate and may lose a few calls around its
+ * rotation.
+ */
+static inline bool dexposedBudgetRecord(DexposedHookControl* control, uint64_t costNs, uint64_t endNs) {
+    uint32_t windowMs = control->budgetWindowMs;
+    if (windowMs == 0)
+        return false;
+
+    uint32_t nowMs = (uint32_t) (endNs / 1000000);
+    uint32_t costUs = (uint32_t) (costNs / 1000);
+
+    uint32_t startMs = control->windowStartMs;
+    uint32_t elapsedMs = nowMs - startMs;
+    if (elapsedMs >= windowMs) {
+        if (__sync_bool_compare_and_swap(&control->windowStartMs, startMs, nowMs)) {
+            uint32_t lastUs = __sync_lock_test_and_set(&control->windowUs, 0);
+            uint32_t lastCalls = __sync_lock_test_and_set(&control->windowCalls, 0);
+            // the previous window only counts if it ended right before this one
+            bool adjacent = elapsedMs < 2 * windowMs;
+            control->previousWindowUs = adjacent ? lastUs : 0;
+            control->previousWindowCalls = adjacent ? lastCalls : 0;
+        }
+        elapsedMs = nowMs - control->windowStartMs;
+        if (elapsedMs > windowMs)
+            elapsedMs = windowMs;
+    }
+
+    uint32_t us = __sync_add_and_fetch(&control->windowUs, costUs);
+    uint32_t calls = __sync_add_and_fetch(&control->windowCalls, 1);
+
+    // weight the previous window by the part of it still covered by the sliding window
+    uint32_t remainingMs = windowMs - elapsedMs;
+    uint64_t estimatedUs = us + (uint64_t) control->previousWindowUs * remainingMs / windowMs;
+    uint64_t estimatedCalls = calls + (uint64_t) control->previousWindowCalls * remainingMs / windowMs;
+
+    uint32_t maxUs = control->budgetMaxUs;
+    uint32_t maxCalls = control->budgetMaxCalls;
+    if ((maxUs == 0 || estimatedUs <= maxUs) && (maxCalls == 0 || estimatedCalls <= maxCalls))
+        return false;
+
+    if (!__sync_bool_compare_and_swap(&control->budgetTripped, 0, 1))
+        return false;
+
+    control->budgetTrippedAtMs = nowMs;
+    __sync_add_and_fetch(&control->budgetTripCount, 1);
+    return true;
+}
+
+// marks the thread as running callback code until dexposedLeaveCallbacks() is called with the
+// returned state. Calls into Java on behalf of a hooked call must be bracketed by these.
+static inline DexposedThreadState* dexposedEnterCallbacks() {
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state != NULL)
+        state->callbackDepth++;
+    return state;
+}
+
+static inline void dexposedLeaveCallbacks(DexposedThreadState* state) {
+    if (state != NULL)
+        state->callbackDepth--;
+}
+
+// an original method run on behalf of a hooked call, see dexposedSuspendCallbacks()
+struct DexposedOriginalCall {
+    uint32_t callbackDepth;
+    uint64_t originalNs;
+    uint64_t startNs;
+};
+
+// times an original method the handler runs itself, its time is not charged to the callbacks
+static inline void dexposedOriginalBegin(DexposedThreadState* state, DexposedOriginalCall* call) {
+    if (state == NULL)
+        return;
+    call->originalNs = state->originalNs;
+    call->startNs = dexposedNanoTime();
+}
+
+// the time of hooked calls made by the original method is part of it, what they accounted is replaced
+static inline void dexposedOriginalEnd(DexposedThreadState* state, const DexposedOriginalCall* call) {
+    if (state != NULL)
+        state->originalNs = call->originalNs + (dexposedNanoTime() - call->startNs);
+}
+
+// the original method called by the callbacks is no callback code, the hooked calls it makes
+// are dispatched normally and its time is not charged to the callbacks. Must be followed by
+// dexposedResumeCallbacks() with the same call.
+static inline void dexposedSuspendCallbacks(DexposedThreadState* state, DexposedOriginalCall* call) {
+    if (state == NULL)
+        return;
+    call->callbackDepth = state->callbackDepth;
+    state->callbackDepth = 0;
+    dexposedOriginalBegin(state, call);
+}
+
+static inline void dexposedResumeCallbacks(DexposedThreadState* state, const DexposedOriginalCall* call) {
+    if (state == NULL)
+        return;
+    dexposedOriginalEnd(state, call);
+    state->callbackDepth = call->callbackDepth;
+}
+
+// measures the time a dispatched call spends outside of original methods
+struct DexposedCallbackClock {
+    uint64_t startNs;
+    uint64_t originalNs;
+};
+
+static inline void dexposedCallbackClockStart(DexposedThreadState* state, DexposedCallbackClock* clock) {
+    clock->startNs = dexposedNanoTime();
+    clock->originalNs = state != NULL ? state->originalNs : 0;
+}
+
+// returns the time since the clock was started minus the time spent in original methods meanwhile
+static inline uint64_t dexposedCallbackClockCost(DexposedThreadState* state, const DexposedCallbackClock* clock,
+        uint64_t nowNs) {
+    uint64_t costNs = nowNs - clock->startNs;
+    uint64_t originalNs = state != NULL ? state->originalNs - clock->originalNs : 0;
+    return originalNs < costNs ? costNs - originalNs : 0;
+}
+
+static inline bool dexposedInCallbacks() {
+    DexposedThreadState* state = dexposedGetThreadState();
+    // the asynchronous callbacks are callback code as well
+    return state != NULL && (state->callbackDepth != 0 || state->asyncWorker);
+}
+
+static inline bool dexposedShouldDispatch(DexposedHookControl* control) {
+    if (control->dispatchMode == DEXPOSED_DISPATCH_NONE || *control->groupDisabled)
+        return false;
+
+    if (control->nestedPolicy == DEXPOSED_NESTED_PASS_THROUGH && dexposedInCallbacks())
+        return false;
+
+    if (control->budgetTripped != 0 && !dexposedBudgetTryRearm(control))
+        return false;
+
+    uint32_t samplingRate = control->samplingRate;
+    if (samplingRate > 1) {
+        DexposedThreadState* state = dexposedGetThreadState();
+        if (state != NULL && dexposedNextRandom(state) % samplingRate != 0)
+            return false;
+    }
+    return true;
+}
+
+#endif  // DEXPOSED_HOOK_CONTROL_H_
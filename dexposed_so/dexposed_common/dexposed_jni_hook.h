@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native hooks of JNI functions.
+ *
+ * A hook from Java dispatches every call of a native method to Java. A JNI
+ * hook stays in native code: the JNI function of the method is switched to
+ * a stub generated for the hook, which runs the before callback, the
+ * original function and the after callback. The stub does not know the
+ * signature of the function, the callbacks see the words of the call as
+ * JNI functions are called on arm (softfp):
+ *
+ *   args    r0-r3: the JNIEnv, the receiver or class and the first two
+ *           words of the arguments. Further arguments stay on the stack
+ *           for the original function.
+ *   result  r0 and r1, the return value of the original function.
+ *
+ * While the original function runs the return address of the call is kept
+ * on a stack of the thread, see jniReturns in dexposed_thread.h. A call
+ * nested deeper than DEXPOSED_JNI_RETURN_DEPTH, or on a thread whose state
+ * could not be allocated, skips the after callback.
+ *
+ * Hooking a hooked function again wraps the previous hook, removing one
+ * removes the last. Registering the natives of the method again drops the
+ * hooks. Hooks are never freed, a thread may still be in the stub of a
+ * removed one. Hooks are only generated on arm.
+ */
+
+#ifndef DEXPOSED_JNI_HOOK_H_
+#define DEXPOSED_JNI_HOOK_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dexposed_perf_map.h"
+#include "dexposed_stubs.h"
+#include "dexposed_thread.h"
+
+// the callbacks of a hook, passed from native code as the address of this struct, which is copied
+struct DexposedJniHook {
+    // runs before the original function, may change args but not the JNIEnv, may be NULL
+    void (*before)(void* data, uint32_t* args);
+    // runs after the original function returned, may change result, may be NULL
+    void (*after)(void* data, uint64_t* result);
+    void* data;
+};
+
+struct DexposedJniHookStub {
+    DexposedJniHook hook;
+    // the function the stub calls, set before the method is switched to code
+    void* volatile original;
+    // the generated code, which the method gets as its JNI function
+    const void* code;
+    // all hooks, guarded by dexposedJniHooksLock
+    DexposedJniHookStub* next;
+};
+
+static pthread_mutex_t dexposedJniHooksLock = PTHREAD_MUTEX_INITIALIZER;
+static DexposedJniHookStub* dexposedJniHooks = NULL;
+
+#if defined(__arm__)
+// called by the stub with r0-r3, ip and lr as it pushed them. Returns the function to call in the
+// low word, the high word is 1 if the stub returns through the after callback.
+static uint64_t dexposedJniHookEnter(DexposedJniHookStub* stub, uint32_t* registers) {
+    if (stub->hook.before != NULL)
+        stub->hook.before(stub->hook.data, registers);
+    uintptr_t original = (uintptr_t) stub->original;
+    if (stub->hook.after == NULL)
+        return original;
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state == NULL || state->jniDepth == DEXPOSED_JNI_RETURN_DEPTH)
+        return original;
+    state->jniReturns[state->jniDepth++] = registers[5];
+    return ((uint64_t) 1 << 32) | original;
+}
+
+// called by the stub with the result of the original function, returns where the call returns to
+static uintptr_t dexposedJniHookExit(DexposedJniHookStub* stub, uint64_t* result) {
+    // the state exists, the return address was pushed on it
+    DexposedThreadState* state = (DexposedThreadState*) pthread_getspecific(dexposedThreadStateKey);
+    uintptr_t returnAddress = state->jniReturns[--state->jniDepth];
+    stub->hook.after(stub->hook.data, result);
+    return returnAddress;
+}
+
+// ARM code, the original function and the callbacks may be Thumb
+static const uint32_t dexposedJniHookStubTemplate[] = {
+    0xe92d500f,  // push  {r0-r3, ip, lr}
+    0xe59f0048,  // ldr   r0, [pc, #72]      @ stub
+    0xe1a0100d,  // mov   r1, sp
+    0xe59fc044,  // ldr   ip, [pc, #68]      @ dexposedJniHookEnter
+    0xe12fff3c,  // blx   ip
+    0xe1a0c000,  // mov   ip, r0
+    0xe3510000,  // cmp   r1, #0
+    0xe8bd000f,  // pop   {r0-r3}            @ as the before callback left them
+    0xe28dd004,  // add   sp, sp, #4
+    0xe49de004,  // pop   {lr}
+    0x012fff1c,  // bxeq  ip                 @ no after callback, a tail call
+    0xe28fe000,  // adr   lr, 1f
+    0xe12fff1c,  // bx    ip                 @ the stack arguments are where the caller put them
+    0xe92d0003,  // 1: push {r0, r1}
+    0xe59f0014,  // ldr   r0, [pc, #20]      @ stub
+    0xe1a0100d,  // mov   r1, sp
+    0xe59fc014,  // ldr   ip, [pc, #20]      @ dexposedJniHookExit
+    0xe12fff3c,  // blx   ip
+    0xe1a0c000,  // mov   ip, r0
+    0xe8bd0003,  // pop   {r0, r1}           @ as the after callback left them
+    0xe12fff1c,  // bx    ip
+    0,           // stub
+    0,           // dexposedJniHookEnter
+    0,           // dexposedJniHookExit
+};
+#define DEXPOSED_JNI_HOOK_STUB_WORD 21
+#define DEXPOSED_JNI_HOOK_ENTER_WORD 22
+#define DEXPOSED_JNI_HOOK_EXIT_WORD 23
+#endif
+
+/*
+ * Creates a hook with the callbacks of hook, its code is named after the method name in the perf
+ * map. The caller sets original and switches the JNI function of the method to code between
+ * dexposedBeginPublish() and dexposedEndPublish(). Returns NULL if hooks are not supported on this
+ * architecture.
+ */
+static DexposedJniHookStub* dexposedJniHookCreate(const DexposedJniHook* hook, const char* name) {
+#if defined(__arm__)
+    const size_t codeSize = sizeof(dexposedJniHookStubTemplate);
+    DexposedJniHookStub* stub = (DexposedJniHookStub*) calloc(1, sizeof(DexposedJniHookStub));
+    uint32_t* code = stub != NULL ? (uint32_t*) dexposedAllocateStub(codeSize) : NULL;
+    if (code == NULL) {
+        free(stub);
+        return NULL;
+    }
+    stub->hook = *hook;
+    memcpy(code, dexposedJniHookStubTemplate, codeSize);
+    code[DEXPOSED_JNI_HOOK_STUB_WORD] = (uintptr_t) stub;
+    code[DEXPOSED_JNI_HOOK_ENTER_WORD] = (uintptr_t) &dexposedJniHookEnter;
+    code[DEXPOSED_JNI_HOOK_EXIT_WORD] = (uintptr_t) &dexposedJniHookExit;
+    __builtin___clear_cache((char*) code, (char*) code + codeSize);
+    stub->code = code;
+    dexposedPerfMapAdd(code, codeSize, "jni-hook", name);
+
+    pthread_mutex_lock(&dexposedJniHooksLock);
+    stub->next = dexposedJniHooks;
+    dexposedJniHooks = stub;
+    pthread_mutex_unlock(&dexposedJniHooksLock);
+    return stub;
+#else
+    return NULL;
+#endif
+}
+
+// returns the hook whose code is function, or NULL if function is not the code of a hook
+static DexposedJniHookStub* dexposedJniHookFind(const void* function) {
+    pthread_mutex_lock(&dexposedJniHooksLock);
+    DexposedJniHookStub* stub = dexposedJniHooks;
+    while (stub != NULL && stub->code != function)
+        stub = stub->next;
+    pthread_mutex_unlock(&dexposedJniHooksLock);
+    return stub;
+}
+
+#endif  // DEXPOSED_JNI_HOOK_H_
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Result cache of memoized hooks.
+ *
+ * The key of a call is built from its raw argument slots, String arguments
+ * are replaced by their characters. The cache is set associative: a key
+ * hashes to one set of DEXPOSED_MEMO_WAYS entries, which is guarded by its
+ * own spin lock and evicts its least recently used entry. Invalidation
+ * bumps the generation of the cache, entries of older generations count as
+ * empty. Publishing a patch set flushes the caches of all hooks at once by
+ * bumping a global count which is part of every generation. A result is
+ * only stored if the generation did not change while it was computed.
+ *
+ * Primitive results are stored in the entry. Reference results are kept in
+ * slot i of the pins array for entry i and must be read and written with
+ * the lock of the set held, which only the runtime specific code can do.
+ *
+ * Handlers use the cache of a hook inside an epoch read section, a cache
+ * which is replaced is reclaimed like a patch set.
+ */
+
+#ifndef DEXPOSED_MEMO_H_
+#define DEXPOSED_MEMO_H_
+
+#include <jni.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dexposed_epoch.h"
+#include "dexposed_hook_control.h"
+
+#define DEXPOSED_MEMO_WAYS 4
+// calls with longer keys are not memoized
+#define DEXPOSED_MEMO_MAX_KEY_WORDS 64
+
+struct DexposedMemoKey {
+    uint32_t length;
+    bool overflow;
+    uint32_t words[DEXPOSED_MEMO_MAX_KEY_WORDS];
+};
+
+struct DexposedMemoEntry {
+    uint32_t hash;          // 0 while the entry is empty
+    uint32_t generation;
+    uint32_t storedAtMs;
+    uint32_t lastUsed;
+    uint32_t keyLength;
+    uint32_t* key;
+    uint64_t result;        // primitive results, references are in the pins
+};
+
+struct DexposedMemoCache {
+    uint32_t setMask;
+    uint32_t maxAgeMs;      // 0 keeps entries until they are evicted
+    bool referenceResult;
+    jobjectArray pins;      // global reference, NULL for primitive results
+
+    volatile uint32_t generation;
+    volatile uint32_t clock;
+
+    volatile uint32_t hits;
+    volatile uint32_t misses;
+    volatile uint32_t evictions;
+
+    volatile int32_t* locks;
+    DexposedMemoEntry* entries;
+};
+
+// bumped by dexposedMemoFlushAll(), added to the generation of every cache
+static volatile uint32_t dexposedMemoFlushCount = 0;
+
+static inline uint32_t dexposedMemoGeneration(const DexposedMemoCache* cache) {
+    return cache->generation + dexposedMemoFlushCount;
+}
+
+// drops the results cached for all hooks, e.g. when a patch set replaced their callbacks
+static inline void dexposedMemoFlushAll() {
+    __sync_add_and_fetch(&dexposedMemoFlushCount, 1);
+}
+
+static inline void dexposedMemoKeyInit(DexposedMemoKey* key) {
+    key->length = 0;
+    key->overflow = false;
+}
+
+static inline void dexposedMemoKeyAdd(DexposedMemoKey* key, uint32_t word) {
+    if (key->length < DEXPOSED_MEMO_MAX_KEY_WORDS)
+        key->words[key->length++] = word;
+    else
+        key->overflow = true;
+}
+
+// a null string is added as a single 0, other strings as their length + 1 followed by their characters
+static inline void dexposedMemoKeyAddChars(DexposedMemoKey* key, const uint16_t* chars, uint32_t length) {
+    dexposedMemoKeyAdd(key, length + 1);
+    for (uint32_t i = 0; i < length; i += 2) {
+        uint32_t high = i + 1 < length ? chars[i + 1] : 0;
+        dexposedMemoKeyAdd(key, chars[i] | (high << 16));
+    }
+}
+
+// FNV-1a, never 0
+static inline uint32_t dexposedMemoKeyHash(const DexposedMemoKey* key) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < key->length; i++) {
+        hash ^= key->words[i];
+        hash *= 16777619u;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+static inline uint32_t dexposedMemoSetOf(const DexposedMemoCache* cache, uint32_t hash) {
+    // the low bits select the set, mix in the high ones
+    return (hash ^ (hash >> 16)) & cache->setMask;
+}
+
+static inline void dexposedMemoLock(DexposedMemoCache* cache, uint32_t set) {
+    while (__sync_lock_test_and_set(&cache->locks[set], 1) != 0)
+        sched_yield();
+}
+
+static inline void dexposedMemoUnlock(DexposedMemoCache* cache, uint32_t set) {
+    __sync_lock_release(&cache->locks[set]);
+}
+
+static inline uint32_t dexposedMemoNowMs() {
+    return (uint32_t) (dexposedNanoTime() / 1000000);
+}
+
+static inline bool dexposedMemoEntryValid(const DexposedMemoCache* cache, const DexposedMemoEntry* entry,
+        uint32_t generation, uint32_t nowMs) {
+    return entry->hash != 0 && entry->generation == generation
+            && (cache->maxAgeMs == 0 || nowMs - entry->storedAtMs < cache->maxAgeMs);
+}
+
+// returns the entry for key, the lock of its set must be held. generation is
+// dexposedMemoGeneration() read before the lock was taken.
+static DexposedMemoEntry* dexposedMemoFindLocked(DexposedMemoCache* cache, uint32_t set,
+        const DexposedMemoKey* key, uint32_t hash, uint32_t generation) {
+    uint32_t nowMs = dexposedMemoNowMs();
+    DexposedMemoEntry* entries = &cache->entries[set * DEXPOSED_MEMO_WAYS];
+    for (uint32_t i = 0; i < DEXPOSED_MEMO_WAYS; i++) {
+        DexposedMemoEntry* entry = &entries[i];
+        if (entry->hash == hash && entry->keyLength == key->length
+                && dexposedMemoEntryValid(cache, entry, generation, nowMs)
+                && memcmp(entry->key, key->words, key->length * sizeof(uint32_t)) == 0) {
+            entry->lastUsed = ++cache->clock;
+            __sync_add_and_fetch(&cache->hits, 1);
+            return entry;
+        }
+    }
+    __sync_add_and_fetch(&cache->misses, 1);
+    return NULL;
+}
+
+// takes the entry key is stored in, the lock of its set must be held. keyCopy becomes owned by
+// the entry, the previous key of the entry is returned to be freed after unlocking. generation
+// is the one the call missed in, if the cache was invalidated since the result may be stale:
+// nothing is claimed, NULL is returned and keyCopy is returned to be freed.
+static DexposedMemoEntry* dexposedMemoClaimLocked(DexposedMemoCache* cache, uint32_t set,
+        const DexposedMemoKey* key, uint32_t hash, uint32_t generation, uint32_t* keyCopy, uint32_t** oldKey) {
+    if (dexposedMemoGeneration(cache) != generation) {
+        *oldKey = keyCopy;
+        return NULL;
+    }
+    uint32_t nowMs = dexposedMemoNowMs();
+    DexposedMemoEntry* entries = &cache->entries[set * DEXPOSED_MEMO_WAYS];
+    DexposedMemoEntry* victim = NULL;
+    for (uint32_t i = 0; i < DEXPOSED_MEMO_WAYS; i++) {
+        DexposedMemoEntry* entry = &entries[i];
+        if (!dexposedMemoEntryValid(cache, entry, generation, nowMs)) {
+            victim = entry;
+            break;
+        }
+        if (victim == NULL || (int32_t) (entry->lastUsed - victim->lastUsed) < 0)
+            victim = entry;
+    }
+    if (dexposedMemoEntryValid(cache, victim, generation, nowMs))
+        __sync_add_and_fetch(&cache->evictions, 1);
+
+    *oldKey = victim->key;
+    victim->hash = hash;
+    victim->generation = generation;
+    victim->storedAtMs = nowMs;
+    victim->lastUsed = ++cache->clock;
+    victim->keyLength = key->length;
+    victim->key = keyCopy;
+    return victim;
+}
+
+static inline uint32_t* dexposedMemoCopyKey(const DexposedMemoKey* key) {
+    // the key of a call without arguments is empty, malloc(0) may return NULL
+    uint32_t* copy = (uint32_t*) malloc((key->length != 0 ? key->length : 1) * sizeof(uint32_t));
+    if (copy != NULL)
+        memcpy(copy, key->words, key->length * sizeof(uint32_t));
+    return copy;
+}
+
+static inline uint32_t dexposedMemoIndexOf(const DexposedMemoCache* cache, const DexposedMemoEntry* entry) {
+    return entry - cache->entries;
+}
+
+// capacity is rounded up to a power of two, at least one set
+static DexposedMemoCache* dexposedMemoCreate(JNIEnv* env, uint32_t capacity, uint32_t maxAgeMs,
+        bool referenceResult) {
+    uint32_t sets = 1;
+    while (sets * DEXPOSED_MEMO_WAYS < capacity && sets < (1u << 20))
+        sets <<= 1;
+
+    DexposedMemoCache* cache = (DexposedMemoCache*) calloc(1, sizeof(DexposedMemoCache));
+    if (cache == NULL)
+        return NULL;
+    cache->setMask = sets - 1;
+    cache->maxAgeMs = maxAgeMs;
+    cache->referenceResult = referenceResult;
+    cache->locks = (volatile int32_t*) calloc(sets, sizeof(int32_t));
+    cache->entries = (DexposedMemoEntry*) calloc(sets * DEXPOSED_MEMO_WAYS, sizeof(DexposedMemoEntry));
+    if (cache->locks == NULL || cache->entries == NULL) {
+        free((void*) cache->locks);
+        free(cache->entries);
+        free(cache);
+        return NULL;
+    }
+
+    if (referenceResult) {
+        jclass objectClass = env->FindClass("java/lang/Object");
+        jobjectArray pins = objectClass != NULL
+                ? env->NewObjectArray(sets * DEXPOSED_MEMO_WAYS, objectClass, NULL) : NULL;
+        if (pins == NULL) {
+            env->ExceptionClear();
+            free((void*) cache->locks);
+            free(cache->entries);
+            free(cache);
+            return NULL;
+        }
+        cache->pins = (jobjectArray) env->NewGlobalRef(pins);
+        env->DeleteLocalRef(pins);
+        env->DeleteLocalRef(objectClass);
+    }
+    return cache;
+}
+
+// context is the JNIEnv* of the reclaiming thread
+static void dexposedMemoFree(void* data, void* context) {
+    DexposedMemoCache* cache = (DexposedMemoCache*) data;
+    JNIEnv* env = (JNIEnv*) context;
+    uint32_t count = (cache->setMask + 1) * DEXPOSED_MEMO_WAYS;
+    for (uint32_t i = 0; i < count; i++)
+        free(cache->entries[i].key);
+    if (cache->pins != NULL)
+        env->DeleteGlobalRef(cache->pins);
+    free((void*) cache->locks);
+    free(cache->entries);
+    free(cache);
+}
+
+// makes cache (NULL to disable memoization) the cache of the hook, the previous one is
+// reclaimed once no handler can use it anymore
+static void dexposedMemoInstall(JNIEnv* env, DexposedHookControl* control, DexposedMemoCache* cache) {
+    __sync_synchronize();
+    DexposedMemoCache* previous = __sync_lock_test_and_set(&control->memoCache, cache);
+    if (previous != NULL)
+        dexposedEpochRetire(previous, dexposedMemoFree);
+    dexposedEpochReclaim(env);
+}
+
+// drops all results cached for the hook, returns false if it is not memoized
+static bool dexposedMemoInvalidate(DexposedHookControl* control) {
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state == NULL)
+        return false;
+    dexposedEpochEnter(state);
+    DexposedMemoCache* cache = control->memoCache;
+    if (cache != NULL)
+        __sync_add_and_fetch(&cache->generation, 1);
+    dexposedEpochExit(state);
+    return cache != NULL;
+}
+
+// returns { hits, misses, evictions }, or NULL if the hook is not memoized
+static jintArray dexposedMemoStats(JNIEnv* env, DexposedHookControl* control) {
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state == NULL)
+        return NULL;
+    jint stats[3];
+    dexposedEpochEnter(state);
+    DexposedMemoCache* cache = control->memoCache;
+    if (cache != NULL) {
+        stats[0] = cache->hits;
+        stats[1] = cache->misses;
+        stats[2] = cache->evictions;
+    }
+    dexposedEpochExit(state);
+    if (cache == NULL)
+        return NULL;
+
+    jintArray result = env->NewIntArray(3);
+    if (result != NULL)
+        env->SetIntArrayRegion(result, 0, 3, stats);
+    return result;
+}
+
+#endif  // DEXPOSED_MEMO_H_
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Accounting and reclamation of the native data of hooks.
+ *
+ * Every hook accounts the bytes it allocated (hook info, backups, copies)
+ * and the global references it holds, per hook and in total.
+ *
+ * A removed hook is freed in two steps. A handler reads the hook info
+ * inside an epoch read section and marks itself as an active call of the
+ * hook before it leaves the section, see dexposed_epoch.h. Once the
+ * method is restored the hook is retired, after the epoch it is moved to
+ * the draining list, and it is freed as soon as its last active call
+ * returned. The runtime passes the function freeing its hook info.
+ */
+
+#ifndef DEXPOSED_MEMORY_H_
+#define DEXPOSED_MEMORY_H_
+
+#include <jni.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "dexposed_epoch.h"
+#include "dexposed_hook_control.h"
+
+typedef void (*DexposedHookFreeFunction)(DexposedHookControl* control, JNIEnv* env);
+
+// totals of all hooks which were not freed yet, removed ones included
+static volatile uint32_t dexposedMemoryHooks = 0;
+static volatile uint32_t dexposedMemoryBytes = 0;
+static volatile uint32_t dexposedMemoryGlobalRefs = 0;
+
+static pthread_mutex_t dexposedDrainingLock = PTHREAD_MUTEX_INITIALIZER;
+// removed hooks past their epoch, guarded by dexposedDrainingLock
+static DexposedHookControl* dexposedDraining = NULL;
+static volatile uint32_t dexposedRemovedHooks = 0;
+
+// must be called once when a hook is installed
+static inline void dexposedMemoryAccount(DexposedHookControl* control, uint32_t bytes, uint32_t globalRefs) {
+    control->nativeBytes = bytes;
+    control->globalRefs = globalRefs;
+    __sync_add_and_fetch(&dexposedMemoryHooks, 1);
+    __sync_add_and_fetch(&dexposedMemoryBytes, bytes);
+    __sync_add_and_fetch(&dexposedMemoryGlobalRefs, globalRefs);
+}
+
+static inline void dexposedHookCallBegin(DexposedHookControl* control) {
+    __sync_add_and_fetch(&control->activeCalls, 1);
+}
+
+static inline void dexposedHookCallEnd(DexposedHookControl* control) {
+    __sync_sub_and_fetch(&control->activeCalls, 1);
+}
+
+// ends the active call a JNI method took on a hook it looked up to change or read it, when
+// the method returns. The hook is not freed while it is held, see dexposedHookCollect().
+struct DexposedHookCallScope {
+    DexposedHookControl* const control;
+
+    explicit DexposedHookCallScope(DexposedHookControl* control) : control(control) {}
+    ~DexposedHookCallScope() { dexposedHookCallEnd(control); }
+};
+
+static void dexposedHookRetired(void* data, void* context) {
+    DexposedHookControl* control = (DexposedHookControl*) data;
+    pthread_mutex_lock(&dexposedDrainingLock);
+    control->nextRemoved = dexposedDraining;
+    dexposedDraining = control;
+    pthread_mutex_unlock(&dexposedDrainingLock);
+}
+
+// frees the removed hooks without active calls, returns the number of removed hooks still waiting
+static uint32_t dexposedHookCollect(JNIEnv* env, DexposedHookFreeFunction freeHook) {
+    dexposedEpochReclaim(env);
+
+    pthread_mutex_lock(&dexposedDrainingLock);
+    DexposedHookControl** link = &dexposedDraining;
+    while (*link != NULL) {
+        DexposedHookControl* control = *link;
+        if (control->activeCalls != 0) {
+            link = &control->nextRemoved;
+            continue;
+        }
+        *link = control->nextRemoved;
+        __sync_sub_and_fetch(&dexposedMemoryHooks, 1);
+        __sync_sub_and_fetch(&dexposedMemoryBytes, control->nativeBytes);
+        __sync_sub_and_fetch(&dexposedMemoryGlobalRefs, control->globalRefs);
+        __sync_sub_and_fetch(&dexposedRemovedHooks, 1);
+        freeHook(control, env);
+    }
+    pthread_mutex_unlock(&dexposedDrainingLock);
+    return dexposedRemovedHooks;
+}
+
+// queues a hook whose method was restored for freeing, returns the number of removed hooks still waiting
+static uint32_t dexposedHookRemoved(JNIEnv* env, DexposedHookControl* control, DexposedHookFreeFunction freeHook) {
+    __sync_add_and_fetch(&dexposedRemovedHooks, 1);
+    if (!dexposedEpochRetire(control, dexposedHookRetired)) {
+        // it stays allocated and accounted
+        __sync_sub_and_fetch(&dexposedRemovedHooks, 1);
+    }
+    return dexposedHookCollect(env, freeHook);
+}
+
+// returns {native bytes, global references} of a hook
+static jintArray dexposedHookMemoryUsage(JNIEnv* env, const DexposedHookControl* control) {
+    jint usage[2] = { (jint) control->nativeBytes, (jint) control->globalRefs };
+    jintArray result = env->NewIntArray(2);
+    if (result != NULL)
+        env->SetIntArrayRegion(result, 0, 2, usage);
+    return result;
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native int[] getMemoryUsageNative()
+ *
+ * Returns {hooks, native bytes, global references, removed hooks not freed yet}.
+ */
+static jintArray com_taobao_android_dexposed_DexposedBridge_getMemoryUsageNative(JNIEnv* env, jclass clazz) {
+    jint usage[4] = { (jint) dexposedMemoryHooks, (jint) dexposedMemoryBytes, (jint) dexposedMemoryGlobalRefs,
+            (jint) dexposedRemovedHooks };
+    jintArray result = env->NewIntArray(4);
+    if (result != NULL)
+        env->SetIntArrayRegion(result, 0, 4, usage);
+    return result;
+}
+
+#endif  // DEXPOSED_MEMORY_H_
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Data of patched methods, keyed by the address of the method.
+ *
+ * A handler needs data of its method (hook info, coverage counter,
+ * constant). Kept in a field of the method which its old code reads as
+ * well, a caller which still runs the old code could read the data as
+ * bytecode or as a JNI function, so the runtime keeps it here instead.
+ *
+ * The table uses open addressing with linear probing. It is only written
+ * between dexposedBeginPublish() and dexposedEndPublish(), handlers look a
+ * method up without a lock inside the read loop of the seqlock, see
+ * dexposed_publish.h. A removed method keeps its key with NULL data. A table
+ * which is 3/4 full is copied into one twice the size, the old one is never
+ * freed since a handler may still be probing it.
+ */
+
+#ifndef DEXPOSED_METHOD_TABLE_H_
+#define DEXPOSED_METHOD_TABLE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define DEXPOSED_METHOD_TABLE_MIN_SIZE 256
+
+struct DexposedMethodTableEntry {
+    const void* volatile key;
+    void* volatile data;
+};
+
+struct DexposedMethodTable {
+    uint32_t mask;
+    uint32_t used;      // keys, removed ones included
+    DexposedMethodTableEntry entries[1];
+};
+
+static DexposedMethodTable* volatile dexposedMethodTable = NULL;
+
+static inline uint32_t dexposedMethodTableHash(const void* method) {
+    // methods are at least word aligned, mix the higher bits into the low ones
+    uint32_t hash = (uint32_t) (uintptr_t) method;
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bu;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static DexposedMethodTableEntry* dexposedMethodTableProbe(DexposedMethodTable* table, const void* method) {
+    uint32_t i = dexposedMethodTableHash(method) & table->mask;
+    while (table->entries[i].key != method && table->entries[i].key != NULL)
+        i = (i + 1) & table->mask;
+    return &table->entries[i];
+}
+
+// returns the data of method or NULL, must be read inside the read loop of the seqlock
+static inline void* dexposedMethodTableGet(const void* method) {
+    DexposedMethodTable* table = dexposedMethodTable;
+    if (table == NULL)
+        return NULL;
+    DexposedMethodTableEntry* entry = dexposedMethodTableProbe(table, method);
+    return entry->key == method ? entry->data : NULL;
+}
+
+static DexposedMethodTable* dexposedMethodTableCreate(uint32_t size) {
+    DexposedMethodTable* table = (DexposedMethodTable*) calloc(1,
+            sizeof(DexposedMethodTable) + (size - 1) * sizeof(DexposedMethodTableEntry));
+    if (table != NULL)
+        table->mask = size - 1;
+    return table;
+}
+
+/*
+ * Sets the data of method, NULL removes it. Must be called between
+ * dexposedBeginPublish() and dexposedEndPublish(), before the method is
+ * switched to its handler. Returns false if the table could not grow, the
+ * method must not be patched then.
+ */
+static bool dexposedMethodTablePut(const void* method, void* data) {
+    DexposedMethodTable* table = dexposedMethodTable;
+    if (table != NULL) {
+        DexposedMethodTableEntry* entry = dexposedMethodTableProbe(table, method);
+        if (entry->key == method) {
+            entry->data = data;
+            return true;
+        }
+    }
+    if (data == NULL)
+        return true;
+
+    uint32_t size = table != NULL ? table->mask + 1 : 0;
+    if (table == NULL || (table->used + 1) * 4 > size * 3) {
+        uint32_t live = 0;
+        for (uint32_t i = 0; i < size; i++)
+            if (table->entries[i].data != NULL)
+                live++;
+        uint32_t newSize = DEXPOSED_METHOD_TABLE_MIN_SIZE;
+        while ((live + 1) * 2 > newSize)
+            newSize <<= 1;
+        DexposedMethodTable* grown = dexposedMethodTableCreate(newSize);
+        if (grown == NULL)
+            return false;
+        for (uint32_t i = 0; i < size; i++) {
+            if (table->entries[i].data == NULL)
+                continue;
+            DexposedMethodTableEntry* entry = dexposedMethodTableProbe(grown, table->entries[i].key);
+            entry->key = table->entries[i].key;
+            entry->data = table->entries[i].data;
+            grown->used++;
+        }
+        __sync_synchronize();
+        dexposedMethodTable = grown;
+        table = grown;
+    }
+
+    DexposedMethodTableEntry* entry = dexposedMethodTableProbe(table, method);
+    entry->data = data;
+    __sync_synchronize();
+    entry->key = method;
+    table->used++;
+    return true;
+}
+
+#endif  // DEXPOSED_METHOD_TABLE_H_
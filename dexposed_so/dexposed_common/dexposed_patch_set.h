@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Patch sets replace the callbacks of several hooked methods at once.
+ *
+ * A patch set maps hook ids to the AdditionalHookInfo the calls of that
+ * hook are dispatched with. The current set is swapped with a single
+ * pointer store, so a thread either sees all callbacks of the old set or
+ * all of the new one. Handlers look the set up inside an epoch read
+ * section and the old set is reclaimed once they all left it.
+ */
+
+#ifndef DEXPOSED_PATCH_SET_H_
+#define DEXPOSED_PATCH_SET_H_
+
+#include <jni.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dexposed_epoch.h"
+#include "dexposed_hook_control.h"
+
+struct DexposedPatchSet {
+    uint32_t version;
+    // additionalInfos is indexed by hook id, hooks past the end are not patched
+    uint32_t capacity;
+    // global references, NULL for hooks which are not patched
+    jobject additionalInfos[1];
+};
+
+static DexposedPatchSet* volatile dexposedPatchSet = NULL;
+
+// guards publishing, readers do not take it
+static pthread_mutex_t dexposedPatchSetLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t dexposedPatchSetVersion = 0;
+
+// must be called inside a read section, the result is only valid until it is left
+static inline jobject dexposedPatchSetLookup(uint32_t hookId) {
+    const DexposedPatchSet* patchSet = dexposedPatchSet;
+    if (patchSet == NULL || hookId >= patchSet->capacity)
+        return NULL;
+    return patchSet->additionalInfos[hookId];
+}
+
+// with room for all hooks installed so far
+static DexposedPatchSet* dexposedPatchSetCreate() {
+    uint32_t capacity = dexposedLastHookId + 1;
+    DexposedPatchSet* patchSet = (DexposedPatchSet*) calloc(1,
+            sizeof(DexposedPatchSet) + (capacity - 1) * sizeof(jobject));
+    if (patchSet != NULL)
+        patchSet->capacity = capacity;
+    return patchSet;
+}
+
+// context is the JNIEnv* of the reclaiming thread
+static void dexposedPatchSetFree(void* data, void* context) {
+    DexposedPatchSet* patchSet = (DexposedPatchSet*) data;
+    JNIEnv* env = (JNIEnv*) context;
+    for (uint32_t i = 0; i < patchSet->capacity; i++) {
+        if (patchSet->additionalInfos[i] != NULL)
+            env->DeleteGlobalRef(patchSet->additionalInfos[i]);
+    }
+    free(patchSet);
+}
+
+// makes patchSet (which may be NULL) the current set, returns its version
+static uint32_t dexposedPatchSetPublish(JNIEnv* env, DexposedPatchSet* patchSet) {
+    pthread_mutex_lock(&dexposedPatchSetLock);
+    uint32_t version = ++dexposedPatchSetVersion;
+    if (patchSet != NULL)
+        patchSet->version = version;
+    __sync_synchronize();
+    DexposedPatchSet* previous = dexposedPatchSet;
+    dexposedPatchSet = patchSet;
+    pthread_mutex_unlock(&dexposedPatchSetLock);
+
+    // if it cannot be retired the previous set is leaked, freeing it now is not safe
+    if (previous != NULL)
+        dexposedEpochRetire(previous, dexposedPatchSetFree);
+    dexposedEpochReclaim(env);
+    return version;
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native int reclaimPatchSetsNative()
+ */
+static jint com_taobao_android_dexposed_DexposedBridge_reclaimPatchSetsNative(JNIEnv* env, jclass clazz) {
+    return dexposedEpochReclaim(env);
+}
+
+#endif  // DEXPOSED_PATCH_SET_H_
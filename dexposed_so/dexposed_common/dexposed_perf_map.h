@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Perf map of the code dexposed generates.
+ *
+ * Stubs are written into anonymous executable memory, which profilers
+ * cannot symbolize. When the perf map is started every stub created
+ * afterwards gets a line "<start> <size> <name>" (hex start and size) in
+ * it, the format perf and simpleperf read from /tmp/perf-<pid>.map.
+ *
+ * Every hook installed afterwards gets a line as well, naming the hooked
+ * method at the handler its calls enter. All hooks share that handler in
+ * libdexposed.so, so the line covers its first byte only and samples in
+ * the handler keep the symbols of the library. No jitdump is written.
+ *
+ * Lines are flushed one by one so the file is complete while the app
+ * runs.
+ */
+
+#ifndef DEXPOSED_PERF_MAP_H_
+#define DEXPOSED_PERF_MAP_H_
+
+#include <jni.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+static pthread_mutex_t dexposedPerfMapLock = PTHREAD_MUTEX_INITIALIZER;
+// guarded by dexposedPerfMapLock, set once
+static FILE* dexposedPerfMap = NULL;
+
+// creates the perf map at path, it can only be started once
+static bool dexposedPerfMapStart(const char* path) {
+    pthread_mutex_lock(&dexposedPerfMapLock);
+    bool started = false;
+    if (dexposedPerfMap == NULL) {
+        dexposedPerfMap = fopen(path, "w");
+        started = dexposedPerfMap != NULL;
+    }
+    pthread_mutex_unlock(&dexposedPerfMapLock);
+    return started;
+}
+
+// true once the perf map is started, names need not be built before
+static inline bool dexposedPerfMapStarted() {
+    return dexposedPerfMap != NULL;
+}
+
+// names the code at [start, start + size), does nothing while the perf map is not started
+static void dexposedPerfMapAdd(const void* start, size_t size, const char* kind, const char* name) {
+    pthread_mutex_lock(&dexposedPerfMapLock);
+    if (dexposedPerfMap != NULL) {
+        fprintf(dexposedPerfMap, "%" PRIxPTR " %zx dexposed %s %s\n", (uintptr_t) start, size, kind, name);
+        fflush(dexposedPerfMap);
+    }
+    pthread_mutex_unlock(&dexposedPerfMapLock);
+}
+
+// names a hook of the method name, whose calls enter handler
+static void dexposedPerfMapAddHook(const void* handler, const char* name) {
+    // the address of a Thumb function has its lowest bit set
+    dexposedPerfMapAdd((const void*) ((uintptr_t) handler & ~(uintptr_t) 1), 1, "hook", name);
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native boolean startPerfMapNative(String path)
+ */
+static jboolean com_taobao_android_dexposed_DexposedBridge_startPerfMapNative(JNIEnv* env, jclass clazz,
+            jstring path) {
+    const char* pathChars = env->GetStringUTFChars(path, NULL);
+    if (pathChars == NULL)
+        return false;
+    bool started = dexposedPerfMapStart(pathChars);
+    env->ReleaseStringUTFChars(path, pathChars);
+    return started;
+}
+
+#endif  // DEXPOSED_PERF_MAP_H_
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Publication of hooks while other threads keep calling the method.
+ *
+ * A runtime patches a method with a few plain stores, one of which makes
+ * callers enter the handler (the quick entry point on ART, the native
+ * flag or nativeFunc on Dalvik). Everything a caller of the old code still
+ * reads is left alone until that store, everything the handler reads is
+ * written before it, with a barrier in between. Removing a hook runs the
+ * same way backwards.
+ *
+ * The one thing which cannot always be written on the right side of the
+ * switch is the pointer to the hook info, when it lives in a field the
+ * old code uses as well (the JNI entry point of a native method on ART;
+ * Dalvik keeps it in the method table of dexposed_method_table.h), and the
+ * handler must not pair the switch it entered through with the pointer of
+ * a later hook either. So all stores to a method are made between
+ * dexposedBeginPublish() and dexposedEndPublish(), which form the writing
+ * side of a seqlock, and the handlers read whether the method is hooked
+ * and its hook info pointer as one snapshot:
+ *
+ *   do {
+ *       sequence = dexposedPublishReadBegin();
+ *       hookInfo = hooked(method) ? pointer(method) : NULL;
+ *   } while (dexposedPublishReadRetry(sequence));
+ *
+ * Publications are serialized and only take a few stores, nothing between
+ * begin and end may suspend the thread. The VM is never suspended.
+ */
+
+#ifndef DEXPOSED_PUBLISH_H_
+#define DEXPOSED_PUBLISH_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+static pthread_mutex_t dexposedPublishLock = PTHREAD_MUTEX_INITIALIZER;
+
+// odd while a method is being patched
+static volatile uint32_t dexposedPublishSequence = 0;
+
+// starts patching a method, the caller checks whether it is hooked again after this
+static inline void dexposedBeginPublish() {
+    pthread_mutex_lock(&dexposedPublishLock);
+    // a full barrier, readers see the odd sequence before any store to the method
+    __sync_add_and_fetch(&dexposedPublishSequence, 1);
+}
+
+static inline void dexposedEndPublish() {
+    __sync_add_and_fetch(&dexposedPublishSequence, 1);
+    pthread_mutex_unlock(&dexposedPublishLock);
+}
+
+static inline uint32_t dexposedPublishReadBegin() {
+    uint32_t sequence;
+    while (__builtin_expect((sequence = dexposedPublishSequence) & 1, 0))
+        sched_yield();
+    __sync_synchronize();
+    return sequence;
+}
+
+// true if a method was patched while reading, the reads must be made again
+static inline bool dexposedPublishReadRetry(uint32_t sequence) {
+    __sync_synchronize();
+    return dexposedPublishSequence != sequence;
+}
+
+#endif  // DEXPOSED_PUBLISH_H_
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Sampled call stacks of hooked methods.
+ *
+ * A sampled call walks the managed stack from the frame of the hooked
+ * method into the stack buffer of its thread, innermost frame first. A
+ * frame is the raw method pointer and a pc whose meaning is up to the
+ * runtime, nothing is looked up while the call is running.
+ *
+ * The stacks are stored in one trie shared by all hooks, whose roots are
+ * the outermost frames, so a stack which was seen before only increments
+ * the sample count of its last node. The nodes live in an open addressed
+ * table keyed by their parent and frame and are claimed like the entries
+ * of a caller profile, see dexposed_callers.h. The trie is created once
+ * and never freed, it stops growing when it is full.
+ *
+ * Frames are turned into names when the trie is dumped, as folded stacks
+ * (outermost;...;innermost count) which flame graph tools read.
+ */
+
+#ifndef DEXPOSED_STACKS_H_
+#define DEXPOSED_STACKS_H_
+
+#include <jni.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dexposed_hook_control.h"
+#include "dexposed_thread.h"
+
+#define DEXPOSED_STACK_MAX_DEPTH 64
+#define DEXPOSED_STACK_MAX_PROBES 16
+#define DEXPOSED_STACK_MAX_NAME 256
+
+struct DexposedStackFrame {
+    const void* method;
+    uintptr_t pc;
+};
+
+struct DexposedStackNode {
+    volatile uint32_t tag;      // hash of the parent and the frame, 0 while the node is free
+    volatile uint32_t ready;    // set once parent and frame are written
+    volatile uint32_t samples;  // sampled stacks which end here
+    uint32_t parent;            // index of the parent + 1, 0 for the outermost frames
+    DexposedStackFrame frame;
+};
+
+struct DexposedStackTrie {
+    uint32_t mask;
+    volatile uint32_t nodeCount;
+    volatile uint32_t samples;
+    volatile uint32_t dropped;  // stacks which did not fit into the trie
+    DexposedStackNode* nodes;
+};
+
+// set once, the trie is never freed since handlers may be sampling at any time
+static DexposedStackTrie* volatile dexposedStacks = NULL;
+
+// never 0
+static inline uint32_t dexposedStackHash(uint32_t parent, const DexposedStackFrame* frame) {
+    uint64_t key = (uint64_t) (uintptr_t) frame->method ^ ((uint64_t) frame->pc * 0x9e3779b97f4a7c15ULL)
+            ^ ((uint64_t) parent << 40);
+    uint32_t hash = (uint32_t) (key ^ (key >> 32));
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash != 0 ? hash : 1;
+}
+
+// returns the index of the child of parent for frame, claiming a node if there is none yet, or -1
+static int32_t dexposedStackChild(DexposedStackTrie* trie, uint32_t parent, const DexposedStackFrame* frame) {
+    const uint32_t tag = dexposedStackHash(parent, frame);
+    uint32_t index = tag & trie->mask;
+    for (uint32_t probe = 0; probe < DEXPOSED_STACK_MAX_PROBES; probe++, index = (index + 1) & trie->mask) {
+        DexposedStackNode* node = &trie->nodes[index];
+        uint32_t current = node->tag;
+        if (current == 0) {
+            if (__sync_bool_compare_and_swap(&node->tag, 0, tag)) {
+                node->parent = parent;
+                node->frame = *frame;
+                __sync_synchronize();
+                node->ready = 1;
+                __sync_add_and_fetch(&trie->nodeCount, 1);
+                return index;
+            }
+            current = node->tag;
+        }
+        if (current != tag)
+            continue;
+        if (!node->ready) {
+            // claimed by another thread which did not write the frame yet, maybe this one
+            return -1;
+        }
+        __sync_synchronize();
+        if (node->parent == parent && node->frame.method == frame->method && node->frame.pc == frame->pc)
+            return index;
+    }
+    return -1;
+}
+
+// adds a stack captured innermost frame first
+static void dexposedStackRecord(const DexposedStackFrame* frames, uint32_t depth) {
+    DexposedStackTrie* trie = dexposedStacks;
+    if (trie == NULL || depth == 0)
+        return;
+
+    uint32_t parent = 0;
+    for (uint32_t i = depth; i-- > 0;) {
+        int32_t index = dexposedStackChild(trie, parent, &frames[i]);
+        if (index < 0) {
+            __sync_add_and_fetch(&trie->dropped, 1);
+            return;
+        }
+        parent = index + 1;
+    }
+    __sync_add_and_fetch(&trie->nodes[parent - 1].samples, 1);
+    __sync_add_and_fetch(&trie->samples, 1);
+}
+
+// returns the buffer to capture the stack of a call into, DEXPOSED_STACK_MAX_DEPTH frames, or
+// NULL if the call is not sampled
+static inline DexposedStackFrame* dexposedStackSample(const DexposedHookControl* control, DexposedThreadState* state) {
+    uint32_t rate = control->stackSamplingRate;
+    if (rate == 0 || state == NULL || dexposedStacks == NULL)
+        return NULL;
+    if (rate > 1 && dexposedNextRandom(state) % rate != 0)
+        return NULL;
+    if (state->stackBuffer == NULL)
+        state->stackBuffer = (DexposedStackFrame*) malloc(DEXPOSED_STACK_MAX_DEPTH * sizeof(DexposedStackFrame));
+    return state->stackBuffer;
+}
+
+// creates the trie with room for capacity frames, it can only be created once
+static bool dexposedStacksStart(uint32_t capacity) {
+    if (dexposedStacks != NULL || capacity == 0 || capacity > (1u << 22))
+        return false;
+    uint32_t size = DEXPOSED_STACK_MAX_PROBES;
+    while (size < capacity)
+        size <<= 1;
+
+    DexposedStackTrie* trie = (DexposedStackTrie*) calloc(1, sizeof(DexposedStackTrie));
+    if (trie == NULL)
+        return false;
+    trie->mask = size - 1;
+    trie->nodes = (DexposedStackNode*) calloc(size, sizeof(DexposedStackNode));
+    if (trie->nodes == NULL || !__sync_bool_compare_and_swap(&dexposedStacks, NULL, trie)) {
+        free(trie->nodes);
+        free(trie);
+        return false;
+    }
+    return true;
+}
+
+// writes the name of a frame into name, context is the one passed to dexposedStacksDump()
+typedef void (*DexposedStackDescribeFunction)(void* context, const DexposedStackFrame* frame,
+        char* name, size_t size);
+
+// writes every sampled stack as a line of folded frames to path, returns the number of stacks
+// or -1. Stacks sampled while dumping may be missing.
+static int32_t dexposedStacksDump(const char* path, DexposedStackDescribeFunction describe, void* context) {
+    DexposedStackTrie* trie = dexposedStacks;
+    if (trie == NULL)
+        return -1;
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+        return -1;
+
+    int32_t stacks = 0;
+    char name[DEXPOSED_STACK_MAX_NAME];
+    uint32_t nodes[DEXPOSED_STACK_MAX_DEPTH];
+    for (uint32_t i = 0; i <= trie->mask; i++) {
+        const DexposedStackNode* leaf = &trie->nodes[i];
+        uint32_t samples = leaf->samples;
+        if (samples == 0)
+            continue;
+
+        uint32_t depth = 0;
+        for (uint32_t node = i + 1; node != 0 && depth < DEXPOSED_STACK_MAX_DEPTH; node = trie->nodes[node - 1].parent)
+            nodes[depth++] = node - 1;
+        while (depth-- > 0) {
+            describe(context, &trie->nodes[nodes[depth]].frame, name, sizeof(name));
+            fputs(name, out);
+            fputc(depth != 0 ? ';' : ' ', out);
+        }
+        fprintf(out, "%u\n", samples);
+        stacks++;
+    }
+    bool failed = ferror(out) != 0;
+    if (fclose(out) != 0 || failed)
+        return -1;
+    return stacks;
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native boolean startStackSamplingNative(int capacity)
+ */
+static jboolean com_taobao_android_dexposed_DexposedBridge_startStackSamplingNative(JNIEnv* env, jclass clazz,
+            jint capacity) {
+    return dexposedStacksStart(capacity);
+}
+
+/*
+ * private static native int[] getStackSamplingStatsNative()
+ *
+ * Returns {samples, dropped samples, nodes}, or null before sampling was started.
+ */
+static jintArray com_taobao_android_dexposed_DexposedBridge_getStackSamplingStatsNative(JNIEnv* env, jclass clazz) {
+    DexposedStackTrie* trie = dexposedStacks;
+    if (trie == NULL)
+        return NULL;
+
+    jint stats[3] = { (jint) trie->samples, (jint) trie->dropped, (jint) trie->nodeCount };
+    jintArray result = env->NewIntArray(3);
+    if (result != NULL)
+        env->SetIntArrayRegion(result, 0, 3, stats);
+    return result;
+}
+
+#endif  // DEXPOSED_STACKS_H_
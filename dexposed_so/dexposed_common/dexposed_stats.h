@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Writing side of the stats file, the layout and the seqlock protocol are
+ * described in dexposed_stats_format.h.
+ */
+
+#ifndef DEXPOSED_STATS_H_
+#define DEXPOSED_STATS_H_
+
+#include <jni.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dexposed_hook_control.h"
+#include "dexposed_stats_format.h"
+
+struct DexposedStatsFile {
+    DexposedStatsHeader* header;
+    DexposedStatsSlot* slots;
+    size_t size;
+};
+
+// set once, the mapping is never removed since handlers may be writing to it at any time
+static DexposedStatsFile* volatile dexposedStatsFile = NULL;
+
+static inline uint32_t dexposedStatsBucket(uint64_t durationNs) {
+    uint32_t bucket = 0;
+    durationNs >>= DEXPOSED_STATS_FIRST_BUCKET_SHIFT;
+    while (durationNs != 0 && bucket < DEXPOSED_STATS_BUCKETS - 1) {
+        durationNs >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// adds one call to the slot of a hook
+static inline void dexposedStatsRecord(DexposedStatsSlot* slot, uint64_t durationNs, bool exception) {
+    uint32_t sequence;
+    for (;;) {
+        sequence = slot->sequence;
+        if ((sequence & 1) == 0 && __sync_bool_compare_and_swap(&slot->sequence, sequence, sequence + 1))
+            break;
+        sched_yield();
+    }
+
+    slot->calls++;
+    if (exception)
+        slot->exceptions++;
+    slot->totalNs += durationNs;
+    uint32_t durationNs32 = durationNs > 0xffffffffULL ? 0xffffffffu : (uint32_t) durationNs;
+    if (durationNs32 > slot->maxNs)
+        slot->maxNs = durationNs32;
+    slot->histogram[dexposedStatsBucket(durationNs)]++;
+
+    // a full barrier, the updates are visible before the sequence is even again
+    __sync_add_and_fetch(&slot->sequence, 1);
+}
+
+// returns the slot of a hook, which is added unless it is there already, or NULL if the file
+// is not open or full
+static DexposedStatsSlot* dexposedStatsAddHook(uint32_t hookId, const char* name) {
+    DexposedStatsFile* file = dexposedStatsFile;
+    if (file == NULL)
+        return NULL;
+
+    DexposedStatsHeader* header = file->header;
+    uint32_t count = header->slotCount;
+    for (uint32_t i = 0; i < count && i < header->slotCapacity; i++) {
+        if (file->slots[i].hookId == hookId)
+            return &file->slots[i];
+    }
+
+    uint32_t index = __sync_fetch_and_add(&header->slotCount, 1);
+    if (index >= header->slotCapacity)
+        return NULL;
+
+    DexposedStatsSlot* slot = &file->slots[index];
+    strncpy(slot->name, name, sizeof(slot->name) - 1);
+    __sync_synchronize();
+    slot->hookId = hookId;
+    return slot;
+}
+
+// creates the file at path with room for capacity hooks
+static bool dexposedStatsOpen(const char* path, uint32_t capacity) {
+    if (dexposedStatsFile != NULL || capacity == 0 || capacity > (1u << 16))
+        return false;
+
+    size_t slotsOffset = DEXPOSED_STATS_HEADER_SIZE;
+    size_t size = slotsOffset + (size_t) capacity * sizeof(DexposedStatsSlot);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    DexposedStatsFile* file = (DexposedStatsFile*) calloc(1, sizeof(DexposedStatsFile));
+    if (file == NULL) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    DexposedStatsHeader* header = (DexposedStatsHeader*) mapping;
+    header->version = DEXPOSED_STATS_VERSION;
+    header->headerSize = DEXPOSED_STATS_HEADER_SIZE;
+    header->slotsOffset = slotsOffset;
+    header->slotSize = sizeof(DexposedStatsSlot);
+    header->slotCapacity = capacity;
+    header->bucketCount = DEXPOSED_STATS_BUCKETS;
+    header->firstBucketShift = DEXPOSED_STATS_FIRST_BUCKET_SHIFT;
+    header->pid = getpid();
+    __sync_synchronize();
+    memcpy(header->magic, DEXPOSED_STATS_MAGIC, sizeof(DEXPOSED_STATS_MAGIC));
+
+    file->header = header;
+    file->slots = (DexposedStatsSlot*) ((char*) mapping + slotsOffset);
+    file->size = size;
+    __sync_synchronize();
+    dexposedStatsFile = file;
+    return true;
+}
+
+// turns the stats of a hook on or off, returns false if they cannot be turned on
+static bool dexposedStatsEnable(DexposedHookControl* control, bool enabled, const char* name) {
+    if (!enabled) {
+        control->statsSlot = NULL;
+        return true;
+    }
+    DexposedStatsSlot* slot = dexposedStatsAddHook(control->hookId, name);
+    if (slot == NULL)
+        return false;
+    control->statsSlot = slot;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native boolean openStatsFileNative(String path, int capacity)
+ */
+static jboolean com_taobao_android_dexposed_DexposedBridge_openStatsFileNative(JNIEnv* env, jclass clazz,
+            jstring path, jint capacity) {
+    const char* pathChars = env->GetStringUTFChars(path, NULL);
+    if (pathChars == NULL)
+        return false;
+    bool opened = dexposedStatsOpen(pathChars, capacity);
+    env->ReleaseStringUTFChars(path, pathChars);
+    return opened;
+}
+
+#endif  // DEXPOSED_STATS_H_
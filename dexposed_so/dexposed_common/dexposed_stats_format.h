@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Stats file of hooked methods, written by the native handlers and read
+ * by other processes, e.g. the reader in dexposed_tools.
+ *
+ * The file is mapped shared, a reader maps it as well and sees the
+ * counters as they are updated, without any call into the app. Layout:
+ *
+ *   offset 0                 DexposedStatsHeader
+ *   slotsOffset              slotCapacity x DexposedStatsSlot, one for each hook with stats
+ *
+ * Every slot is guarded by a seqlock. A writer makes the sequence odd
+ * with a compare and swap from the even value it read, which also keeps
+ * other writers out, updates the slot and increments the sequence again.
+ * A reader copies the slot and keeps the copy if the sequence was even
+ * and did not change while copying, else it tries again:
+ *
+ *   do {
+ *       before = slot->sequence;  barrier;
+ *       copy = *slot;             barrier;
+ *   } while ((before & 1) != 0 || slot->sequence != before);
+ *
+ * Slots are only added, a slot is valid once its hookId is not 0.
+ * Bucket i of the histogram counts the calls which took less than
+ * 2^(DEXPOSED_STATS_FIRST_BUCKET_SHIFT + i) ns and not less than the
+ * bound of bucket i - 1, the last bucket counts all longer calls.
+ */
+
+#ifndef DEXPOSED_STATS_FORMAT_H_
+#define DEXPOSED_STATS_FORMAT_H_
+
+#include <stdint.h>
+
+#define DEXPOSED_STATS_MAGIC "DXSTATS"
+#define DEXPOSED_STATS_VERSION 1
+#define DEXPOSED_STATS_HEADER_SIZE 4096
+#define DEXPOSED_STATS_BUCKETS 20
+// bucket 0 holds the calls faster than 1024 ns
+#define DEXPOSED_STATS_FIRST_BUCKET_SHIFT 10
+
+struct DexposedStatsHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t slotsOffset;
+    uint32_t slotSize;
+    uint32_t slotCapacity;
+    uint32_t bucketCount;
+    uint32_t firstBucketShift;
+    uint32_t pid;
+    volatile uint32_t slotCount;
+    uint32_t reserved;
+};
+
+struct DexposedStatsSlot {
+    volatile uint32_t sequence;     // odd while the slot is being written
+    volatile uint32_t hookId;       // written last when the slot is added, 0 while it is incomplete
+    char name[96];
+    uint32_t calls;
+    uint32_t exceptions;            // calls which threw
+    uint32_t maxNs;                 // saturates at 0xffffffff
+    uint32_t reserved;
+    uint64_t totalNs;
+    uint32_t histogram[DEXPOSED_STATS_BUCKETS];
+};
+
+#endif  // DEXPOSED_STATS_FORMAT_H_
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Executable memory for the stubs dexposed generates.
+ *
+ * Stubs are carved out of anonymous executable pages which are never
+ * freed, a thread may be running a stub at any time. A stub is written
+ * completely and its instruction cache flushed before any code can jump
+ * to it.
+ */
+
+#ifndef DEXPOSED_STUBS_H_
+#define DEXPOSED_STUBS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define DEXPOSED_STUB_PAGE_SIZE 4096
+
+static pthread_mutex_t dexposedStubLock = PTHREAD_MUTEX_INITIALIZER;
+// guarded by dexposedStubLock
+static uint8_t* dexposedStubPage = NULL;
+static size_t dexposedStubPageUsed = 0;
+
+// returns room for a stub of size bytes, or NULL
+static void* dexposedAllocateStub(size_t size) {
+    pthread_mutex_lock(&dexposedStubLock);
+    if (dexposedStubPage == NULL || dexposedStubPageUsed + size > DEXPOSED_STUB_PAGE_SIZE) {
+        void* page = mmap(NULL, DEXPOSED_STUB_PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED) {
+            pthread_mutex_unlock(&dexposedStubLock);
+            return NULL;
+        }
+        dexposedStubPage = (uint8_t*) page;
+        dexposedStubPageUsed = 0;
+    }
+    void* stub = dexposedStubPage + dexposedStubPageUsed;
+    dexposedStubPageUsed += size;
+    pthread_mutex_unlock(&dexposedStubLock);
+    return stub;
+}
+
+#endif  // DEXPOSED_STUBS_H_
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Systrace slices of hooked methods.
+ *
+ * A hook with systrace enabled writes a begin marker "B|<pid>|<name>"
+ * and an end marker "E|<pid>" to the ftrace trace_marker around its calls,
+ * the format of the framework's Trace.traceBegin(), so the calls show up as
+ * slices in systrace and perfetto. The marker file is opened once and
+ * both markers are formatted when they are set up, a traced call only
+ * makes the two writes.
+ *
+ * On Android markers are only written while the app tag is enabled in
+ * the tags libcutils keeps up to date, otherwise whenever the marker file
+ * is open: ftrace drops them itself while tracing is off.
+ */
+
+#ifndef DEXPOSED_SYSTRACE_H_
+#define DEXPOSED_SYSTRACE_H_
+
+#include <jni.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dexposed_hook_control.h"
+#include "dexposed_memory.h"
+
+// ATRACE_TAG_APP and ATRACE_TAG_NOT_READY of libcutils
+#define DEXPOSED_ATRACE_TAG_APP (1ULL << 12)
+#define DEXPOSED_ATRACE_TAG_NOT_READY (1ULL << 63)
+
+#define DEXPOSED_SYSTRACE_MAX_NAME 127
+
+struct DexposedSystraceMarker {
+    uint32_t length;
+    char text[];
+};
+
+// set once, the file stays open since handlers may be writing to it at any time
+static volatile int dexposedSystraceFd = -1;
+// atrace_enabled_tags of libcutils, NULL if it was not found
+static const volatile uint64_t* dexposedSystraceTags = NULL;
+static char dexposedSystraceEndMarker[24];
+static uint32_t dexposedSystraceEndLength = 0;
+
+static const char* const dexposedSystraceMarkerPaths[] = {
+    "/sys/kernel/tracing/trace_marker",
+    "/sys/kernel/debug/tracing/trace_marker",
+};
+
+// looks up the enabled tags of libcutils, making it read them first if it did not yet
+static const volatile uint64_t* dexposedSystraceFindTags() {
+    void (*setup)() = NULL;
+    *(void**) (&setup) = dlsym(RTLD_DEFAULT, "atrace_setup");
+    const volatile uint64_t* tags = (const volatile uint64_t*) dlsym(RTLD_DEFAULT, "atrace_enabled_tags");
+    if (setup == NULL || tags == NULL)
+        return NULL;
+    setup();
+    return tags;
+}
+
+// opens the marker file, path NULL for the one of the kernel, tags NULL to write markers whenever
+// a traced hook is called. It can only be opened once.
+static bool dexposedSystraceOpen(const char* path, const volatile uint64_t* tags) {
+    if (dexposedSystraceFd >= 0)
+        return false;
+
+    int fd = -1;
+    if (path != NULL) {
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+    } else {
+        for (size_t i = 0; fd < 0 && i < sizeof(dexposedSystraceMarkerPaths) / sizeof(dexposedSystraceMarkerPaths[0]); i++)
+            fd = open(dexposedSystraceMarkerPaths[i], O_WRONLY | O_CLOEXEC);
+    }
+    if (fd < 0)
+        return false;
+
+    dexposedSystraceEndLength = snprintf(dexposedSystraceEndMarker, sizeof(dexposedSystraceEndMarker),
+            "E|%d", getpid());
+    dexposedSystraceTags = tags;
+    __sync_synchronize();
+    if (!__sync_bool_compare_and_swap(&dexposedSystraceFd, -1, fd)) {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+// true if a call of the hook is written as a slice, read once per call so its markers pair up
+static inline bool dexposedSystraceActive(const DexposedHookControl* control) {
+    if (!control->systraceEnabled || dexposedSystraceFd < 0)
+        return false;
+    const volatile uint64_t* tags = dexposedSystraceTags;
+    return tags == NULL || (*tags & (DEXPOSED_ATRACE_TAG_APP | DEXPOSED_ATRACE_TAG_NOT_READY)) == DEXPOSED_ATRACE_TAG_APP;
+}
+
+static inline void dexposedSystraceBegin(const DexposedHookControl* control) {
+    const DexposedSystraceMarker* marker = control->systraceMarker;
+    ssize_t written = write(dexposedSystraceFd, marker->text, marker->length);
+    (void) written;
+}
+
+static inline void dexposedSystraceEnd() {
+    ssize_t written = write(dexposedSystraceFd, dexposedSystraceEndMarker, dexposedSystraceEndLength);
+    (void) written;
+}
+
+// formats the begin marker of the hook the first time it is traced, the name of a hook does not
+// change. Must not be called concurrently for the same hook.
+static bool dexposedSystraceSetUp(DexposedHookControl* control, const char* name) {
+    if (control->systraceMarker != NULL)
+        return true;
+
+    char text[DEXPOSED_SYSTRACE_MAX_NAME + 24];
+    int length = snprintf(text, sizeof(text), "B|%d|%.*s", getpid(), DEXPOSED_SYSTRACE_MAX_NAME, name);
+    uint32_t bytes = sizeof(DexposedSystraceMarker) + length + 1;
+    DexposedSystraceMarker* marker = (DexposedSystraceMarker*) malloc(bytes);
+    if (marker == NULL)
+        return false;
+    marker->length = length;
+    memcpy(marker->text, text, length + 1);
+
+    // freed with the hook, see dexposedSystraceFree()
+    control->nativeBytes += bytes;
+    __sync_add_and_fetch(&dexposedMemoryBytes, bytes);
+    __sync_synchronize();
+    control->systraceMarker = marker;
+    return true;
+}
+
+// called when the hook is freed
+static void dexposedSystraceFree(DexposedHookControl* control) {
+    free(control->systraceMarker);
+    control->systraceMarker = NULL;
+}
+
+// turns the slices of the hook on or off, name is only read the first time they are turned on
+static bool dexposedSystraceEnable(JNIEnv* env, DexposedHookControl* control, bool enabled, jstring name) {
+    if (enabled && control->systraceMarker == NULL) {
+        const char* nameChars = env->GetStringUTFChars(name, NULL);
+        if (nameChars == NULL)
+            return false;
+        bool setUp = dexposedSystraceSetUp(control, nameChars);
+        env->ReleaseStringUTFChars(name, nameChars);
+        if (!setUp)
+            return false;
+    }
+    control->systraceEnabled = enabled;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native boolean startSystraceNative()
+ */
+static jboolean com_taobao_android_dexposed_DexposedBridge_startSystraceNative(JNIEnv* env, jclass clazz) {
+    return dexposedSystraceOpen(NULL, dexposedSystraceFindTags());
+}
+
+#endif  // DEXPOSED_SYSTRACE_H_
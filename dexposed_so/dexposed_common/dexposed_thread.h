@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per-thread state of the native hook handlers, shared by the dalvik and
+ * art runtimes. Bionic has no usable __thread support on the platforms we
+ * target, so the state lives behind a pthread key and is allocated the first
+ * time a thread needs it.
+ */
+
+#ifndef DEXPOSED_THREAD_H_
+#define DEXPOSED_THREAD_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// nesting of calls with hooked JNI functions which return through their hook, see dexposed_jni_hook.h
+#define DEXPOSED_JNI_RETURN_DEPTH 32
+
+struct DexposedThreadState {
+    // kernel thread id, cached since gettid() is a system call
+    uint32_t tid;
+
+    // xorshift32 state for sampling decisions, never 0
+    uint32_t random;
+    // set on the thread running the asynchronous callbacks, it never blocks on its own queue
+    uint32_t asyncWorker;
+
+    // the thread opted in to hooks with the DEXPOSED_THREAD_FILTER_OPT_IN filter
+    uint32_t filterOptIn;
+
+    // number of Java dispatches of hooked calls the thread is in, 0 while it runs an original method
+    uint32_t callbackDepth;
+    // time the thread spent in original methods called by callbacks, see dexposedSuspendCallbacks()
+    uint64_t originalNs;
+
+    // frames of a sampled call stack, allocated the first time one is sampled, see dexposed_stacks.h
+    struct DexposedStackFrame* stackBuffer;
+
+    // epoch the thread entered its read section in, 0 outside, see dexposed_epoch.h
+    volatile uint32_t epoch;
+    uint32_t epochNesting;
+
+    // return addresses of the calls with hooked JNI functions the thread is in, see dexposed_jni_hook.h
+    uintptr_t jniReturns[DEXPOSED_JNI_RETURN_DEPTH];
+    uint32_t jniDepth;
+
+    // list of all thread states, guarded by dexposedThreadStatesLock
+    DexposedThreadState* next;
+    DexposedThreadState* previous;
+};
+
+static pthread_key_t dexposedThreadStateKey;
+
+// the main thread of a process has the process id as its thread id
+static uint32_t dexposedMainTid;
+
+static pthread_mutex_t dexposedThreadStatesLock = PTHREAD_MUTEX_INITIALIZER;
+static DexposedThreadState* dexposedThreadStates = NULL;
+
+static inline uint32_t dexposedGetTid() {
+    return (uint32_t) syscall(__NR_gettid);
+}
+
+static void dexposedFreeThreadState(void* data) {
+    DexposedThreadState* state = (DexposedThreadState*) data;
+    pthread_mutex_lock(&dexposedThreadStatesLock);
+    if (state->previous != NULL)
+        state->previous->next = state->next;
+    else
+        dexposedThreadStates = state->next;
+    if (state->next != NULL)
+        state->next->previous = state->previous;
+    pthread_mutex_unlock(&dexposedThreadStatesLock);
+    free(state->stackBuffer);
+    free(state);
+}
+
+// must be called once before any hook is installed
+static inline bool dexposedThreadStateInit() {
+    dexposedMainTid = getpid();
+    return pthread_key_create(&dexposedThreadStateKey, dexposedFreeThreadState) == 0;
+}
+
+// returns NULL if the state could not be allocated, callers should then behave
+// as if no per-thread feature was enabled
+static inline DexposedThreadState* dexposedGetThreadState() {
+    DexposedThreadState* state = (DexposedThreadState*) pthread_getspecific(dexposedThreadStateKey);
+    if (state != NULL)
+        return state;
+
+    state = (DexposedThreadState*) calloc(1, sizeof(DexposedThreadState));
+    if (state == NULL)
+        return NULL;
+
+    state->tid = dexposedGetTid();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    state->random = (state->tid * 2654435761u) ^ (uint32_t) now.tv_nsec;
+    if (state->random == 0)
+        state->random = 1;
+
+    pthread_mutex_lock(&dexposedThreadStatesLock);
+    state->next = dexposedThreadStates;
+    if (state->next != NULL)
+        state->next->previous = state;
+    dexposedThreadStates = state;
+    pthread_mutex_unlock(&dexposedThreadStatesLock);
+
+    pthread_setspecific(dexposedThreadStateKey, state);
+    return state;
+}
+
+static inline uint32_t dexposedNextRandom(DexposedThreadState* state) {
+    uint32_t x = state->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state->random = x;
+    return x;
+}
+
+#endif  // DEXPOSED_THREAD_H_
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Writing side of the trace file, the layout is described in
+ * dexposed_trace_format.h.
+ */
+
+#ifndef DEXPOSED_TRACE_H_
+#define DEXPOSED_TRACE_H_
+
+#include <jni.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "dexposed_hook_control.h"
+#include "dexposed_trace_format.h"
+
+struct DexposedTraceFile {
+    DexposedTraceHeader* header;
+    DexposedTraceHook* hooks;
+    DexposedTraceRecord* records;
+    uint32_t mask;
+    size_t size;
+};
+
+// set once, the mapping is never removed since handlers may be writing to it at any time
+static DexposedTraceFile* volatile dexposedTraceFile = NULL;
+
+static inline bool dexposedTraceEnabled(const DexposedHookControl* control) {
+    return control->traceEnabled && dexposedTraceFile != NULL;
+}
+
+static inline void dexposedTraceBegin(DexposedTraceRecord* record, const DexposedHookControl* control) {
+    record->hookId = control->hookId;
+    record->tid = dexposedGetTid();
+    record->thisHash = 0;
+    record->flags = 0;
+    record->argCount = 0;
+    record->reserved = 0;
+    record->result = 0;
+    record->timestampNs = dexposedNanoTime();
+}
+
+// stores the raw bits of one argument, call in argument order
+static inline void dexposedTraceArg(DexposedTraceRecord* record, uint64_t value) {
+    if (record->argCount < DEXPOSED_TRACE_MAX_ARGS)
+        record->args[record->argCount] = value;
+    else
+        record->flags |= DEXPOSED_TRACE_FLAG_TRUNCATED;
+    record->argCount++;
+}
+
+static inline void dexposedTraceEnd(DexposedTraceRecord* record, uint64_t result, bool exception) {
+    DexposedTraceFile* file = dexposedTraceFile;
+    if (file == NULL)
+        return;
+
+    uint64_t durationNs = dexposedNanoTime() - record->timestampNs;
+    record->durationNs = durationNs > 0xffffffffULL ? 0xffffffffu : (uint32_t) durationNs;
+    record->result = result;
+    if (exception)
+        record->flags |= DEXPOSED_TRACE_FLAG_EXCEPTION;
+
+    uint32_t index = __sync_fetch_and_add(&file->header->writeCount, 1);
+    DexposedTraceRecord* slot = &file->records[index & file->mask];
+    slot->sequence = 0;
+    __sync_synchronize();
+    memcpy((char*) slot + sizeof(slot->sequence), (const char*) record + sizeof(record->sequence),
+            sizeof(DexposedTraceRecord) - sizeof(record->sequence));
+    __sync_synchronize();
+    slot->sequence = index + 1;
+}
+
+// adds the description of a hook to the file, unless it is there already
+static bool dexposedTraceRegisterHook(uint32_t hookId, const char* shorty, const char* name) {
+    DexposedTraceFile* file = dexposedTraceFile;
+    if (file == NULL)
+        return false;
+
+    DexposedTraceHeader* header = file->header;
+    uint32_t count = header->hookCount;
+    for (uint32_t i = 0; i < count && i < header->hookCapacity; i++) {
+        if (file->hooks[i].hookId == hookId)
+            return true;
+    }
+
+    uint32_t index = __sync_fetch_and_add(&header->hookCount, 1);
+    if (index >= header->hookCapacity)
+        return false;
+
+    DexposedTraceHook* hook = &file->hooks[index];
+    strncpy(hook->shorty, shorty, sizeof(hook->shorty) - 1);
+    strncpy(hook->name, name, sizeof(hook->name) - 1);
+    __sync_synchronize();
+    hook->hookId = hookId;
+    return true;
+}
+
+// creates the file at path with room for at least capacity records
+static bool dexposedTraceOpen(const char* path, uint32_t capacity) {
+    if (dexposedTraceFile != NULL)
+        return false;
+
+    uint32_t recordCapacity = 64;
+    while (recordCapacity < capacity && recordCapacity < (1u << 24))
+        recordCapacity <<= 1;
+
+    size_t recordsOffset = DEXPOSED_TRACE_HEADER_SIZE + DEXPOSED_TRACE_HOOK_CAPACITY * sizeof(DexposedTraceHook);
+    size_t size = recordsOffset + (size_t) recordCapacity * sizeof(DexposedTraceRecord);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    DexposedTraceFile* file = (DexposedTraceFile*) calloc(1, sizeof(DexposedTraceFile));
+    if (file == NULL) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    DexposedTraceHeader* header = (DexposedTraceHeader*) mapping;
+    header->version = DEXPOSED_TRACE_VERSION;
+    header->headerSize = DEXPOSED_TRACE_HEADER_SIZE;
+    header->recordsOffset = recordsOffset;
+    header->recordSize = sizeof(DexposedTraceRecord);
+    header->recordCapacity = recordCapacity;
+    header->hookCapacity = DEXPOSED_TRACE_HOOK_CAPACITY;
+    header->pid = getpid();
+    header->monotonicBaseNs = dexposedNanoTime();
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    header->wallClockBaseMs = (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+    __sync_synchronize();
+    memcpy(header->magic, DEXPOSED_TRACE_MAGIC, sizeof(DEXPOSED_TRACE_MAGIC));
+
+    file->header = header;
+    file->hooks = (DexposedTraceHook*) ((char*) mapping + DEXPOSED_TRACE_HEADER_SIZE);
+    file->records = (DexposedTraceRecord*) ((char*) mapping + recordsOffset);
+    file->mask = recordCapacity - 1;
+    file->size = size;
+    __sync_synchronize();
+    dexposedTraceFile = file;
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+// JNI methods, registered by both runtimes
+////////////////////////////////////////////////////////////
+
+/*
+ * private static native boolean openTraceFileNative(String path, int capacity)
+ */
+static jboolean com_taobao_android_dexposed_DexposedBridge_openTraceFileNative(JNIEnv* env, jclass clazz,
+            jstring path, jint capacity) {
+    const char* pathChars = env->GetStringUTFChars(path, NULL);
+    if (pathChars == NULL)
+        return false;
+    bool opened = dexposedTraceOpen(pathChars, capacity);
+    env->ReleaseStringUTFChars(path, pathChars);
+    return opened;
+}
+
+/*
+ * private static native void syncTraceFileNative()
+ */
+static void com_taobao_android_dexposed_DexposedBridge_syncTraceFileNative(JNIEnv* env, jclass clazz) {
+    DexposedTraceFile* file = dexposedTraceFile;
+    if (file != NULL)
+        msync(file->header, file->size, MS_SYNC);
+}
+
+#endif  // DEXPOSED_TRACE_H_
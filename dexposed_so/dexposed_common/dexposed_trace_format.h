@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Trace file of hooked calls, written by the native handlers and read by the
+ * host decoder in dexposed_tools.
+ *
+ * The file is mapped shared, so records reach the page cache with a plain
+ * memory copy and survive a crash of the process. Layout:
+ *
+ *   offset 0                 DexposedTraceHeader
+ *   headerSize               hookCapacity x DexposedTraceHook, one for each traced hook
+ *   recordsOffset            recordCapacity x DexposedTraceRecord, a ring
+ *
+ * Writers take a slot with an atomic increment of writeCount. A record is
+ * valid when its sequence is the writeCount it was written for plus one; the
+ * sequence is cleared before and set after the rest of the record, so the
+ * decoder skips records which were being written when the file was copied.
+ * Only fixed-size data is recorded: primitives as their raw bits and objects
+ * as their identity hash code.
+ */
+
+#ifndef DEXPOSED_TRACE_FORMAT_H_
+#define DEXPOSED_TRACE_FORMAT_H_
+
+#include <stdint.h>
+
+#define DEXPOSED_TRACE_MAGIC "DXTRACE"
+#define DEXPOSED_TRACE_VERSION 1
+#define DEXPOSED_TRACE_HEADER_SIZE 4096
+#define DEXPOSED_TRACE_HOOK_CAPACITY 1024
+#define DEXPOSED_TRACE_MAX_ARGS 5
+
+enum {
+    // the call threw, result holds the identity hash of the exception
+    DEXPOSED_TRACE_FLAG_EXCEPTION = 1,
+    // the method has more than DEXPOSED_TRACE_MAX_ARGS arguments, the others are not recorded
+    DEXPOSED_TRACE_FLAG_TRUNCATED = 2,
+};
+
+struct DexposedTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t recordsOffset;
+    uint32_t recordSize;
+    uint32_t recordCapacity;        // a power of two
+    uint32_t hookCapacity;
+    uint32_t pid;
+    uint32_t reserved;
+    // CLOCK_MONOTONIC and wall clock when the file was created, to convert the timestamps
+    uint64_t monotonicBaseNs;
+    uint64_t wallClockBaseMs;
+    volatile uint32_t hookCount;
+    volatile uint32_t writeCount;
+};
+
+struct DexposedTraceHook {
+    volatile uint32_t hookId;       // written last, 0 while the entry is incomplete
+    char shorty[28];                // [0] is the return type, truncated like the arguments
+    char name[96];
+};
+
+struct DexposedTraceRecord {
+    volatile uint32_t sequence;
+    uint32_t hookId;
+    uint32_t tid;
+    uint32_t thisHash;              // 0 for static methods
+    uint64_t timestampNs;           // CLOCK_MONOTONIC at entry
+    uint32_t durationNs;            // saturates at 0xffffffff
+    uint16_t flags;
+    uint8_t argCount;               // number of arguments of the method
+    uint8_t reserved;
+    uint64_t result;
+    uint64_t args[DEXPOSED_TRACE_MAX_ARGS];
+};
+
+#endif  // DEXPOSED_TRACE_FORMAT_H_
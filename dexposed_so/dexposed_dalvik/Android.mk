@@ -20,7 +20,8 @@ ifneq ($(shell expr $(PLATFORM_SDK_VERSION) \> 15), 0)
 LOCAL_SHARED_LIBRARIES += libandroidfw
 endif
 
-LOCAL_C_INCLUDES += dalvik \
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../dexposed_common \
+                    dalvik \
                     dalvik/vm \
                     external/stlport/stlport \
                     bionic \
@@ -31,6 +31,7 @@
 #include <sys/mman.h>
 #include <cutils/properties.h>
 #include <dlfcn.h>
+#include <alloca.h>
 
 #include "dexposed_offsets.h"
 
@@ -48,6 +49,7 @@ bool keepLoadingDexposed = false;
 ClassObject* objectArrayClass = NULL;
 jclass dexposedClass = NULL;
 Method* dexposedHandleHookedMethod = NULL;
+Method* dexposedOnHookBudgetExceeded = NULL;
 
 void* PTR_gDvmJit = NULL;
 size_t arrayContentsOffset = 0;
@@ -86,7 +88,7 @@ static Object* dvmDecodeIndirectRef(::Thread* self, jobject jobj) {
 
 
 ////////////////////////////////////////////////////////////
-// called directoy by JNI_OnLoad
+// called by the bootstrap
 ////////////////////////////////////////////////////////////
 void initTypePointers()
 {
@@ -143,36 +145,25 @@ bool isRunningDalvik() {
     }
 }
 
+// Only registers the natives, the rest is done by bootstrapNative() on the first hook.
 extern "C" JNIEXPORT jint JNI_OnLoad(JavaVM* vm, void* reserved)
 {
     JNIEnv* env = NULL;
     jint result = -1;
+    uint64_t startNs = dexposedNanoTime();
 
     if (vm->GetEnv((void**) &env, JNI_VERSION_1_6) != JNI_OK) {
         return result;
     }
 
-    initTypePointers();
-    dexposedInfo();
-    keepLoadingDexposed = isRunningDalvik();
-    keepLoadingDexposed = dexposedOnVmCreated(env, NULL);
-    initNative(env, NULL);
+    keepLoadingDexposed = dexposedThreadStateInit() && dexposedOnVmCreated(env, NULL);
+    dexposedBootstrapTimed(DEXPOSED_BOOTSTRAP_LOAD, startNs);
 
     return JNI_VERSION_1_6;
 }
 
 bool dexposedOnVmCreated(JNIEnv* env, const char* className) {
 
-    keepLoadingDexposed = keepLoadingDexposed && dexposedInitMemberOffsets(env);
-    if (!keepLoadingDexposed)
-        return false;
-
-    // disable some access checks
-    patchReturnTrue((uintptr_t) &dvmCheckClassAccess);
-    patchReturnTrue((uintptr_t) &dvmCheckFieldAccess);
-    patchReturnTrue((uintptr_t) &dvmInSamePackage);
-    patchReturnTrue((uintptr_t) &dvmCheckMethodAccess);
-
     env->ExceptionClear();
 
     dexposedClass = env->FindClass(DEXPOSED_CLASS);
@@ -194,6 +185,49 @@ bool dexposedOnVmCreated(JNIEnv* env, const char* className) {
     return true;
 }
 
+////////////////////////////////////////////////////////////
+// bootstrap phases, see dexposed_bootstrap.h
+////////////////////////////////////////////////////////////
+static bool dexposedBootstrapDeviceInfo(JNIEnv* env) {
+    initTypePointers();
+    dexposedInfo();
+    keepLoadingDexposed = keepLoadingDexposed && isRunningDalvik();
+    return keepLoadingDexposed;
+}
+
+static bool dexposedBootstrapMemberOffsets(JNIEnv* env) {
+    keepLoadingDexposed = dexposedInitMemberOffsets(env);
+    return keepLoadingDexposed;
+}
+
+static bool dexposedBootstrapAccessPatches(JNIEnv* env) {
+    // disable some access checks, they are mostly on the same pages
+    DexposedCodePatchTransaction transaction;
+    dexposedCodePatchBegin(&transaction);
+    bool added = patchReturnTrue(&transaction, (uintptr_t) &dvmCheckClassAccess)
+            && patchReturnTrue(&transaction, (uintptr_t) &dvmCheckFieldAccess)
+            && patchReturnTrue(&transaction, (uintptr_t) &dvmInSamePackage)
+            && patchReturnTrue(&transaction, (uintptr_t) &dvmCheckMethodAccess);
+    // nothing is patched if it fails, hooks work without it
+    if (!added)
+        dexposedCodePatchAbort(&transaction);
+    if (!added || !dexposedCodePatchCommit(&transaction))
+        ALOGE("Could not disable the access checks\n");
+    return true;
+}
+
+static bool dexposedBootstrapResolveMethods(JNIEnv* env) {
+    return initNative(env, NULL);
+}
+
+static const DexposedBootstrapFunction dexposedBootstrapPhases[DEXPOSED_BOOTSTRAP_PHASES] = {
+    NULL,
+    dexposedBootstrapDeviceInfo,
+    dexposedBootstrapMemberOffsets,
+    dexposedBootstrapAccessPatches,
+    dexposedBootstrapResolveMethods,
+};
+
 static jboolean initNative(JNIEnv* env, jclass clazz) {
 
 	if (!keepLoadingDexposed) {
@@ -213,6 +247,16 @@ static jboolean initNative(JNIEnv* env, jclass clazz) {
         return false;
     }
 
+    dexposedOnHookBudgetExceeded = (Method*) env->GetStaticMethodID(dexposedClass, "onHookBudgetExceeded",
+        "(Ljava/lang/Object;)V");
+    if (dexposedOnHookBudgetExceeded == NULL) {
+        LOGE("ERROR: could not find method %s.onHookBudgetExceeded(Object)\n", DEXPOSED_CLASS);
+        dvmLogExceptionStackTrace();
+        env->ExceptionClear();
+        keepLoadingDexposed = false;
+        return false;
+    }
+
     Method* dexposedInvokeOriginalMethodNative = (Method*) env->GetStaticMethodID(dexposedClass, "invokeOriginalMethodNative",
         "(Ljava/lang/reflect/Member;I[Ljava/lang/Class;Ljava/lang/Class;Ljava/lang/Object;[Ljava/lang/Object;)Ljava/lang/Object;");
     if (dexposedInvokeOriginalMethodNative == NULL) {
@@ -235,6 +279,11 @@ static jboolean initNative(JNIEnv* env, jclass clazz) {
 	}
     dvmSetNativeFunc(dexposedInvokeSuperNative, com_taobao_android_dexposed_DexposedBridge_invokeSuperNative, NULL);
 
+    if (!dexposedRegisterFieldAccessors(env)) {
+        keepLoadingDexposed = false;
+        return false;
+    }
+
     objectArrayClass = dvmFindArrayClass("[Ljava/lang/Object;", NULL);
     if (objectArrayClass == NULL) {
         LOGE("Error while loading Object[] class");
@@ -293,16 +342,283 @@ static inline void dexposedSetObjectArrayElement(const ArrayObject* obj, int ind
 ////////////////////////////////////////////////////////////
 
 static void dexposedCallHandler(const u4* args, JValue* pResult, const Method* method, ::Thread* self) {
+    const u4* fp = args;
+    // the arguments are at the top of the frame, registersSize is left as it was, see dexposedPatchMethod()
+    args += method->registersSize - method->insSize;
+
+    // the hook info stays allocated until the call ended, see dexposed_memory.h
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state != NULL)
+        dexposedEpochEnter(state);
+    DexposedHookInfo* hookInfo = dexposedGetHookInfo(method);
+    if (hookInfo != NULL) {
+        dexposedHookCallBegin(&hookInfo->control);
+        // the caller profile is read in the same section
+        DexposedCallerTable* callers = hookInfo->control.callerTable;
+        if (callers != NULL && state != NULL)
+            dexposedRecordCaller(callers, fp);
+    }
+    if (state != NULL)
+        dexposedEpochExit(state);
+    if (hookInfo == NULL) {
+        // the hook was removed after the caller read nativeFunc, the method has its own code again
+        dexposedInvokeOriginal(args, pResult, method, self);
+        return;
+    }
+    DexposedStackFrame* stackFrames = dexposedStackSample(&hookInfo->control, state);
+    if (stackFrames != NULL)
+        dexposedSampleStack(stackFrames, fp);
+    if (dexposedAllocationSampled(&hookInfo->control, state))
+        dexposedRecordAllocation(method, fp);
+    bool systrace = dexposedSystraceActive(&hookInfo->control);
+    if (systrace)
+        dexposedSystraceBegin(&hookInfo->control);
+
+    DexposedStatsSlot* statsSlot = hookInfo->control.statsSlot;
+    if (statsSlot == NULL) {
+        dexposedRouteCall(args, pResult, method, hookInfo, self);
+    } else {
+        uint64_t startNs = dexposedNanoTime();
+        dexposedRouteCall(args, pResult, method, hookInfo, self);
+        dexposedStatsRecord(statsSlot, dexposedNanoTime() - startNs, dvmCheckException(self));
+    }
+    if (systrace)
+        dexposedSystraceEnd();
+    dexposedHookCallEnd(&hookInfo->control);
+}
 
-    if (!dexposedIsHooked(method)) {
-        dvmThrowNoSuchMethodError("could not find Dexposed original method - how did you even get here?");
+// records the call site of a call, fp is the frame the interpreter pushed for the hooked method. Its
+// save area holds the pc of the caller, which is the method of the previous frame unless that is a
+// break frame, i.e. the method was called from native code or by reflection.
+static void dexposedRecordCaller(DexposedCallerTable* table, const u4* fp) {
+    const StackSaveArea* saveArea = SAVEAREA_FROM_FP(fp);
+    const void* callerFp = saveArea->prevFrame;
+    const Method* caller = NULL;
+    uintptr_t dexPc = (uintptr_t) -1;
+    if (callerFp != NULL && !dvmIsBreakFrame((const u4*) callerFp)) {
+        caller = SAVEAREA_FROM_FP(callerFp)->method;
+        if (!dvmIsNativeMethod(caller) && saveArea->savedPc != NULL)
+            dexPc = saveArea->savedPc - caller->insns;
+    }
+    dexposedCallerRecord(table, caller, dexPc);
+}
+
+// captures the stack of a sampled call into frames and adds it to the trie, fp is the frame of the
+// hooked method. Break frames are skipped, the pc of a frame is its dex pc, or -1 in native methods.
+static void dexposedSampleStack(DexposedStackFrame* frames, const u4* fp) {
+    uint32_t depth = 0;
+    for (; fp != NULL && depth < DEXPOSED_STACK_MAX_DEPTH; fp = (const u4*) SAVEAREA_FROM_FP(fp)->prevFrame) {
+        if (dvmIsBreakFrame(fp))
+            continue;
+        const StackSaveArea* saveArea = SAVEAREA_FROM_FP(fp);
+        const Method* method = saveArea->method;
+        frames[depth].method = method;
+        if (dvmIsNativeMethod(method) || saveArea->xtra.currentPc == NULL)
+            frames[depth].pc = (uintptr_t) -1;
+        else
+            frames[depth].pc = saveArea->xtra.currentPc - method->insns;
+        depth++;
+    }
+    dexposedStackRecord(frames, depth);
+}
+
+// counts a sampled call of a profiled constructor for its class and calling method, fp is the frame of the
+// constructor. Calls made by another constructor of the class, i.e. this(...), do not allocate.
+static void dexposedRecordAllocation(const Method* constructor, const u4* fp) {
+    const void* callerFp = SAVEAREA_FROM_FP(fp)->prevFrame;
+    const Method* caller = NULL;
+    if (callerFp != NULL && !dvmIsBreakFrame((const u4*) callerFp))
+        caller = SAVEAREA_FROM_FP(callerFp)->method;
+    if (caller != NULL && caller->clazz == constructor->clazz && dvmIsConstructorMethod(caller))
+        return;
+    dexposedAllocationRecord(constructor->clazz, caller);
+}
+
+// passes a call through if its thread is filtered out, else answers it from the memoization cache or handles it.
+// Only calls which are to be dispatched may use the cache, a disabled group, a tripped budget or a nested call
+// passed through must run the original method.
+static void dexposedRouteCall(const u4* args, JValue* pResult, const Method* method, DexposedHookInfo* hookInfo, ::Thread* self) {
+    if (!dexposedThreadFilterAccepts(&hookInfo->control)) {
+        dexposedInvokeOriginal(args, pResult, (Method*) hookInfo, self);
+        return;
+    }
+    bool dispatch = dexposedShouldDispatch(&hookInfo->control);
+    if (hookInfo->control.memoCache != NULL && dispatch) {
+        dexposedMemoizedCall(args, pResult, method, hookInfo, self);
+        return;
+    }
+    dexposedHandleCall(args, pResult, method, hookInfo, self, dispatch);
+}
+
+// dispatches a call which passed the thread filter, recording it first if the hook is traced
+static void dexposedHandleCall(const u4* args, JValue* pResult, const Method* method, DexposedHookInfo* hookInfo, ::Thread* self,
+            bool dispatch) {
+    if (dexposedTraceEnabled(&hookInfo->control)) {
+        dexposedTraceCall(args, pResult, method, hookInfo, self, dispatch);
         return;
     }
+    dexposedDispatchCall(args, pResult, method, hookInfo, self, dispatch);
+}
 
-    DexposedHookInfo* hookInfo = (DexposedHookInfo*) method->insns;
+// builds the memoization key of a call, String arguments are keyed by their characters.
+// Returns false if the call cannot be memoized.
+static bool dexposedBuildMemoKey(const u4* args, const Method* method, DexposedMemoKey* key) {
+    if (!dvmIsStaticMethod(method))
+        return false;
+
+    dexposedMemoKeyInit(key);
+    const char* desc = &method->shorty[1]; // [0] is the return type.
+    while (*desc != '\0') {
+        switch (*(desc++)) {
+            case 'L': {
+                StringObject* string = (StringObject*) *(args++);
+                if (string == NULL)
+                    dexposedMemoKeyAdd(key, 0);
+                else
+                    dexposedMemoKeyAddChars(key, dvmStringChars(string), dvmStringLen(string));
+                break;
+            }
+            case 'J':
+            case 'D':
+                dexposedMemoKeyAdd(key, *(args++));
+                dexposedMemoKeyAdd(key, *(args++));
+                break;
+            default:
+                dexposedMemoKeyAdd(key, *(args++));
+        }
+    }
+    return !key->overflow;
+}
+
+// answers a call of a memoized hook which is to be dispatched from its cache. Calls which miss are handled like
+// any other and store their result unless they threw or the cache was invalidated meanwhile.
+static void dexposedMemoizedCall(const u4* args, JValue* pResult, const Method* method, DexposedHookInfo* hookInfo, ::Thread* self) {
+    DexposedMemoKey key;
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state == NULL || !dexposedBuildMemoKey(args, method, &key)) {
+        dexposedHandleCall(args, pResult, method, hookInfo, self, true);
+        return;
+    }
+    uint32_t hash = dexposedMemoKeyHash(&key);
+
+    bool hit = false;
+    uint32_t generation = 0;
+    dexposedEpochEnter(state);
+    DexposedMemoCache* cache = hookInfo->control.memoCache;
+    DexposedMemoCache* missedCache = cache;
+    if (cache != NULL) {
+        ArrayObject* pins = cache->referenceResult ? (ArrayObject*) dvmDecodeIndirectRef(self, cache->pins) : NULL;
+        generation = dexposedMemoGeneration(cache);
+        uint32_t set = dexposedMemoSetOf(cache, hash);
+        dexposedMemoLock(cache, set);
+        DexposedMemoEntry* entry = dexposedMemoFindLocked(cache, set, &key, hash, generation);
+        if (entry != NULL) {
+            hit = true;
+            if (pins != NULL)
+                pResult->l = ((Object**) ((uintptr_t) pins + arrayContentsOffset))[dexposedMemoIndexOf(cache, entry)];
+            else
+                pResult->j = entry->result;
+        }
+        dexposedMemoUnlock(cache, set);
+    }
+    dexposedEpochExit(state);
+    if (hit)
+        return;
+
+    dexposedHandleCall(args, pResult, method, hookInfo, self, true);
+    if (dvmCheckException(self))
+        return;
+
+    uint32_t* keyCopy = dexposedMemoCopyKey(&key);
+    if (keyCopy == NULL)
+        return;
+    uint32_t* oldKey = keyCopy;
+    dexposedEpochEnter(state);
+    cache = hookInfo->control.memoCache;
+    // a cache installed meanwhile may already have dropped what the result depends on
+    if (cache != NULL && cache == missedCache) {
+        ArrayObject* pins = cache->referenceResult ? (ArrayObject*) dvmDecodeIndirectRef(self, cache->pins) : NULL;
+        uint32_t set = dexposedMemoSetOf(cache, hash);
+        dexposedMemoLock(cache, set);
+        DexposedMemoEntry* entry = dexposedMemoClaimLocked(cache, set, &key, hash, generation, keyCopy, &oldKey);
+        // NULL if the cache was invalidated while the result was computed
+        if (entry != NULL && pins != NULL)
+            dexposedSetObjectArrayElement(pins, dexposedMemoIndexOf(cache, entry), pResult->l);
+        else if (entry != NULL)
+            entry->result = pResult->j;
+        dexposedMemoUnlock(cache, set);
+    }
+    dexposedEpochExit(state);
+    free(oldKey);
+}
+
+// returns the additional info of the published patch set if it patches the hook, else the one the hook was
+// installed with. The patch set may be reclaimed as soon as the read section is left, so a patched info is
+// returned as a tracked allocation which the caller must release.
+static Object* dexposedGetDispatchAdditionalInfo(DexposedHookInfo* hookInfo, ::Thread* self, bool* patched) {
+    *patched = false;
+    if (dexposedPatchSet == NULL)
+        return hookInfo->additionalInfo;
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state == NULL)
+        return hookInfo->additionalInfo;
+
+    Object* additionalInfo = hookInfo->additionalInfo;
+    dexposedEpochEnter(state);
+    jobject patchedInfo = dexposedPatchSetLookup(hookInfo->control.hookId);
+    if (patchedInfo != NULL) {
+        additionalInfo = dvmDecodeIndirectRef(self, patchedInfo);
+        dvmAddTrackedAlloc(additionalInfo, self);
+        *patched = true;
+    }
+    dexposedEpochExit(state);
+    return additionalInfo;
+}
+
+// calls which are not to be dispatched run the original method
+static void dexposedDispatchCall(const u4* args, JValue* pResult, const Method* method, DexposedHookInfo* hookInfo, ::Thread* self,
+            bool dispatch) {
     Method* original = (Method*) hookInfo;
+    if (!dispatch) {
+        dexposedInvokeOriginal(args, pResult, original, self);
+        return;
+    }
+
+    // only the time spent outside of the original method is charged to the budget
+    bool measureCost = dexposedBudgetEnabled(&hookInfo->control);
+    DexposedThreadState* clockState = measureCost ? dexposedGetThreadState() : NULL;
+    DexposedCallbackClock clock = { 0, 0 };
+    if (measureCost)
+        dexposedCallbackClockStart(clockState, &clock);
+
+    uint32_t dispatchMode = hookInfo->control.dispatchMode;
+    DexposedAsyncQueue* asyncQueue = NULL;
+    if (dispatchMode != DEXPOSED_DISPATCH_SYNC)
+        asyncQueue = dexposedAsyncAcquireQueue();
+
+    if (dispatchMode == DEXPOSED_DISPATCH_ASYNC_ONLY) {
+        // no Java code runs on this thread, the call is copied before the original method may change the arguments
+        DexposedAsyncCall* call = NULL;
+        ArrayObject* refs = asyncQueue == NULL ? NULL
+            : dexposedCaptureAsyncCall(asyncQueue, hookInfo, method, args, self, &call);
+        DexposedOriginalCall originalCall;
+        dexposedOriginalBegin(clockState, &originalCall);
+        dexposedInvokeOriginal(args, pResult, original, self);
+        dexposedOriginalEnd(clockState, &originalCall);
+        if (refs != NULL)
+            dexposedSubmitAsyncCall(asyncQueue, refs, call, pResult, self);
+        dexposedRecordDispatchCost(hookInfo, method, &clock, clockState, pResult, self);
+        return;
+    }
+
+    // the asynchronous callbacks see the arguments the method was called with
+    DexposedAsyncCall* asyncCall = NULL;
+    ArrayObject* asyncRefs = asyncQueue == NULL ? NULL
+        : dexposedCaptureAsyncCall(asyncQueue, hookInfo, method, args, self, &asyncCall);
+
     Object* originalReflected = hookInfo->reflectedMethod;
-    Object* additionalInfo = hookInfo->additionalInfo;
+    bool patched = false;
+    Object* additionalInfo = dexposedGetDispatchAdditionalInfo(hookInfo, self, &patched);
   
     // convert/box arguments
     const char* desc = &method->shorty[1]; // [0] is the return type.
@@ -318,6 +634,12 @@ static void dexposedCallHandler(const u4* args, JValue* pResult, const Method* m
     
     ArrayObject* argsArray = dvmAllocArrayByClass(objectArrayClass, strlen(method->shorty) - 1, ALLOC_DEFAULT);
     if (argsArray == NULL) {
+        if (asyncRefs != NULL) {
+            dexposedAsyncDrop(asyncQueue, asyncCall);
+            dvmReleaseTrackedAlloc((Object*) asyncRefs, self);
+        }
+        if (patched)
+            dvmReleaseTrackedAlloc(additionalInfo, self);
         return;
     }
     
@@ -356,63 +678,302 @@ static void dexposedCallHandler(const u4* args, JValue* pResult, const Method* m
         dexposedSetObjectArrayElement(argsArray, dstIndex++, obj);
     }
     
-    // call the Java handler function
+    // call the Java handler function, the arguments are passed as a prepared block of raw references
+    // rather than parsed from varargs against its signature
+    jvalue handlerArgs[5];
+    handlerArgs[0].l = (jobject) originalReflected;
+    handlerArgs[1].i = (int) original;
+    handlerArgs[2].l = (jobject) additionalInfo;
+    handlerArgs[3].l = (jobject) thisObject;
+    handlerArgs[4].l = (jobject) argsArray;
     JValue result;
-    dvmCallMethod(self, dexposedHandleHookedMethod, NULL, &result,
-        originalReflected, (int) original, additionalInfo, thisObject, argsArray);
+    DexposedThreadState* threadState = dexposedEnterCallbacks();
+    dvmCallMethodA(self, dexposedHandleHookedMethod, NULL, false, &result, handlerArgs);
+    dexposedLeaveCallbacks(threadState);
         
     dvmReleaseTrackedAlloc((Object *)argsArray, self);
+    if (patched)
+        dvmReleaseTrackedAlloc(additionalInfo, self);
+
+    // exceptions are thrown to the caller, otherwise return result with proper type
+    if (!dvmCheckException(self)) {
+        ClassObject* returnType = dvmGetBoxedReturnType(method);
+        if (returnType->primitiveType == PRIM_VOID) {
+            // ignored
+        } else if (result.l == NULL) {
+            if (dvmIsPrimitiveClass(returnType)) {
+                dvmThrowNullPointerException("null result when primitive expected");
+            }
+            pResult->l = NULL;
+        } else {
+            if (!dvmUnboxPrimitive((Object *)result.l, returnType, pResult)) {
+                dvmThrowClassCastException(((Object *)result.l)->clazz, returnType);
+
+            }
+        }
+    }
 
-    // exceptions are thrown to the caller
-    if (dvmCheckException(self)) {
+    if (asyncRefs != NULL)
+        dexposedSubmitAsyncCall(asyncQueue, asyncRefs, asyncCall, pResult, self);
+    dexposedRecordDispatchCost(hookInfo, method, &clock, clockState, pResult, self);
+}
+
+// charges a dispatched call to the budget of its hook once the result is final
+static void dexposedRecordDispatchCost(DexposedHookInfo* hookInfo, const Method* method,
+        const DexposedCallbackClock* clock, DexposedThreadState* clockState, JValue* pResult, ::Thread* self) {
+    // startNs is 0 if the budget was enabled while the call ran
+    if (clock->startNs == 0 || !dexposedBudgetEnabled(&hookInfo->control))
         return;
+    uint64_t nowNs = dexposedNanoTime();
+    if (dexposedBudgetRecord(&hookInfo->control, dexposedCallbackClockCost(clockState, clock, nowNs), nowNs))
+        dexposedNotifyHookBudgetExceeded(hookInfo, method, pResult, self);
+}
+
+// Calls the original method with the arguments as they were passed to the hooked one.
+// Nothing is boxed and the Java handler is not involved.
+static void dexposedInvokeOriginal(const u4* args, JValue* pResult, const Method* original, ::Thread* self) {
+    const char* desc = &original->shorty[1]; // [0] is the return type.
+    jvalue* argValues = (jvalue*) alloca(strlen(desc) * sizeof(jvalue));
+    Object* thisObject = NULL;
+    size_t srcIndex = 0;
+    size_t dstIndex = 0;
+
+    if (!dvmIsStaticMethod(original)) {
+        thisObject = (Object*) args[0];
+        srcIndex++;
     }
 
-    // return result with proper type
-    ClassObject* returnType = dvmGetBoxedReturnType(method);
-    if (returnType->primitiveType == PRIM_VOID) {
-        // ignored
-    } else if (result.l == NULL) {
-        if (dvmIsPrimitiveClass(returnType)) {
-            dvmThrowNullPointerException("null result when primitive expected");
+    while (*desc != '\0') {
+        switch (*(desc++)) {
+        case 'D':
+        case 'J':
+            argValues[dstIndex++].j = dvmGetArgLong(args, srcIndex);
+            srcIndex += 2;
+            break;
+        case '[':
+        case 'L':
+            argValues[dstIndex++].l = (jobject) args[srcIndex++];
+            break;
+        default:
+            argValues[dstIndex++].i = args[srcIndex++];
         }
-        pResult->l = NULL;
-    } else {
-        if (!dvmUnboxPrimitive((Object *)result.l, returnType, pResult)) {
-            dvmThrowClassCastException(((Object *)result.l)->clazz, returnType);
+    }
+
+    // objects are passed as Object* (fromJni = false), not as indirect references
+    dvmCallMethodA(self, original, thisObject, false, pResult, argValues);
+}
 
+// replaces the code of a method counted by coverage, counts the call and runs the original method
+static void dexposedCoverageHandler(const u4* args, JValue* pResult, const Method* method, ::Thread* self) {
+    args += method->registersSize - method->insSize;
+    DexposedCoverageSite* site;
+    uint32_t sequence;
+    do {
+        sequence = dexposedPublishReadBegin();
+        site = method->nativeFunc == &dexposedCoverageHandler ? (DexposedCoverageSite*) dexposedMethodTableGet(method) : NULL;
+    } while (dexposedPublishReadRetry(sequence));
+    if (site == NULL) {
+        // hooked after the caller read nativeFunc
+        dexposedInvokeOriginal(args, pResult, method, self);
+        return;
+    }
+    __sync_add_and_fetch(site->counter, 1);
+    dexposedInvokeOriginal(args, pResult, (Method*) site, self);
+}
+
+// returns the constant of a method replaced by replaceWithConstantNative(), nothing is read from the arguments
+static void dexposedConstantHandler(const u4* args, JValue* pResult, const Method* method, ::Thread* self) {
+    const uint64_t* constant;
+    uint32_t sequence;
+    do {
+        sequence = dexposedPublishReadBegin();
+        constant = method->nativeFunc == &dexposedConstantHandler ? (const uint64_t*) dexposedMethodTableGet(method) : NULL;
+    } while (dexposedPublishReadRetry(sequence));
+    if (constant == NULL) {
+        // hooked after the caller read nativeFunc
+        args += method->registersSize - method->insSize;
+        dexposedInvokeOriginal(args, pResult, method, self);
+        return;
+    }
+    pResult->j = *constant;
+}
+
+// tells DexposedBridge that a hook exceeded its budget and is passed through from now on,
+// a pending exception or the reference result of the hooked call is kept alive meanwhile
+static void dexposedNotifyHookBudgetExceeded(DexposedHookInfo* hookInfo, const Method* method,
+        JValue* pResult, ::Thread* self) {
+    Object* pending = dvmGetException(self);
+    Object* result = NULL;
+    if (pending != NULL) {
+        dvmAddTrackedAlloc(pending, self);
+        dvmClearException(self);
+    } else if (dexposedAsyncIsReference(method->shorty[0]) && pResult->l != NULL) {
+        result = (Object*) pResult->l;
+        dvmAddTrackedAlloc(result, self);
+    }
+
+    JValue unused;
+    DexposedThreadState* threadState = dexposedEnterCallbacks();
+    dvmCallMethod(self, dexposedOnHookBudgetExceeded, NULL, &unused, hookInfo->additionalInfo);
+    dexposedLeaveCallbacks(threadState);
+    dvmClearException(self);
+
+    if (pending != NULL) {
+        dvmSetException(self, pending);
+        dvmReleaseTrackedAlloc(pending, self);
+    }
+    if (result != NULL)
+        dvmReleaseTrackedAlloc(result, self);
+}
+
+// records a call to the trace file, objects are recorded as their identity hash
+static void dexposedTraceCall(const u4* args, JValue* pResult, const Method* method, DexposedHookInfo* hookInfo, ::Thread* self,
+            bool dispatch) {
+    DexposedTraceRecord record;
+    dexposedTraceBegin(&record, &hookInfo->control);
+
+    const char* desc = &method->shorty[1]; // [0] is the return type.
+    size_t srcIndex = 0;
+    if (!dvmIsStaticMethod(method)) {
+        record.thisHash = dvmIdentityHashCode((Object*) args[0]);
+        srcIndex++;
+    }
+    while (*desc != '\0') {
+        switch (*(desc++)) {
+        case 'D':
+        case 'J':
+            dexposedTraceArg(&record, dvmGetArgLong(args, srcIndex));
+            srcIndex += 2;
+            break;
+        case '[':
+        case 'L': {
+            Object* obj = (Object*) args[srcIndex++];
+            dexposedTraceArg(&record, obj != NULL ? dvmIdentityHashCode(obj) : 0);
+            break;
+        }
+        default:
+            dexposedTraceArg(&record, args[srcIndex++]);
+        }
+    }
+
+    dexposedDispatchCall(args, pResult, method, hookInfo, self, dispatch);
+
+    Object* exception = dvmGetException(self);
+    if (exception != NULL) {
+        dexposedTraceEnd(&record, dvmIdentityHashCode(exception), true);
+    } else {
+        switch (method->shorty[0]) {
+        case 'V':
+            dexposedTraceEnd(&record, 0, false);
+            break;
+        case 'D':
+        case 'J':
+            dexposedTraceEnd(&record, pResult->j, false);
+            break;
+        case '[':
+        case 'L':
+            dexposedTraceEnd(&record, pResult->l != NULL ? dvmIdentityHashCode((Object*) pResult->l) : 0, false);
+            break;
+        default:
+            dexposedTraceEnd(&record, (u4) pResult->i, false);
         }
     }
 }
 
+// copies a call for the asynchronous callbacks, the primitive arguments into a DexposedAsyncCall
+// and the references into an Object[] which is pinned in the queue; the array is returned as a
+// tracked allocation, or NULL if the call is dropped
+static ArrayObject* dexposedCaptureAsyncCall(DexposedAsyncQueue* queue, DexposedHookInfo* hookInfo,
+            const Method* method, const u4* args, ::Thread* self, DexposedAsyncCall** callOut) {
+    DexposedAsyncCall* call = dexposedAsyncCallCreate(method->shorty);
+    if (call == NULL) {
+        dexposedAsyncDrop(queue, NULL);
+        return NULL;
+    }
+
+    const char* desc = &method->shorty[1]; // [0] is the return type.
+    ArrayObject* refs = dvmAllocArrayByClass(objectArrayClass, DEXPOSED_ASYNC_REF_ARGS + strlen(desc), ALLOC_DEFAULT);
+    if (refs == NULL) {
+        dvmClearException(self);
+        dexposedAsyncDrop(queue, call);
+        return NULL;
+    }
 
-static void replaceAsm(uintptr_t function, unsigned const char* newCode, size_t len) {
-#ifdef __arm__
-    function = function & ~1;
-#endif
-    uintptr_t pageStart = function & ~(PAGESIZE-1);
-    size_t pageProtectSize = PAGESIZE;
-    if (function+len > pageStart+pageProtectSize)
-        pageProtectSize += PAGESIZE;
+    size_t srcIndex = 0;
+    size_t dstIndex = 0;
+    dexposedSetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_ADDITIONAL_INFO, hookInfo->additionalInfo);
+    if (!dvmIsStaticMethod(method)) {
+        dexposedSetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_THIS, (Object*) args[0]);
+        srcIndex++;
+    }
+
+    while (*desc != '\0') {
+        switch (*(desc++)) {
+        case 'D':
+        case 'J':
+            call->args[dstIndex].j = dvmGetArgLong(args, srcIndex);
+            srcIndex += 2;
+            break;
+        case '[':
+        case 'L':
+            dexposedSetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_ARGS + dstIndex, (Object*) args[srcIndex++]);
+            break;
+        default:
+            call->args[dstIndex].i = args[srcIndex++];
+        }
+        dstIndex++;
+    }
+
+    *callOut = call;
+    return refs;
+}
+
+// adds the result or the pending exception to a captured call and queues it, with the block
+// policy the thread waits for room in VMWAIT state so that it does not hold up the GC
+static void dexposedSubmitAsyncCall(DexposedAsyncQueue* queue, ArrayObject* refs, DexposedAsyncCall* call,
+            const JValue* pResult, ::Thread* self) {
+    Object* throwable = dvmGetException(self);
+    if (throwable != NULL) {
+        dexposedSetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_THROWABLE, throwable);
+    } else if (dexposedAsyncIsReference(call->shorty[0])) {
+        dexposedSetObjectArrayElement(refs, DEXPOSED_ASYNC_REF_RESULT, (Object*) pResult->l);
+    } else {
+        call->result.j = pResult->j;
+    }
 
-    mprotect((void*)pageStart, pageProtectSize, PROT_READ | PROT_WRITE | PROT_EXEC);
-    memcpy((void*)function, newCode, len);
-    mprotect((void*)pageStart, pageProtectSize, PROT_READ | PROT_EXEC);
+    uint32_t pos;
+    uint32_t attempt = 0;
+    while (!dexposedAsyncTryReserve(queue, &pos)) {
+        if (!dexposedAsyncMayBlock(queue)) {
+            dexposedAsyncDrop(queue, call);
+            call = NULL;
+            break;
+        }
+        ThreadStatus oldStatus = dvmChangeStatus(self, THREAD_VMWAIT);
+        dexposedAsyncBackoff(queue, attempt++);
+        dvmChangeStatus(self, oldStatus);
+    }
 
-    __clear_cache((void*)function, (void*)(function+len));
+    if (call != NULL) {
+        ArrayObject* pins = (ArrayObject*) dvmDecodeIndirectRef(self, queue->pins);
+        dexposedSetObjectArrayElement(pins, pos & queue->mask, (Object*) refs);
+        dexposedAsyncPublish(queue, pos, call);
+    }
+    dvmReleaseTrackedAlloc((Object*) refs, self);
 }
 
-static void patchReturnTrue(uintptr_t function) {
+// adds a patch making function return true to the transaction, see dexposed_code_patch.h
+static bool patchReturnTrue(DexposedCodePatchTransaction* transaction, uintptr_t function) {
 #ifdef __arm__
     unsigned const char asmReturnTrueThumb[] = { 0x01, 0x20, 0x70, 0x47 };
     unsigned const char asmReturnTrueArm[] = { 0x01, 0x00, 0xA0, 0xE3, 0x1E, 0xFF, 0x2F, 0xE1 };
     if (function & 1)
-        replaceAsm(function, asmReturnTrueThumb, sizeof(asmReturnTrueThumb));
+        return dexposedCodePatchAdd(transaction, function & ~1, asmReturnTrueThumb, sizeof(asmReturnTrueThumb));
     else
-        replaceAsm(function, asmReturnTrueArm, sizeof(asmReturnTrueArm));
+        return dexposedCodePatchAdd(transaction, function, asmReturnTrueArm, sizeof(asmReturnTrueArm));
 #else
     unsigned const char asmReturnTrueX86[] = { 0x31, 0xC0, 0x40, 0xC3 };
-    replaceAsm(function, asmReturnTrueX86, sizeof(asmReturnTrueX86));
+    return dexposedCodePatchAdd(transaction, function, asmReturnTrueX86, sizeof(asmReturnTrueX86));
 #endif
 }
 
@@ -442,23 +1003,178 @@ static void com_taobao_android_dexposed_DexposedBridge_hookMethodNative(JNIEnv*
         return;
     }
     
-    // Save a copy of the original method and other hook info
+    // Save the hook info, the copy of the original method is made when it is switched
     DexposedHookInfo* hookInfo = (DexposedHookInfo*) calloc(1, sizeof(DexposedHookInfo));
-    memcpy(hookInfo, method, sizeof(hookInfo->originalMethodStruct));
-    hookInfo->reflectedMethod = dvmDecodeIndirectRef(dvmThreadSelf(), env->NewGlobalRef(reflectedMethodIndirect));
-    hookInfo->additionalInfo = dvmDecodeIndirectRef(dvmThreadSelf(), env->NewGlobalRef(additionalInfoIndirect));
+    hookInfo->reflectedMethodRef = env->NewGlobalRef(reflectedMethodIndirect);
+    hookInfo->additionalInfoRef = env->NewGlobalRef(additionalInfoIndirect);
+    hookInfo->reflectedMethod = dvmDecodeIndirectRef(dvmThreadSelf(), hookInfo->reflectedMethodRef);
+    hookInfo->additionalInfo = dvmDecodeIndirectRef(dvmThreadSelf(), hookInfo->additionalInfoRef);
+    dexposedHookControlInit(&hookInfo->control);
+
+    // Replace method with our own code, nothing in between may suspend the thread
+    dexposedBeginPublish();
+    if (dexposedIsHooked(method)) {
+        // hooked by another thread meanwhile
+        dexposedEndPublish();
+        env->DeleteGlobalRef(hookInfo->reflectedMethodRef);
+        env->DeleteGlobalRef(hookInfo->additionalInfoRef);
+        free(hookInfo);
+        return;
+    }
+    // the copy of the method as it is when it is switched
+    if (!dexposedCopyMethod(hookInfo, method, sizeof(hookInfo->originalMethodStruct))
+            || !dexposedPatchMethod(method, &dexposedCallHandler, hookInfo)) {
+        dexposedMethodTablePut(hookInfo, NULL);
+        dexposedEndPublish();
+        env->DeleteGlobalRef(hookInfo->reflectedMethodRef);
+        env->DeleteGlobalRef(hookInfo->additionalInfoRef);
+        free(hookInfo);
+        return;
+    }
+    dexposedMemoryAccount(&hookInfo->control, sizeof(DexposedHookInfo), 2);
+    dexposedEndPublish();
+
+    if (dexposedPerfMapStarted()) {
+        char name[256];
+        size_t length = dexposedWriteClassName(method->clazz, name, sizeof(name));
+        snprintf(name + length, sizeof(name) - length, ".%s", method->name);
+        dexposedPerfMapAddHook((const void*) &dexposedCallHandler, name);
+    }
+
+    if (PTR_gDvmJit != NULL) {
+        // reset JIT cache
+        MEMBER_VAL(PTR_gDvmJit, DvmJitGlobals, codeCacheFull) = true;
+    }
+}
+
+static jint com_taobao_android_dexposed_DexposedBridge_coverMethodNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jstring name) {
+    if (declaredClassIndirect == NULL)
+        return -1;
+    ClassObject* declaredClass = (ClassObject*) dvmDecodeIndirectRef(dvmThreadSelf(), declaredClassIndirect);
+    Method* method = dvmSlotToMethod(declaredClass, slot);
+    if (method == NULL || dvmIsAbstractMethod(method))
+        return -1;
+
+    DexposedCoverageSite* site = (DexposedCoverageSite*) calloc(1, sizeof(DexposedCoverageSite));
+    if (site == NULL)
+        return -1;
+    const char* nameChars = env->GetStringUTFChars(name, NULL);
+    int32_t id = nameChars != NULL ? dexposedCoverageAdd(nameChars) : -1;
+    if (nameChars != NULL)
+        env->ReleaseStringUTFChars(name, nameChars);
+    if (id < 0) {
+        free(site);
+        return -1;
+    }
+
+    // a copy of the method as it is now, which may be a hooked method
+    dexposedBeginPublish();
+    site->counter = dexposedCoverageCounter(id);
+    if (!dexposedCopyMethod(site, method, sizeof(site->originalMethodStruct))
+            || !dexposedPatchMethod(method, &dexposedCoverageHandler, site)) {
+        // the id stays taken, its counter is never incremented
+        dexposedMethodTablePut(site, NULL);
+        dexposedEndPublish();
+        free(site);
+        return -1;
+    }
+    dexposedEndPublish();
+
+    if (PTR_gDvmJit != NULL) {
+        // reset JIT cache
+        MEMBER_VAL(PTR_gDvmJit, DvmJitGlobals, codeCacheFull) = true;
+    }
+    return id;
+}
 
-    // Replace method with our own code
-    SET_METHOD_FLAG(method, ACC_NATIVE);
-    method->nativeFunc = &dexposedCallHandler;
-    method->insns = (const u2*) hookInfo;
-    method->registersSize = method->insSize;
-    method->outsSize = 0;
+static jboolean com_taobao_android_dexposed_DexposedBridge_replaceWithConstantNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jlong bits) {
+    if (declaredClassIndirect == NULL)
+        return false;
+    ClassObject* declaredClass = (ClassObject*) dvmDecodeIndirectRef(dvmThreadSelf(), declaredClassIndirect);
+    Method* method = dvmSlotToMethod(declaredClass, slot);
+    if (method == NULL || dvmIsAbstractMethod(method))
+        return false;
+
+    // never freed, like the method
+    uint64_t* constant = (uint64_t*) malloc(sizeof(uint64_t));
+    if (constant == NULL)
+        return false;
+    *constant = bits;
+
+    // a hook or a counter would lose its data in the table, checked with the switch so that
+    // neither can be installed in between
+    dexposedBeginPublish();
+    bool patched = !dexposedIsHooked(method) && method->nativeFunc != &dexposedCoverageHandler
+            && dexposedPatchMethod(method, &dexposedConstantHandler, constant);
+    dexposedEndPublish();
+    if (!patched) {
+        free(constant);
+        return false;
+    }
 
     if (PTR_gDvmJit != NULL) {
         // reset JIT cache
         MEMBER_VAL(PTR_gDvmJit, DvmJitGlobals, codeCacheFull) = true;
     }
+    return true;
+}
+
+// dvmCallJNIMethod() reads the JNI function from insns on every call, so a hook is switched in with a
+// single store, see dexposed_jni_hook.h. The callbacks of a hooked method call its original copy, the
+// function of the copy is hooked instead and given back to the method when the hook is removed.
+static jboolean com_taobao_android_dexposed_DexposedBridge_hookJniFunctionNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jlong hook) {
+    if (declaredClassIndirect == NULL || hook == 0)
+        return false;
+    ClassObject* declaredClass = (ClassObject*) dvmDecodeIndirectRef(dvmThreadSelf(), declaredClassIndirect);
+    Method* method = dvmSlotToMethod(declaredClass, slot);
+    if (method == NULL || (!dexposedIsJniMethod(method) && !dexposedIsHooked(method)))
+        return false;
+
+    char name[256];
+    size_t length = dexposedWriteClassName(method->clazz, name, sizeof(name));
+    snprintf(name + length, sizeof(name) - length, ".%s", method->name);
+    DexposedJniHookStub* stub = dexposedJniHookCreate((const DexposedJniHook*) (uintptr_t) hook, name);
+    if (stub == NULL)
+        return false;
+
+    // a stub which is not installed is never called, it is kept like every stub
+    dexposedBeginPublish();
+    Method* target = method;
+    if (dexposedIsHooked(method))
+        target = &((DexposedHookInfo*) dexposedMethodTableGet(method))->originalMethodStruct.originalMethod;
+    bool hooked = dexposedIsJniMethod(target);
+    if (hooked) {
+        stub->original = (void*) target->insns;
+        __sync_synchronize();
+        target->insns = (const u2*) stub->code;
+    }
+    dexposedEndPublish();
+    return hooked;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_unhookJniFunctionNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot) {
+    if (declaredClassIndirect == NULL)
+        return false;
+    ClassObject* declaredClass = (ClassObject*) dvmDecodeIndirectRef(dvmThreadSelf(), declaredClassIndirect);
+    Method* method = dvmSlotToMethod(declaredClass, slot);
+    if (method == NULL)
+        return false;
+
+    DexposedJniHookStub* stub = NULL;
+    dexposedBeginPublish();
+    Method* target = method;
+    if (dexposedIsHooked(method))
+        target = &((DexposedHookInfo*) dexposedMethodTableGet(method))->originalMethodStruct.originalMethod;
+    if (dexposedIsJniMethod(target))
+        stub = dexposedJniHookFind(target->insns);
+    if (stub != NULL)
+        target->insns = (const u2*) stub->original;
+    dexposedEndPublish();
+    return stub != NULL;
 }
 
 /*
@@ -541,16 +1257,170 @@ static inline bool dexposedIsHooked(const Method* method) {
     return (method->nativeFunc == &dexposedCallHandler);
 }
 
+// true if method is a native method with a registered JNI function, which is kept in insns. Internal
+// natives have no insns, interpreted methods patched by dexposed are native but keep their bytecode.
+static inline bool dexposedIsJniMethod(const Method* method) {
+    return dvmIsNativeMethod(method) && method->insns != NULL
+            && method->nativeFunc != &dexposedCallHandler
+            && method->nativeFunc != &dexposedCoverageHandler
+            && method->nativeFunc != &dexposedConstantHandler;
+}
+
+// returns the hook info of method, or NULL if it is not hooked, both are read as one snapshot,
+// see dexposed_publish.h
+static inline DexposedHookInfo* dexposedGetHookInfo(const Method* method) {
+    DexposedHookInfo* hookInfo;
+    uint32_t sequence;
+    do {
+        sequence = dexposedPublishReadBegin();
+        hookInfo = dexposedIsHooked(method) ? (DexposedHookInfo*) dexposedMethodTableGet(method) : NULL;
+    } while (dexposedPublishReadRetry(sequence));
+    return hookInfo;
+}
+
+// Makes method call func with data while other threads may be calling it, between
+// dexposedBeginPublish() and dexposedEndPublish(). The data is kept in the method table, see
+// dexposed_method_table.h, so callers of the old code never read it as bytecode or as a JNI
+// function: a single store switches them to func and insns keeps its meaning. registersSize and
+// outsSize are left as they were, the interpreter and dvmCallMethod() put the arguments of a
+// native method at registersSize - insSize into its frame, so handlers skip that many words.
+// Returns false if the data could not be stored, the method is left as it is then.
+static bool dexposedPatchMethod(Method* method, DalvikBridgeFunc func, void* data) {
+    if (!dexposedMethodTablePut(method, data))
+        return false;
+    __sync_synchronize();
+    method->nativeFunc = func;
+    if (!dvmIsNativeMethod(method)) {
+        // nativeFunc is only read once the method is native, the flag is the switch
+        __sync_fetch_and_or(&method->accessFlags, ACC_NATIVE);
+    }
+    return true;
+}
+
+// gives method the fields of original back, the reverse of dexposedPatchMethod(). original may
+// have been patched itself, the method gets its data back as well.
+static void dexposedUnpatchMethod(Method* method, const Method* original) {
+    if (dvmIsNativeMethod(original)) {
+        // insns still holds a JNI function, the one of original may have been replaced meanwhile
+        method->insns = original->insns;
+        __sync_synchronize();
+        method->nativeFunc = original->nativeFunc;
+    } else {
+        __sync_fetch_and_and(&method->accessFlags, ~ACC_NATIVE);
+        method->nativeFunc = original->nativeFunc;
+    }
+    // the key of the method is in the table, restoring its data does not allocate
+    dexposedMethodTablePut(method, dexposedMethodTableGet(original));
+}
+
+// copies size bytes of method to copy between dexposedBeginPublish() and dexposedEndPublish(). A
+// copy of a patched method calls the same handler, which looks its data up by the address of the
+// copy. Returns false if the data could not be stored.
+static bool dexposedCopyMethod(void* copy, const Method* method, size_t size) {
+    memcpy(copy, method, size);
+    void* data = dexposedMethodTableGet(method);
+    return data == NULL || dexposedMethodTablePut(copy, data);
+}
+
+// frees a removed hook once no call uses it anymore, see dexposed_memory.h
+static void dexposedFreeHookInfo(DexposedHookControl* control, JNIEnv* env) {
+    DexposedHookInfo* hookInfo = (DexposedHookInfo*) ((u1*) control - offsetof(DexposedHookInfo, control));
+    env->DeleteGlobalRef(hookInfo->reflectedMethodRef);
+    env->DeleteGlobalRef(hookInfo->additionalInfoRef);
+    dexposedSystraceFree(control);
+    // installed by a JNI method which held the hook while it was removed, no call can read them anymore
+    if (control->memoCache != NULL)
+        dexposedMemoFree(control->memoCache, env);
+    if (control->callerTable != NULL)
+        dexposedCallerFree(control->callerTable, env);
+    // the copy of the original method may have been patched, its data must not outlive it
+    dexposedBeginPublish();
+    dexposedMethodTablePut(hookInfo, NULL);
+    dexposedEndPublish();
+    free(hookInfo);
+}
+
+// returns the hook info for the method in the given slot, or NULL if it is not hooked. It counts as an
+// active call until dexposedHookCallEnd(), so a concurrent removeHookNative() does not free it meanwhile.
+static DexposedHookInfo* dexposedAcquireHookInfo(jobject declaredClassIndirect, jint slot) {
+    if (declaredClassIndirect == NULL)
+        return NULL;
+
+    ClassObject* declaredClass = (ClassObject*) dvmDecodeIndirectRef(dvmThreadSelf(), declaredClassIndirect);
+    Method* method = dvmSlotToMethod(declaredClass, slot);
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (method == NULL || state == NULL)
+        return NULL;
+
+    dexposedEpochEnter(state);
+    DexposedHookInfo* hookInfo = dexposedGetHookInfo(method);
+    if (hookInfo != NULL)
+        dexposedHookCallBegin(&hookInfo->control);
+    dexposedEpochExit(state);
+    return hookInfo;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_removeHookNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot) {
+    if (declaredClassIndirect == NULL)
+        return false;
+    ClassObject* declaredClass = (ClassObject*) dvmDecodeIndirectRef(dvmThreadSelf(), declaredClassIndirect);
+    Method* method = dvmSlotToMethod(declaredClass, slot);
+    if (method == NULL)
+        return false;
+
+    dexposedBeginPublish();
+    if (!dexposedIsHooked(method)) {
+        dexposedEndPublish();
+        return false;
+    }
+    DexposedHookInfo* hookInfo = (DexposedHookInfo*) dexposedMethodTableGet(method);
+    dexposedUnpatchMethod(method, &hookInfo->originalMethodStruct.originalMethod);
+    dexposedEndPublish();
+
+    if (PTR_gDvmJit != NULL) {
+        // reset JIT cache
+        MEMBER_VAL(PTR_gDvmJit, DvmJitGlobals, codeCacheFull) = true;
+    }
+
+    dexposedMemoInstall(env, &hookInfo->control, NULL);
+    dexposedCallerInstall(env, &hookInfo->control, NULL);
+    dexposedHookRemoved(env, &hookInfo->control, dexposedFreeHookInfo);
+    return true;
+}
+
+static jint com_taobao_android_dexposed_DexposedBridge_reclaimRemovedHooksNative(JNIEnv* env, jclass clazz) {
+    return dexposedHookCollect(env, dexposedFreeHookInfo);
+}
+
+static jintArray com_taobao_android_dexposed_DexposedBridge_getHookMemoryUsageNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return NULL;
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    return dexposedHookMemoryUsage(env, &hookInfo->control);
+}
+
 // simplified copy of Method.invokeNative, but calls the original (non-hooked) method and has no access checks
 // used when a method has been hooked
 static void com_taobao_android_dexposed_DexposedBridge_invokeOriginalMethodNative(const u4* args, JValue* pResult,
             const Method* method, ::Thread* self) {
+    DexposedThreadState* state = dexposedGetThreadState();
+    DexposedHookInfo* hookInfo = NULL;
     Method* meth = (Method*) args[1];
     if (meth == NULL) {
         meth = dvmGetMethodFromReflectObj((Object*) args[0]);
-        if (dexposedIsHooked(meth)) {
-            meth = (Method*) meth->insns;
+        // the copy of the original method stays allocated until the call ended, see dexposed_memory.h
+        if (state != NULL)
+            dexposedEpochEnter(state);
+        hookInfo = dexposedGetHookInfo(meth);
+        if (hookInfo != NULL) {
+            dexposedHookCallBegin(&hookInfo->control);
+            meth = (Method*) hookInfo;
         }
+        if (state != NULL)
+            dexposedEpochExit(state);
     }
     ArrayObject* params = (ArrayObject*) args[2];
     ClassObject* returnType = (ClassObject*) args[3];
@@ -558,12 +1428,546 @@ static void com_taobao_android_dexposed_DexposedBridge_invokeOriginalMethodNativ
     ArrayObject* argList = (ArrayObject*) args[5];
 
     // invoke the method
+    DexposedOriginalCall originalCall;
+    dexposedSuspendCallbacks(state, &originalCall);
     pResult->l = dvmInvokeMethod(thisObject, meth, argList, params, returnType, true);
+    dexposedResumeCallbacks(state, &originalCall);
+    if (hookInfo != NULL)
+        dexposedHookCallEnd(&hookInfo->control);
     return;
 }
 
+static jboolean com_taobao_android_dexposed_DexposedBridge_setSamplingRateNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint rate) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    hookInfo->control.samplingRate = rate;
+    return true;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setDispatchModeNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint mode) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    hookInfo->control.dispatchMode = mode;
+    // the mode changes with the callbacks, results cached for the old ones are dropped
+    dexposedMemoInvalidate(&hookInfo->control);
+    return true;
+}
+
+static jint com_taobao_android_dexposed_DexposedBridge_publishPatchSetNative(JNIEnv* env, jclass clazz, jobjectArray reflectedMethods,
+            jobjectArray declaredClasses, jintArray slots, jobjectArray additionalInfos) {
+    DexposedPatchSet* patchSet = NULL;
+    if (reflectedMethods != NULL) {
+        patchSet = dexposedPatchSetCreate();
+        if (patchSet == NULL)
+            return 0;
+
+        jsize count = env->GetArrayLength(reflectedMethods);
+        jint* slotValues = env->GetIntArrayElements(slots, NULL);
+        for (jsize i = 0; i < count; i++) {
+            jobject declaredClassIndirect = env->GetObjectArrayElement(declaredClasses, i);
+            DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slotValues[i]);
+            env->DeleteLocalRef(declaredClassIndirect);
+            uint32_t hookId = hookInfo != NULL ? hookInfo->control.hookId : patchSet->capacity;
+            if (hookInfo != NULL)
+                dexposedHookCallEnd(&hookInfo->control);
+            if (hookId >= patchSet->capacity) {
+                env->ReleaseIntArrayElements(slots, slotValues, JNI_ABORT);
+                dexposedPatchSetFree(patchSet, env);
+                return 0;
+            }
+            jobject additionalInfoIndirect = env->GetObjectArrayElement(additionalInfos, i);
+            patchSet->additionalInfos[hookId] = env->NewGlobalRef(additionalInfoIndirect);
+            env->DeleteLocalRef(additionalInfoIndirect);
+        }
+        env->ReleaseIntArrayElements(slots, slotValues, JNI_ABORT);
+    }
+    uint32_t version = dexposedPatchSetPublish(env, patchSet);
+    // the results cached before were computed by the callbacks of the previous set
+    dexposedMemoFlushAll();
+    return version;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setNestedPolicyNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint policy) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    hookInfo->control.nestedPolicy = policy;
+    return true;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setThreadFilterNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint filter, jintArray tidsArray) {
+    uint32_t tids[DEXPOSED_MAX_FILTER_TIDS];
+    jsize tidCount = tidsArray == NULL ? 0 : env->GetArrayLength(tidsArray);
+    if (tidCount > DEXPOSED_MAX_FILTER_TIDS)
+        return false;
+    if (tidCount > 0)
+        env->GetIntArrayRegion(tidsArray, 0, tidCount, (jint*) tids);
+
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    return dexposedSetThreadFilter(&hookInfo->control, filter, tids, tidCount);
+}
+
+static void com_taobao_android_dexposed_DexposedBridge_setThreadOptInNative(JNIEnv* env, jclass clazz, jboolean optIn) {
+    DexposedThreadState* state = dexposedGetThreadState();
+    if (state != NULL)
+        state->filterOptIn = optIn;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setStatsNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jboolean enabled, jstring name) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    const char* nameChars = env->GetStringUTFChars(name, NULL);
+    if (nameChars == NULL)
+        return false;
+    bool set = dexposedStatsEnable(&hookInfo->control, enabled, nameChars);
+    env->ReleaseStringUTFChars(name, nameChars);
+    return set;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setMemoizationNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint capacity, jint maxAgeMs) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    DexposedMemoCache* cache = NULL;
+    if (capacity > 0) {
+        cache = dexposedMemoCreate(env, capacity, maxAgeMs, hookInfo->originalMethodStruct.originalMethod.shorty[0] == 'L');
+        if (cache == NULL)
+            return false;
+    }
+    dexposedMemoInstall(env, &hookInfo->control, cache);
+    return true;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_invalidateMemoizationNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    return dexposedMemoInvalidate(&hookInfo->control);
+}
+
+static jintArray com_taobao_android_dexposed_DexposedBridge_getMemoizationStatsNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return NULL;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    return dexposedMemoStats(env, &hookInfo->control);
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setCallerProfileNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint capacity) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    DexposedCallerTable* table = NULL;
+    if (capacity > 0) {
+        table = dexposedCallerCreate(capacity);
+        if (table == NULL)
+            return false;
+    }
+    dexposedCallerInstall(env, &hookInfo->control, table);
+    return true;
+}
+
+// names a caller like Lcom/example/Foo;.bar(I)V, methods are never freed
+static jint dexposedDescribeCaller(JNIEnv* env, const DexposedCallerEntry* site, jstring* name) {
+    const Method* caller = (const Method*) site->caller;
+    if (caller == NULL) {
+        *name = NULL;
+        return -1;
+    }
+    char* signature = dexProtoCopyMethodDescriptor(&caller->prototype);
+    size_t length = strlen(caller->clazz->descriptor) + strlen(caller->name) + (signature != NULL ? strlen(signature) : 0) + 2;
+    char* chars = (char*) malloc(length);
+    if (chars != NULL) {
+        snprintf(chars, length, "%s.%s%s", caller->clazz->descriptor, caller->name, signature != NULL ? signature : "");
+        *name = env->NewStringUTF(chars);
+    } else {
+        *name = NULL;
+    }
+    free(chars);
+    free(signature);
+    return site->pc != (uintptr_t) -1 ? (jint) site->pc : -1;
+}
+
+static jobjectArray com_taobao_android_dexposed_DexposedBridge_getTopCallersNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jintArray counts) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return NULL;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    return dexposedCallerTopCallers(env, &hookInfo->control, counts, dexposedDescribeCaller);
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setStackSamplingNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint rate) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    hookInfo->control.stackSamplingRate = rate;
+    return true;
+}
+
+// writes the name of a class like com.example.Foo into name, returns its length
+static size_t dexposedWriteClassName(const ClassObject* clazz, char* name, size_t size) {
+    const char* descriptor = clazz->descriptor;
+    size_t length = 0;
+    if (*descriptor == 'L')
+        descriptor++;
+    for (; *descriptor != '\0' && *descriptor != ';' && length + 1 < size; descriptor++)
+        name[length++] = *descriptor == '/' ? '.' : *descriptor;
+    name[length] = '\0';
+    return length;
+}
+
+// names a frame of a sampled stack like com.example.Foo.bar:12, methods are never freed
+static void dexposedDescribeStackFrame(void* context, const DexposedStackFrame* frame, char* name, size_t size) {
+    const Method* method = (const Method*) frame->method;
+    size_t length = dexposedWriteClassName(method->clazz, name, size);
+    if (frame->pc != (uintptr_t) -1)
+        snprintf(name + length, size - length, ".%s:%u", method->name, (uint32_t) frame->pc);
+    else
+        snprintf(name + length, size - length, ".%s", method->name);
+}
+
+static jint com_taobao_android_dexposed_DexposedBridge_dumpStackSamplesNative(JNIEnv* env, jclass clazz, jstring path) {
+    const char* pathChars = env->GetStringUTFChars(path, NULL);
+    if (pathChars == NULL)
+        return -1;
+    jint stacks = dexposedStacksDump(pathChars, dexposedDescribeStackFrame, NULL);
+    env->ReleaseStringUTFChars(path, pathChars);
+    return stacks;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setAllocationSamplingNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint rate) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    hookInfo->control.allocationSamplingRate = rate;
+    return true;
+}
+
+// names an allocation site like "com.example.Foo\tcom.example.Bar.create", classes and methods are never freed
+static void dexposedDescribeAllocation(void* context, const void* clazz, const void* caller, char* name, size_t size) {
+    size_t length = dexposedWriteClassName((const ClassObject*) clazz, name, size);
+    const Method* callerMethod = (const Method*) caller;
+    if (callerMethod == NULL) {
+        snprintf(name + length, size - length, "\t<native>");
+        return;
+    }
+    length += snprintf(name + length, size - length, "\t");
+    if (length + 1 >= size)
+        return;
+    length += dexposedWriteClassName(callerMethod->clazz, name + length, size - length);
+    snprintf(name + length, size - length, ".%s", callerMethod->name);
+}
+
+static jint com_taobao_android_dexposed_DexposedBridge_dumpAllocationsNative(JNIEnv* env, jclass clazz, jstring path) {
+    const char* pathChars = env->GetStringUTFChars(path, NULL);
+    if (pathChars == NULL)
+        return -1;
+    jint sites = dexposedAllocationsDump(pathChars, dexposedDescribeAllocation, NULL);
+    env->ReleaseStringUTFChars(path, pathChars);
+    return sites;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setHookGroupNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint group) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    return dexposedSetHookGroup(&hookInfo->control, group);
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setHookGroupEnabledNative(JNIEnv* env, jclass clazz, jint group, jboolean enabled) {
+    return dexposedSetHookGroupEnabled(group, enabled);
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setTracingNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jboolean enabled, jstring name) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    if (enabled) {
+        const char* nameChars = env->GetStringUTFChars(name, NULL);
+        if (nameChars == NULL)
+            return false;
+        bool registered = dexposedTraceRegisterHook(hookInfo->control.hookId,
+            hookInfo->originalMethodStruct.originalMethod.shorty, nameChars);
+        env->ReleaseStringUTFChars(name, nameChars);
+        if (!registered)
+            return false;
+    }
+    hookInfo->control.traceEnabled = enabled;
+    return true;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_bootstrapNative(JNIEnv* env, jclass clazz) {
+    return dexposedBootstrap(env, dexposedBootstrapPhases);
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setSystraceNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jboolean enabled, jstring name) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    return dexposedSystraceEnable(env, &hookInfo->control, enabled, name);
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_setBudgetNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint windowMs, jint maxUs, jint maxCalls, jint rearmPolicy, jint cooldownMs) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    DexposedHookControl* control = &hookInfo->control;
+    control->budgetWindowMs = 0;
+    control->budgetMaxUs = maxUs;
+    control->budgetMaxCalls = maxCalls;
+    control->budgetRearmPolicy = rearmPolicy;
+    control->budgetCooldownMs = cooldownMs;
+    dexposedBudgetReset(control);
+    control->budgetWindowMs = windowMs;
+    return true;
+}
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_rearmBudgetNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot) {
+    DexposedHookInfo* hookInfo = dexposedAcquireHookInfo(declaredClassIndirect, slot);
+    if (hookInfo == NULL)
+        return false;
+
+    DexposedHookCallScope hookCall(&hookInfo->control);
+    dexposedBudgetReset(&hookInfo->control);
+    return true;
+}
+
+////////////////////////////////////////////////////////////
+// field accessors
+////////////////////////////////////////////////////////////
+
+// handles of static fields are the address of the StaticField with the lowest bit set,
+// handles of instance fields are the byte offset of the field in the object
+#define DEXPOSED_FIELD_HANDLE_STATIC 1
+
+/*
+ * static native long resolveFieldNative(Field field)
+ */
+static jlong com_taobao_android_dexposed_DexposedBridge_resolveFieldNative(JNIEnv* env, jclass clazz, jobject fieldIndirect) {
+    Field* field = (Field*) env->FromReflectedField(fieldIndirect);
+    if (field == NULL) {
+        // 0 is a valid handle, the offset of the class pointer
+        if (!env->ExceptionCheck())
+            env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "cannot resolve the field");
+        return 0;
+    }
+    if (dvmIsStaticField(field))
+        return (jlong) ((uintptr_t) field | DEXPOSED_FIELD_HANDLE_STATIC);
+    return ((InstField*) field)->byteOffset;
+}
+
+// booleans, bytes, chars, shorts and floats take a full 32 bit slot like ints
+/*
+ * static native int getFieldIntNative(Object obj, long handle)
+ */
+static void com_taobao_android_dexposed_DexposedBridge_getFieldIntNative(const u4* args, JValue* pResult,
+            const Method* method, ::Thread* self) {
+    Object* obj = (Object*) args[0];
+    uintptr_t handle = (uintptr_t) dvmGetArgLong(args, 1);
+    if (handle & DEXPOSED_FIELD_HANDLE_STATIC)
+        pResult->i = dvmGetStaticFieldInt((StaticField*) (handle & ~DEXPOSED_FIELD_HANDLE_STATIC));
+    else
+        pResult->i = dvmGetFieldInt(obj, handle);
+}
+
+/*
+ * static native void setFieldIntNative(Object obj, long handle, int value)
+ */
+static void com_taobao_android_dexposed_DexposedBridge_setFieldIntNative(const u4* args, JValue* pResult,
+            const Method* method, ::Thread* self) {
+    Object* obj = (Object*) args[0];
+    uintptr_t handle = (uintptr_t) dvmGetArgLong(args, 1);
+    s4 value = args[3];
+    if (handle & DEXPOSED_FIELD_HANDLE_STATIC)
+        dvmSetStaticFieldInt((StaticField*) (handle & ~DEXPOSED_FIELD_HANDLE_STATIC), value);
+    else
+        dvmSetFieldInt(obj, handle, value);
+}
+
+/*
+ * static native long getFieldLongNative(Object obj, long handle)
+ */
+static void com_taobao_android_dexposed_DexposedBridge_getFieldLongNative(const u4* args, JValue* pResult,
+            const Method* method, ::Thread* self) {
+    Object* obj = (Object*) args[0];
+    uintptr_t handle = (uintptr_t) dvmGetArgLong(args, 1);
+    if (handle & DEXPOSED_FIELD_HANDLE_STATIC)
+        pResult->j = dvmGetStaticFieldLong((StaticField*) (handle & ~DEXPOSED_FIELD_HANDLE_STATIC));
+    else
+        pResult->j = dvmGetFieldLong(obj, handle);
+}
+
+/*
+ * static native void setFieldLongNative(Object obj, long handle, long value)
+ */
+static void com_taobao_android_dexposed_DexposedBridge_setFieldLongNative(const u4* args, JValue* pResult,
+            const Method* method, ::Thread* self) {
+    Object* obj = (Object*) args[0];
+    uintptr_t handle = (uintptr_t) dvmGetArgLong(args, 1);
+    s8 value = dvmGetArgLong(args, 3);
+    if (handle & DEXPOSED_FIELD_HANDLE_STATIC)
+        dvmSetStaticFieldLong((StaticField*) (handle & ~DEXPOSED_FIELD_HANDLE_STATIC), value);
+    else
+        dvmSetFieldLong(obj, handle, value);
+}
+
+/*
+ * static native Object getFieldObjectNative(Object obj, long handle)
+ */
+static void com_taobao_android_dexposed_DexposedBridge_getFieldObjectNative(const u4* args, JValue* pResult,
+            const Method* method, ::Thread* self) {
+    Object* obj = (Object*) args[0];
+    uintptr_t handle = (uintptr_t) dvmGetArgLong(args, 1);
+    if (handle & DEXPOSED_FIELD_HANDLE_STATIC)
+        pResult->l = dvmGetStaticFieldObject((StaticField*) (handle & ~DEXPOSED_FIELD_HANDLE_STATIC));
+    else
+        pResult->l = dvmGetFieldObject(obj, handle);
+}
+
+/*
+ * static native void setFieldObjectNative(Object obj, long handle, Object value)
+ */
+static void com_taobao_android_dexposed_DexposedBridge_setFieldObjectNative(const u4* args, JValue* pResult,
+            const Method* method, ::Thread* self) {
+    Object* obj = (Object*) args[0];
+    uintptr_t handle = (uintptr_t) dvmGetArgLong(args, 1);
+    Object* value = (Object*) args[3];
+    // both setters do the write barrier
+    if (handle & DEXPOSED_FIELD_HANDLE_STATIC)
+        dvmSetStaticFieldObject((StaticField*) (handle & ~DEXPOSED_FIELD_HANDLE_STATIC), value);
+    else
+        dvmSetFieldObject(obj, handle, value);
+}
+
+static const DexposedInternalNative dexposedFieldAccessorMethods[] = {
+    {"getFieldIntNative", "(Ljava/lang/Object;J)I", com_taobao_android_dexposed_DexposedBridge_getFieldIntNative},
+    {"setFieldIntNative", "(Ljava/lang/Object;JI)V", com_taobao_android_dexposed_DexposedBridge_setFieldIntNative},
+    {"getFieldLongNative", "(Ljava/lang/Object;J)J", com_taobao_android_dexposed_DexposedBridge_getFieldLongNative},
+    {"setFieldLongNative", "(Ljava/lang/Object;JJ)V", com_taobao_android_dexposed_DexposedBridge_setFieldLongNative},
+    {"getFieldObjectNative", "(Ljava/lang/Object;J)Ljava/lang/Object;", com_taobao_android_dexposed_DexposedBridge_getFieldObjectNative},
+    {"setFieldObjectNative", "(Ljava/lang/Object;JLjava/lang/Object;)V", com_taobao_android_dexposed_DexposedBridge_setFieldObjectNative},
+};
+
+// the field accessors run without a JNI transition
+static bool dexposedRegisterFieldAccessors(JNIEnv* env) {
+    for (size_t i = 0; i < NELEM(dexposedFieldAccessorMethods); i++) {
+        Method* accessor = (Method*) env->GetStaticMethodID(dexposedClass, dexposedFieldAccessorMethods[i].name,
+            dexposedFieldAccessorMethods[i].signature);
+        if (accessor == NULL) {
+            LOGE("ERROR: could not find method %s.%s\n", DEXPOSED_CLASS, dexposedFieldAccessorMethods[i].name);
+            dvmLogExceptionStackTrace();
+            env->ExceptionClear();
+            return false;
+        }
+        dvmSetNativeFunc(accessor, dexposedFieldAccessorMethods[i].func, NULL);
+    }
+    return true;
+}
+
 static const JNINativeMethod dexposedMethods[] = {
+    {"resolveFieldNative", "(Ljava/lang/reflect/Field;)J", (void*)com_taobao_android_dexposed_DexposedBridge_resolveFieldNative},
     {"hookMethodNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;ILjava/lang/Object;)V", (void*)com_taobao_android_dexposed_DexposedBridge_hookMethodNative},
+    {"setSamplingRateNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setSamplingRateNative},
+    {"setDispatchModeNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setDispatchModeNative},
+    {"setBudgetNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IIIIII)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setBudgetNative},
+    {"rearmBudgetNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_rearmBudgetNative},
+    {"publishPatchSetNative", "([Ljava/lang/reflect/Member;[Ljava/lang/Class;[I[Ljava/lang/Object;)I", (void*)com_taobao_android_dexposed_DexposedBridge_publishPatchSetNative},
+    {"reclaimPatchSetsNative", "()I", (void*)com_taobao_android_dexposed_DexposedBridge_reclaimPatchSetsNative},
+    {"setNestedPolicyNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setNestedPolicyNative},
+    {"setThreadFilterNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II[I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setThreadFilterNative},
+    {"setThreadOptInNative", "(Z)V", (void*)com_taobao_android_dexposed_DexposedBridge_setThreadOptInNative},
+    {"startCoverageNative", "(Ljava/lang/String;I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_startCoverageNative},
+    {"coverMethodNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;ILjava/lang/String;)I", (void*)com_taobao_android_dexposed_DexposedBridge_coverMethodNative},
+    {"getCoverageCountsNative", "()[I", (void*)com_taobao_android_dexposed_DexposedBridge_getCoverageCountsNative},
+    {"syncCoverageNative", "()V", (void*)com_taobao_android_dexposed_DexposedBridge_syncCoverageNative},
+    {"startPerfMapNative", "(Ljava/lang/String;)Z", (void*)com_taobao_android_dexposed_DexposedBridge_startPerfMapNative},
+    {"replaceWithConstantNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IJ)Z", (void*)com_taobao_android_dexposed_DexposedBridge_replaceWithConstantNative},
+    {"hookJniFunctionNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IJ)Z", (void*)com_taobao_android_dexposed_DexposedBridge_hookJniFunctionNative},
+    {"unhookJniFunctionNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_unhookJniFunctionNative},
+    {"openStatsFileNative", "(Ljava/lang/String;I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_openStatsFileNative},
+    {"setStatsNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IZLjava/lang/String;)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setStatsNative},
+    {"removeHookNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_removeHookNative},
+    {"reclaimRemovedHooksNative", "()I", (void*)com_taobao_android_dexposed_DexposedBridge_reclaimRemovedHooksNative},
+    {"getHookMemoryUsageNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)[I", (void*)com_taobao_android_dexposed_DexposedBridge_getHookMemoryUsageNative},
+    {"getMemoryUsageNative", "()[I", (void*)com_taobao_android_dexposed_DexposedBridge_getMemoryUsageNative},
+    {"setMemoizationNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;III)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setMemoizationNative},
+    {"invalidateMemoizationNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_invalidateMemoizationNative},
+    {"getMemoizationStatsNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I)[I", (void*)com_taobao_android_dexposed_DexposedBridge_getMemoizationStatsNative},
+    {"setCallerProfileNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setCallerProfileNative},
+    {"getTopCallersNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;I[I)[Ljava/lang/String;", (void*)com_taobao_android_dexposed_DexposedBridge_getTopCallersNative},
+    {"startStackSamplingNative", "(I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_startStackSamplingNative},
+    {"setStackSamplingNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setStackSamplingNative},
+    {"dumpStackSamplesNative", "(Ljava/lang/String;)I", (void*)com_taobao_android_dexposed_DexposedBridge_dumpStackSamplesNative},
+    {"getStackSamplingStatsNative", "()[I", (void*)com_taobao_android_dexposed_DexposedBridge_getStackSamplingStatsNative},
+    {"startAllocationProfilingNative", "(I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_startAllocationProfilingNative},
+    {"setAllocationSamplingNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setAllocationSamplingNative},
+    {"dumpAllocationsNative", "(Ljava/lang/String;)I", (void*)com_taobao_android_dexposed_DexposedBridge_dumpAllocationsNative},
+    {"getAllocationProfilingStatsNative", "()[I", (void*)com_taobao_android_dexposed_DexposedBridge_getAllocationProfilingStatsNative},
+    {"setHookGroupNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;II)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setHookGroupNative},
+    {"setHookGroupEnabledNative", "(IZ)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setHookGroupEnabledNative},
+    {"setTracingNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IZLjava/lang/String;)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setTracingNative},
+    {"bootstrapNative", "()Z", (void*)com_taobao_android_dexposed_DexposedBridge_bootstrapNative},
+    {"getBootstrapTimingsNative", "()[J", (void*)com_taobao_android_dexposed_DexposedBridge_getBootstrapTimingsNative},
+    {"startSystraceNative", "()Z", (void*)com_taobao_android_dexposed_DexposedBridge_startSystraceNative},
+    {"setSystraceNative", "(Ljava/lang/reflect/Member;Ljava/lang/Class;IZLjava/lang/String;)Z", (void*)com_taobao_android_dexposed_DexposedBridge_setSystraceNative},
+    {"openTraceFileNative", "(Ljava/lang/String;I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_openTraceFileNative},
+    {"syncTraceFileNative", "()V", (void*)com_taobao_android_dexposed_DexposedBridge_syncTraceFileNative},
+    {"startAsyncHooksNative", "(I)Z", (void*)com_taobao_android_dexposed_DexposedBridge_startAsyncHooksNative},
+    {"takeAsyncCallNative", "()[Ljava/lang/Object;", (void*)com_taobao_android_dexposed_DexposedBridge_takeAsyncCallNative},
+    {"setAsyncOverflowPolicyNative", "(I)V", (void*)com_taobao_android_dexposed_DexposedBridge_setAsyncOverflowPolicyNative},
+    {"getAsyncStatsNative", "()[I", (void*)com_taobao_android_dexposed_DexposedBridge_getAsyncStatsNative},
 };
 
 static int register_com_taobao_android_dexposed_DexposedBridge(JNIEnv* env) {
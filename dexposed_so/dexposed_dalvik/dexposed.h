@@ -35,6 +35,25 @@ extern "C" {
 #endif
 #endif
 
+#include "dexposed_hook_control.h"
+#include "dexposed_async.h"
+#include "dexposed_trace.h"
+#include "dexposed_patch_set.h"
+#include "dexposed_memo.h"
+#include "dexposed_callers.h"
+#include "dexposed_stacks.h"
+#include "dexposed_allocations.h"
+#include "dexposed_systrace.h"
+#include "dexposed_perf_map.h"
+#include "dexposed_jni_hook.h"
+#include "dexposed_bootstrap.h"
+#include "dexposed_code_patch.h"
+#include "dexposed_coverage.h"
+#include "dexposed_stats.h"
+#include "dexposed_publish.h"
+#include "dexposed_method_table.h"
+#include "dexposed_memory.h"
+
 namespace android {
 
 #define DEXPOSED_CLASS "com/taobao/android/dexposed/DexposedBridge"
@@ -56,6 +75,13 @@ namespace android {
 #endif
 
 
+// a method implemented like the VM's internal natives, it runs without a JNI transition
+struct DexposedInternalNative {
+    const char* name;
+    const char* signature;
+    DalvikBridgeFunc func;
+};
+
 struct DexposedHookInfo {
     struct {
         Method originalMethod;
@@ -66,6 +92,20 @@ struct DexposedHookInfo {
 
     Object* reflectedMethod;
     Object* additionalInfo;
+    // the global references keeping the two objects above alive
+    jobject reflectedMethodRef;
+    jobject additionalInfoRef;
+    DexposedHookControl control;
+};
+
+// the data of a method counted by coverage, see dexposed_coverage.h
+struct DexposedCoverageSite {
+    struct {
+        Method originalMethod;
+        int dummyForRomExtensions[4];
+    } originalMethodStruct;
+
+    volatile uint32_t* counter;
 };
 
 // called directoy by app_process
@@ -78,16 +118,109 @@ static inline void dexposedSetObjectArrayElement(const ArrayObject* obj, int ind
 
 // handling hooked methods / helpers
 static void dexposedCallHandler(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static void dexposedRecordCaller(DexposedCallerTable* table, const u4* fp);
+static void dexposedSampleStack(DexposedStackFrame* frames, const u4* fp);
+static void dexposedRecordAllocation(const Method* constructor, const u4* fp);
+static Object* dexposedGetDispatchAdditionalInfo(DexposedHookInfo* hookInfo, ::Thread* self, bool* patched);
+static void dexposedRouteCall(const u4* args, JValue* pResult, const Method* method, DexposedHookInfo* hookInfo, ::Thread* self);
+static void dexposedHandleCall(const u4* args, JValue* pResult, const Method* method, DexposedHookInfo* hookInfo, ::Thread* self,
+            bool dispatch);
+static void dexposedDispatchCall(const u4* args, JValue* pResult, const Method* method, DexposedHookInfo* hookInfo, ::Thread* self,
+            bool dispatch);
+static void dexposedMemoizedCall(const u4* args, JValue* pResult, const Method* method, DexposedHookInfo* hookInfo, ::Thread* self);
+static void dexposedTraceCall(const u4* args, JValue* pResult, const Method* method, DexposedHookInfo* hookInfo, ::Thread* self,
+            bool dispatch);
+static void dexposedInvokeOriginal(const u4* args, JValue* pResult, const Method* original, ::Thread* self);
+static void dexposedCoverageHandler(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static void dexposedConstantHandler(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static bool dexposedPatchMethod(Method* method, DalvikBridgeFunc func, void* data);
+static void dexposedUnpatchMethod(Method* method, const Method* original);
+static bool dexposedCopyMethod(void* copy, const Method* method, size_t size);
+static void dexposedFreeHookInfo(DexposedHookControl* control, JNIEnv* env);
+static void dexposedRecordDispatchCost(DexposedHookInfo* hookInfo, const Method* method,
+        const DexposedCallbackClock* clock, DexposedThreadState* clockState, JValue* pResult, ::Thread* self);
+static void dexposedNotifyHookBudgetExceeded(DexposedHookInfo* hookInfo, const Method* method,
+        JValue* pResult, ::Thread* self);
+static ArrayObject* dexposedCaptureAsyncCall(DexposedAsyncQueue* queue, DexposedHookInfo* hookInfo,
+            const Method* method, const u4* args, ::Thread* self, DexposedAsyncCall** callOut);
+static void dexposedSubmitAsyncCall(DexposedAsyncQueue* queue, ArrayObject* refs, DexposedAsyncCall* call,
+            const JValue* pResult, ::Thread* self);
 static jobject dexposedAddLocalReference(::Thread* self, Object* obj);
-static void replaceAsm(uintptr_t function, unsigned const char* newCode, size_t len);
-static void patchReturnTrue(uintptr_t function);
+static bool patchReturnTrue(DexposedCodePatchTransaction* transaction, uintptr_t function);
 static inline bool dexposedIsHooked(const Method* method);
+static inline bool dexposedIsJniMethod(const Method* method);
+static inline DexposedHookInfo* dexposedGetHookInfo(const Method* method);
+static DexposedHookInfo* dexposedAcquireHookInfo(jobject declaredClassIndirect, jint slot);
+static size_t dexposedWriteClassName(const ClassObject* clazz, char* name, size_t size);
 
 // JNI methods
 static void com_taobao_android_dexposed_DexposedBridge_hookMethodNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
             jobject declaredClassIndirect, jint slot, jobject additionalInfoIndirect);
 static void com_taobao_android_dexposed_DexposedBridge_invokeOriginalMethodNative(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
 static void com_taobao_android_dexposed_DexposedBridge_invokeSuperNative(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static bool dexposedRegisterFieldAccessors(JNIEnv* env);
+static jlong com_taobao_android_dexposed_DexposedBridge_resolveFieldNative(JNIEnv* env, jclass clazz, jobject fieldIndirect);
+static void com_taobao_android_dexposed_DexposedBridge_getFieldIntNative(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static void com_taobao_android_dexposed_DexposedBridge_setFieldIntNative(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static void com_taobao_android_dexposed_DexposedBridge_getFieldLongNative(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static void com_taobao_android_dexposed_DexposedBridge_setFieldLongNative(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static void com_taobao_android_dexposed_DexposedBridge_getFieldObjectNative(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static void com_taobao_android_dexposed_DexposedBridge_setFieldObjectNative(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setSamplingRateNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint rate);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setDispatchModeNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint mode);
+static jint com_taobao_android_dexposed_DexposedBridge_publishPatchSetNative(JNIEnv* env, jclass clazz, jobjectArray reflectedMethods,
+            jobjectArray declaredClasses, jintArray slots, jobjectArray additionalInfos);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setNestedPolicyNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint policy);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setThreadFilterNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint filter, jintArray tidsArray);
+static void com_taobao_android_dexposed_DexposedBridge_setThreadOptInNative(JNIEnv* env, jclass clazz, jboolean optIn);
+static jint com_taobao_android_dexposed_DexposedBridge_coverMethodNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jstring name);
+static jboolean com_taobao_android_dexposed_DexposedBridge_replaceWithConstantNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jlong bits);
+static jboolean com_taobao_android_dexposed_DexposedBridge_hookJniFunctionNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jlong hook);
+static jboolean com_taobao_android_dexposed_DexposedBridge_unhookJniFunctionNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setStatsNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jboolean enabled, jstring name);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setMemoizationNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint capacity, jint maxAgeMs);
+static jboolean com_taobao_android_dexposed_DexposedBridge_invalidateMemoizationNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot);
+static jintArray com_taobao_android_dexposed_DexposedBridge_getMemoizationStatsNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setCallerProfileNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint capacity);
+static jobjectArray com_taobao_android_dexposed_DexposedBridge_getTopCallersNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jintArray counts);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setStackSamplingNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint rate);
+static jint com_taobao_android_dexposed_DexposedBridge_dumpStackSamplesNative(JNIEnv* env, jclass clazz, jstring path);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setAllocationSamplingNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint rate);
+static jint com_taobao_android_dexposed_DexposedBridge_dumpAllocationsNative(JNIEnv* env, jclass clazz, jstring path);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setHookGroupNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint group);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setHookGroupEnabledNative(JNIEnv* env, jclass clazz, jint group, jboolean enabled);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setTracingNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jboolean enabled, jstring name);
+static jboolean com_taobao_android_dexposed_DexposedBridge_bootstrapNative(JNIEnv* env, jclass clazz);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setSystraceNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jboolean enabled, jstring name);
+static jboolean com_taobao_android_dexposed_DexposedBridge_setBudgetNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot, jint windowMs, jint maxUs, jint maxCalls, jint rearmPolicy, jint cooldownMs);
+static jboolean com_taobao_android_dexposed_DexposedBridge_rearmBudgetNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot);
+
+static jboolean com_taobao_android_dexposed_DexposedBridge_removeHookNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot);
+static jint com_taobao_android_dexposed_DexposedBridge_reclaimRemovedHooksNative(JNIEnv* env, jclass clazz);
+static jintArray com_taobao_android_dexposed_DexposedBridge_getHookMemoryUsageNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
+            jobject declaredClassIndirect, jint slot);
 
 static int register_com_taobao_android_dexposed_DexposedBridge(JNIEnv* env);
 }
@@ -0,0 +1,46 @@
+LOCAL_PATH:= $(call my-dir)
+
+# host tools reading the files written by libdexposed, they only depend on the
+# file formats in dexposed_common
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	dexposed_trace_decoder.cpp
+
+LOCAL_CFLAGS += -Wall
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../dexposed_common
+
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := dexposed_trace_decoder
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	dexposed_coverage_decoder.cpp
+
+LOCAL_CFLAGS += -Wall
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../dexposed_common
+
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := dexposed_coverage_decoder
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	dexposed_stats_reader.cpp
+
+LOCAL_CFLAGS += -Wall
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../dexposed_common
+
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := dexposed_stats_reader
+
+include $(BUILD_HOST_EXECUTABLE)
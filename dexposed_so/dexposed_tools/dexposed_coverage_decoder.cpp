@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Prints the call counts in a coverage file written by
+ * DexposedBridge.startCoverage(), most called methods first.
+ *
+ *   dexposed_coverage_decoder [--csv] [--uncalled] <coverage file>
+ *
+ * --uncalled only prints the methods which were never called.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "dexposed_coverage_format.h"
+
+struct Method {
+    uint32_t id;
+    uint32_t count;
+    const char* name;
+};
+
+static bool byCount(const Method& a, const Method& b) {
+    if (a.count != b.count)
+        return a.count > b.count;
+    return a.id < b.id;
+}
+
+int main(int argc, char** argv) {
+    bool csv = false;
+    bool uncalled = false;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0)
+            csv = true;
+        else if (strcmp(argv[i], "--uncalled") == 0)
+            uncalled = true;
+        else
+            path = argv[i];
+    }
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [--csv] [--uncalled] <coverage file>\n", argv[0]);
+        return 2;
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = (char*) malloc(size > 0 ? size : 1);
+    if (data == NULL || size < (long) sizeof(DexposedCoverageHeader) || fread(data, 1, size, file) != (size_t) size) {
+        fprintf(stderr, "%s: could not read the coverage file\n", path);
+        return 1;
+    }
+    fclose(file);
+
+    const DexposedCoverageHeader* header = (const DexposedCoverageHeader*) data;
+    if (memcmp(header->magic, DEXPOSED_COVERAGE_MAGIC, sizeof(DEXPOSED_COVERAGE_MAGIC)) != 0
+            || header->version != DEXPOSED_COVERAGE_VERSION
+            || header->nameSize != sizeof(DexposedCoverageName)) {
+        fprintf(stderr, "%s: not a coverage file of version %d\n", path, DEXPOSED_COVERAGE_VERSION);
+        return 1;
+    }
+    if ((size_t) size < header->namesOffset + (size_t) header->capacity * header->nameSize
+            || header->countersOffset + (size_t) header->capacity * sizeof(uint32_t) > header->namesOffset) {
+        fprintf(stderr, "%s: the coverage file is truncated\n", path);
+        return 1;
+    }
+
+    const uint32_t* counters = (const uint32_t*) (data + header->countersOffset);
+    DexposedCoverageName* names = (DexposedCoverageName*) (data + header->namesOffset);
+    uint32_t count = std::min((uint32_t) header->count, header->capacity);
+
+    std::vector<Method> methods;
+    uint32_t called = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        // skip ids whose name was being written
+        if (names[i].name[0] == '\0')
+            continue;
+        names[i].name[sizeof(names[i].name) - 1] = '\0';
+        if (counters[i] != 0)
+            called++;
+        if (!uncalled || counters[i] == 0) {
+            Method method = { i, counters[i], names[i].name };
+            methods.push_back(method);
+        }
+    }
+    std::sort(methods.begin(), methods.end(), byCount);
+
+    if (csv)
+        printf("coverage_id,count,method\n");
+    else
+        printf("pid %u, %u of %u methods called\n", header->pid, called, count);
+
+    for (size_t i = 0; i < methods.size(); i++) {
+        if (csv)
+            printf("%u,%u,\"%s\"\n", methods[i].id, methods[i].count, methods[i].name);
+        else
+            printf("%10u  %s\n", methods[i].count, methods[i].name);
+    }
+
+    free(data);
+    return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Prints the per hook counters of a stats file written by
+ * DexposedBridge.openStatsFile().
+ *
+ *   dexposed_stats_reader [--csv] [--histogram] [--interval <seconds>] <stats file>
+ *
+ * The file is mapped and read with the seqlock protocol of
+ * dexposed_stats_format.h, so it can be read while the app is writing it,
+ * or after it was pulled from the device. With --interval the counters
+ * are printed again every few seconds until the reader is killed.
+ */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dexposed_stats_format.h"
+
+// gives up on a slot which is being written all the time, e.g. by a writer which died holding it
+static const int kMaxReadAttempts = 1000;
+
+static bool readSlot(const DexposedStatsSlot* slot, DexposedStatsSlot* copy) {
+    for (int attempt = 0; attempt < kMaxReadAttempts; attempt++) {
+        uint32_t before = slot->sequence;
+        __sync_synchronize();
+        memcpy(copy, (const void*) slot, sizeof(DexposedStatsSlot));
+        __sync_synchronize();
+        if ((before & 1) == 0 && slot->sequence == before)
+            return true;
+        sched_yield();
+    }
+    return false;
+}
+
+// upper bound of the bucket which holds the given fraction of the calls, at most the slowest call
+static uint64_t percentileNs(const DexposedStatsSlot* slot, double fraction) {
+    uint64_t target = (uint64_t) (slot->calls * fraction);
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < DEXPOSED_STATS_BUCKETS - 1; i++) {
+        seen += slot->histogram[i];
+        uint64_t bound = 1ULL << (DEXPOSED_STATS_FIRST_BUCKET_SHIFT + i);
+        if (seen > target)
+            return bound < slot->maxNs ? bound : slot->maxNs;
+    }
+    return slot->maxNs;
+}
+
+static void printSlots(const DexposedStatsHeader* header, const DexposedStatsSlot* slots, bool csv, bool histogram) {
+    uint32_t count = header->slotCount < header->slotCapacity ? header->slotCount : header->slotCapacity;
+    if (csv) {
+        printf("hook_id,method,calls,exceptions,total_ns,max_ns,p50_ns,p90_ns,p99_ns");
+        if (histogram) {
+            for (uint32_t i = 0; i < DEXPOSED_STATS_BUCKETS; i++)
+                printf(",lt_%llu_ns", 1ULL << (DEXPOSED_STATS_FIRST_BUCKET_SHIFT + i));
+        }
+        printf("\n");
+    } else {
+        printf("pid %u, %u hooks\n", header->pid, count);
+        printf("%10s %8s %10s %10s %10s %10s  %s\n", "calls", "threw", "mean_us", "p50_us", "p99_us", "max_us", "method");
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        DexposedStatsSlot slot;
+        if (slots[i].hookId == 0)
+            continue;
+        if (!readSlot(&slots[i], &slot)) {
+            fprintf(stderr, "hook %u: slot is being written, skipped\n", slots[i].hookId);
+            continue;
+        }
+        slot.name[sizeof(slot.name) - 1] = '\0';
+
+        if (csv) {
+            printf("%u,%s,%u,%u,%llu,%u,%llu,%llu,%llu", slot.hookId, slot.name, slot.calls, slot.exceptions,
+                    (unsigned long long) slot.totalNs, slot.maxNs,
+                    (unsigned long long) percentileNs(&slot, 0.5), (unsigned long long) percentileNs(&slot, 0.9),
+                    (unsigned long long) percentileNs(&slot, 0.99));
+            if (histogram) {
+                for (uint32_t b = 0; b < DEXPOSED_STATS_BUCKETS; b++)
+                    printf(",%u", slot.histogram[b]);
+            }
+            printf("\n");
+            continue;
+        }
+
+        double meanUs = slot.calls != 0 ? slot.totalNs / 1000.0 / slot.calls : 0;
+        printf("%10u %8u %10.1f %10.1f %10.1f %10.1f  %s\n", slot.calls, slot.exceptions, meanUs,
+                percentileNs(&slot, 0.5) / 1000.0, percentileNs(&slot, 0.99) / 1000.0, slot.maxNs / 1000.0, slot.name);
+        if (histogram) {
+            for (uint32_t b = 0; b < DEXPOSED_STATS_BUCKETS; b++) {
+                if (slot.histogram[b] != 0)
+                    printf("%30s < %llu us: %u\n", "", (1ULL << (DEXPOSED_STATS_FIRST_BUCKET_SHIFT + b)) / 1000,
+                            slot.histogram[b]);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    bool csv = false;
+    bool histogram = false;
+    int interval = 0;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0)
+            csv = true;
+        else if (strcmp(argv[i], "--histogram") == 0)
+            histogram = true;
+        else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+            interval = atoi(argv[++i]);
+        else
+            path = argv[i];
+    }
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [--csv] [--histogram] [--interval <seconds>] <stats file>\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(DexposedStatsHeader)) {
+        fprintf(stderr, "%s: could not read the stats file\n", path);
+        return 1;
+    }
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror(path);
+        return 1;
+    }
+
+    const DexposedStatsHeader* header = (const DexposedStatsHeader*) mapping;
+    if (memcmp(header->magic, DEXPOSED_STATS_MAGIC, sizeof(DEXPOSED_STATS_MAGIC)) != 0
+            || header->version != DEXPOSED_STATS_VERSION
+            || header->slotSize != sizeof(DexposedStatsSlot)
+            || header->bucketCount != DEXPOSED_STATS_BUCKETS
+            || header->firstBucketShift != DEXPOSED_STATS_FIRST_BUCKET_SHIFT) {
+        fprintf(stderr, "%s: not a stats file of version %d\n", path, DEXPOSED_STATS_VERSION);
+        return 1;
+    }
+    if ((size_t) st.st_size < header->slotsOffset + (size_t) header->slotCapacity * header->slotSize) {
+        fprintf(stderr, "%s: the stats file is truncated\n", path);
+        return 1;
+    }
+
+    const DexposedStatsSlot* slots = (const DexposedStatsSlot*) ((const char*) mapping + header->slotsOffset);
+    for (;;) {
+        printSlots(header, slots, csv, histogram);
+        if (interval <= 0)
+            break;
+        fflush(stdout);
+        sleep(interval);
+        printf("\n");
+    }
+
+    munmap(mapping, st.st_size);
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2015, Alibaba Mobile Infrastructure (Android) Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Prints the calls recorded in a trace file written by
+ * DexposedBridge.setHookTracing(), oldest first.
+ *
+ *   dexposed_trace_decoder [--csv] <trace file>
+ *
+ * Pull the file from the device first, e.g. with "adb pull".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "dexposed_trace_format.h"
+
+static const DexposedTraceHook* findHook(const DexposedTraceHook* hooks, uint32_t count, uint32_t hookId) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (hooks[i].hookId == hookId)
+            return &hooks[i];
+    }
+    return NULL;
+}
+
+static bool bySequence(const DexposedTraceRecord* a, const DexposedTraceRecord* b) {
+    // sequences wrap around, compare their distance instead of their values
+    return (int32_t) (a->sequence - b->sequence) < 0;
+}
+
+static void formatValue(char* out, size_t size, char type, uint64_t value) {
+    union { uint32_t bits; float value; } f;
+    union { uint64_t bits; double value; } d;
+    switch (type) {
+    case 'V':
+        snprintf(out, size, "void");
+        break;
+    case 'Z':
+        snprintf(out, size, "%s", (uint32_t) value != 0 ? "true" : "false");
+        break;
+    case 'B':
+        snprintf(out, size, "%d", (int8_t) value);
+        break;
+    case 'S':
+        snprintf(out, size, "%d", (int16_t) value);
+        break;
+    case 'C':
+        if ((uint16_t) value >= 0x20 && (uint16_t) value < 0x7f && (uint16_t) value != '\'')
+            snprintf(out, size, "'%c'", (char) value);
+        else
+            snprintf(out, size, "'\\u%04x'", (uint16_t) value);
+        break;
+    case 'I':
+        snprintf(out, size, "%d", (int32_t) value);
+        break;
+    case 'J':
+        snprintf(out, size, "%lld", (long long) value);
+        break;
+    case 'F':
+        f.bits = (uint32_t) value;
+        snprintf(out, size, "%g", f.value);
+        break;
+    case 'D':
+        d.bits = value;
+        snprintf(out, size, "%g", d.value);
+        break;
+    case 'L':
+    case '[':
+        if ((uint32_t) value == 0)
+            snprintf(out, size, "null");
+        else
+            snprintf(out, size, "@%08x", (uint32_t) value);
+        break;
+    default:
+        snprintf(out, size, "?%llx", (unsigned long long) value);
+    }
+}
+
+static void printRecord(const DexposedTraceHeader* header, const DexposedTraceHook* hook,
+        const DexposedTraceRecord* record, bool csv) {
+    const char* shorty = hook != NULL ? hook->shorty : "";
+    size_t shortyLen = strlen(shorty);
+    char value[64];
+
+    uint64_t wallClockUs = header->wallClockBaseMs * 1000
+            + (int64_t) (record->timestampNs - header->monotonicBaseNs) / 1000;
+    bool exception = (record->flags & DEXPOSED_TRACE_FLAG_EXCEPTION) != 0;
+
+    if (csv) {
+        printf("%u,%llu.%03llu,%u,%u,%s,", record->sequence - 1,
+                (unsigned long long) (wallClockUs / 1000), (unsigned long long) (wallClockUs % 1000),
+                record->tid, record->hookId, hook != NULL ? hook->name : "");
+        if (record->thisHash != 0)
+            printf("@%08x", record->thisHash);
+        printf(",%u", record->argCount);
+        for (uint32_t i = 0; i < DEXPOSED_TRACE_MAX_ARGS; i++) {
+            value[0] = '\0';
+            if (i < record->argCount && i + 1 < shortyLen)
+                formatValue(value, sizeof(value), shorty[i + 1], record->args[i]);
+            printf(",%s", value);
+        }
+        formatValue(value, sizeof(value), exception ? 'L' : (shortyLen > 0 ? shorty[0] : '?'), record->result);
+        printf(",%s,%d,%u\n", value, exception ? 1 : 0, record->durationNs);
+        return;
+    }
+
+    printf("+%.6f tid=%u ", (int64_t) (record->timestampNs - header->monotonicBaseNs) / 1e9, record->tid);
+    if (hook != NULL)
+        printf("%s(", hook->name);
+    else
+        printf("hook#%u(", record->hookId);
+    if (record->thisHash != 0)
+        printf("this=@%08x%s", record->thisHash, record->argCount > 0 ? ", " : "");
+    for (uint32_t i = 0; i < record->argCount; i++) {
+        if (i >= DEXPOSED_TRACE_MAX_ARGS || i + 1 >= shortyLen) {
+            printf("...");
+            break;
+        }
+        formatValue(value, sizeof(value), shorty[i + 1], record->args[i]);
+        printf("%s%s", value, i + 1 < record->argCount ? ", " : "");
+    }
+    if (exception) {
+        formatValue(value, sizeof(value), 'L', record->result);
+        printf(") threw %s", value);
+    } else {
+        formatValue(value, sizeof(value), shortyLen > 0 ? shorty[0] : '?', record->result);
+        printf(") = %s", value);
+    }
+    printf("  [%u ns]\n", record->durationNs);
+}
+
+int main(int argc, char** argv) {
+    bool csv = false;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0)
+            csv = true;
+        else
+            path = argv[i];
+    }
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [--csv] <trace file>\n", argv[0]);
+        return 2;
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = (char*) malloc(size > 0 ? size : 1);
+    if (data == NULL || size < (long) sizeof(DexposedTraceHeader) || fread(data, 1, size, file) != (size_t) size) {
+        fprintf(stderr, "%s: could not read the trace file\n", path);
+        return 1;
+    }
+    fclose(file);
+
+    const DexposedTraceHeader* header = (const DexposedTraceHeader*) data;
+    if (memcmp(header->magic, DEXPOSED_TRACE_MAGIC, sizeof(DEXPOSED_TRACE_MAGIC)) != 0
+            || header->version != DEXPOSED_TRACE_VERSION
+            || header->recordSize != sizeof(DexposedTraceRecord)) {
+        fprintf(stderr, "%s: not a trace file of version %d\n", path, DEXPOSED_TRACE_VERSION);
+        return 1;
+    }
+    if ((size_t) size < header->recordsOffset + (size_t) header->recordCapacity * header->recordSize
+            || header->headerSize + (size_t) header->hookCapacity * sizeof(DexposedTraceHook) > header->recordsOffset) {
+        fprintf(stderr, "%s: the trace file is truncated\n", path);
+        return 1;
+    }
+
+    const DexposedTraceHook* hooks = (const DexposedTraceHook*) (data + header->headerSize);
+    uint32_t hookCount = std::min((uint32_t) header->hookCount, header->hookCapacity);
+    const DexposedTraceRecord* records = (const DexposedTraceRecord*) (data + header->recordsOffset);
+    uint32_t mask = header->recordCapacity - 1;
+
+    std::vector<const DexposedTraceRecord*> valid;
+    for (uint32_t i = 0; i < header->recordCapacity; i++) {
+        // skip empty slots and records which were being written
+        if (records[i].sequence != 0 && ((records[i].sequence - 1) & mask) == i)
+            valid.push_back(&records[i]);
+    }
+    std::sort(valid.begin(), valid.end(), bySequence);
+
+    if (csv)
+        printf("sequence,time_ms,tid,hook_id,method,this,arg_count,arg0,arg1,arg2,arg3,arg4,result,exception,duration_ns\n");
+    else
+        printf("pid %u, %zu of %u calls\n", header->pid, valid.size(), header->writeCount);
+
+    for (size_t i = 0; i < valid.size(); i++)
+        printRecord(header, findHook(hooks, hookCount, valid[i]->hookId), valid[i], csv);
+
+    free(data);
+    return 0;
+}